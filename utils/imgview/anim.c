@@ -0,0 +1,244 @@
+//
+// NekoInk Image Viewer
+// Copyright 2024 Wenting Zhang
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+// 
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+//
+// File : anim.c
+// Brief: Animated image playback
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <assert.h>
+#include <time.h>
+#include <pthread.h>
+#include "config.h"
+#include "disp.h"
+#include "anim.h"
+#include "power.h"
+#include "stb_image.h"
+
+// Frames are decoded by stb_image as a whole, then scaled to the screen by a
+// worker thread a few frames ahead of the one being displayed. The main thread
+// only renders the difference to the previous frame and sends the update.
+struct Anim {
+    uint8_t *data; // All decoded frames
+    int *delays; // In ms
+    int width;
+    int height;
+    int channels;
+    int frames;
+    Canvas *slots[ANIM_PREFETCH_FRAMES];
+    Canvas *frame; // Scratch canvas holding the frame being scaled
+    int produced; // Total frames scaled
+    int consumed; // Total frames taken for display
+    bool stop;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    uint32_t next_time;
+    uint32_t marker; // Update of the last frame still in flight, or 0
+};
+
+static uint32_t anim_get_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static int anim_get_delay(Anim *anim, int seq) {
+    int delay = anim->delays[seq % anim->frames];
+    // Follow what browsers do for very short delays
+    if (delay < 20)
+        delay = ANIM_DEFAULT_DELAY_MS;
+    return delay;
+}
+
+static void *anim_worker(void *arg) {
+    Anim *anim = arg;
+    size_t frame_size = anim->width * anim->height * anim->channels;
+
+    pthread_mutex_lock(&anim->lock);
+    while (!anim->stop) {
+        if (anim->produced - anim->consumed >= ANIM_PREFETCH_FRAMES) {
+            pthread_cond_wait(&anim->cond, &anim->lock);
+            continue;
+        }
+        int seq = anim->produced;
+        Canvas *slot = anim->slots[seq % ANIM_PREFETCH_FRAMES];
+        pthread_mutex_unlock(&anim->lock);
+
+        memcpy(anim->frame->buf, anim->data + (seq % anim->frames) * frame_size,
+                frame_size);
+        // Letterbox area is not touched by scaling
+        memset(slot->buf, 0xff, slot->width * slot->height * anim->channels);
+        disp_scale_image_fit(anim->frame, slot);
+
+        pthread_mutex_lock(&anim->lock);
+        anim->produced++;
+        pthread_cond_broadcast(&anim->cond);
+    }
+    pthread_mutex_unlock(&anim->lock);
+    return NULL;
+}
+
+// Load an animated image. Returns NULL if the file isn't an animation, in which
+// case it should be displayed as a still image.
+Anim *anim_load(char *filename, Canvas *target) {
+    FILE *fp = fopen(filename, "rb");
+    if (!fp)
+        return NULL;
+    fseek(fp, 0, SEEK_END);
+    long size = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+    uint8_t *file = malloc(size);
+    assert(file);
+    if (fread(file, size, 1, fp) != 1) {
+        free(file);
+        fclose(fp);
+        return NULL;
+    }
+    fclose(fp);
+
+#ifdef ENABLE_COLOR
+    int channels = 3;
+    PixelFormat fmt = PIXFMT_RGB888;
+#else
+    int channels = 1;
+    PixelFormat fmt = PIXFMT_Y8;
+#endif
+    assert(target->pixelFormat == fmt);
+
+    int *delays = NULL;
+    int x, y, z, n;
+    uint8_t *data = stbi_load_gif_from_memory(file, size, &delays, &x, &y, &z,
+            &n, channels);
+    free(file);
+    if (!data)
+        return NULL;
+    if (z < 2) {
+        stbi_image_free(data);
+        free(delays);
+        return NULL;
+    }
+    printf("Animation: %d x %d, %d frames\n", x, y, z);
+
+    Anim *anim = calloc(1, sizeof(Anim));
+    assert(anim);
+    anim->data = data;
+    anim->delays = delays;
+    anim->width = x;
+    anim->height = y;
+    anim->channels = channels;
+    anim->frames = z;
+    anim->frame = disp_create(x, y, fmt);
+    // Frames are diffed against the screen, slots take its actual size
+    int width, height;
+    disp_get_size(&width, &height);
+    for (int i = 0; i < ANIM_PREFETCH_FRAMES; i++)
+        anim->slots[i] = disp_create(width, height, fmt);
+    anim->next_time = anim_get_ms();
+    pthread_mutex_init(&anim->lock, NULL);
+    pthread_cond_init(&anim->cond, NULL);
+    pthread_create(&anim->thread, NULL, anim_worker, anim);
+    return anim;
+}
+
+void anim_free(Anim *anim) {
+    pthread_mutex_lock(&anim->lock);
+    anim->stop = true;
+    pthread_cond_broadcast(&anim->cond);
+    pthread_mutex_unlock(&anim->lock);
+    pthread_join(anim->thread, NULL);
+    pthread_mutex_destroy(&anim->lock);
+    pthread_cond_destroy(&anim->cond);
+    for (int i = 0; i < ANIM_PREFETCH_FRAMES; i++)
+        disp_free(anim->slots[i]);
+    disp_free(anim->frame);
+    stbi_image_free(anim->data);
+    free(anim->delays);
+    free(anim);
+}
+
+// Display the next frame if it is due. Returns the time in ms until the next
+// call is needed, or -1 until the previous frame has completed on the screen.
+int anim_step(Anim *anim) {
+    if (anim->marker) {
+        if (!disp_update_done(anim->marker))
+            return -1;
+        anim->marker = 0;
+    }
+
+    uint32_t now = anim_get_ms();
+    int32_t wait = (int32_t)(anim->next_time - now);
+    if (wait > 0)
+        return wait;
+
+    pthread_mutex_lock(&anim->lock);
+    while (anim->produced == anim->consumed)
+        pthread_cond_wait(&anim->cond, &anim->lock);
+    // When the panel can't keep up, drop frames already overdue to keep
+    // playing at the intended speed, as long as a later one is ready
+    while ((anim->produced - anim->consumed > 1) &&
+            ((int32_t)(now - anim->next_time) >=
+            anim_get_delay(anim, anim->consumed))) {
+        anim->next_time += anim_get_delay(anim, anim->consumed);
+        anim->consumed++;
+    }
+    int seq = anim->consumed;
+    Canvas *slot = anim->slots[seq % ANIM_PREFETCH_FRAMES];
+    pthread_mutex_unlock(&anim->lock);
+
+    Rect rects[ANIM_MAX_RECTS];
+    int count = disp_filtering_frame(slot, rects, ANIM_MAX_RECTS);
+
+    pthread_mutex_lock(&anim->lock);
+    anim->consumed++;
+    pthread_cond_broadcast(&anim->cond);
+    pthread_mutex_unlock(&anim->lock);
+
+    // Only wait for the last update, which paces playback to what the panel
+    // could achieve. If completion is notified, the wait is left to the event
+    // loop instead of blocking here.
+    bool notified = (disp_get_complete_fd() >= 0);
+#ifdef ENABLE_POWER_POLICY
+    if (count > 0)
+        power_note_update();
+#endif
+    for (int i = 0; i < count; i++) {
+        bool last = (i == count - 1);
+        uint32_t marker = disp_present(rects[i], ANIM_WAVEFORM, true,
+                last && !notified);
+        if (last && notified)
+            anim->marker = marker;
+    }
+
+    anim->next_time += anim_get_delay(anim, seq);
+    now = anim_get_ms();
+    wait = (int32_t)(anim->next_time - now);
+    if (wait < -1000) {
+        // Too far behind to catch up by dropping frames, restart timing
+        anim->next_time = now;
+        wait = 0;
+    }
+    return (wait > 0) ? wait : 0;
+}
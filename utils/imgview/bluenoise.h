@@ -1,5 +1,6 @@
 
-#ifdef DITHERING_BLUE_NOISE
+#if defined(DITHERING_BLUE_NOISE) || defined(ENABLE_ANIMATION) || \
+        defined(ENABLE_CLASSIFY)
 #ifdef ENABLE_COLOR
 int8_t noise_map[120][40] = {
     {14, 98, -98, 31, -24, 89, 6, 45, -75, 62, -32, 40, -68, 108, -82, -12, 122, -92, -41, 81, -116, -10, -73, 89, 21, -64, -88, 54, 126, -4, 65, -110, 121, -38, 41, -60, -79, -124, 36, -63, },
@@ -0,0 +1,107 @@
+//
+// NekoInk Image Viewer
+// Copyright 2024 Wenting Zhang
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+// 
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+//
+// File : classify.c
+// Brief: Content classification of screen tiles
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <assert.h>
+#include "config.h"
+#include "disp.h"
+#include "classify.h"
+
+// Tiles are classified from a few statistics of their luma: how many pixels
+// are neither dark nor light, how many grey levels are in use, and how many
+// neighbouring pixels differ sharply.
+
+static void classify_luma_row(Canvas *src, int x, int y, int w, uint8_t *row) {
+    if (src->pixelFormat == PIXFMT_Y8) {
+        memcpy(row, &src->buf[y * src->width + x], w);
+        return;
+    }
+    assert(src->pixelFormat == PIXFMT_RGB888);
+    uint8_t *rdptr = &src->buf[(y * src->width + x) * 3];
+    for (int i = 0; i < w; i++) {
+        row[i] = disp_luma(rdptr[0], rdptr[1], rdptr[2]);
+        rdptr += 3;
+    }
+}
+
+TileClass classify_tile(Canvas *src, Rect rect) {
+    uint8_t row[CLASSIFY_TILE_SIZE];
+    uint8_t prev[CLASSIFY_TILE_SIZE];
+    uint32_t hist[16] = {0};
+    uint32_t mid = 0;
+    uint32_t edges = 0;
+
+    assert(rect.w <= CLASSIFY_TILE_SIZE);
+    for (int y = 0; y < rect.h; y++) {
+        classify_luma_row(src, rect.x, rect.y + y, rect.w, row);
+        for (int x = 0; x < rect.w; x++) {
+            hist[row[x] >> 4]++;
+            mid += (uint8_t)(row[x] - CLASSIFY_DARK) <
+                    (CLASSIFY_LIGHT - CLASSIFY_DARK);
+        }
+        for (int x = 1; x < rect.w; x++)
+            edges += abs(row[x] - row[x - 1]) > CLASSIFY_EDGE;
+        if (y > 0) {
+            for (int x = 0; x < rect.w; x++)
+                edges += abs(row[x] - prev[x]) > CLASSIFY_EDGE;
+        }
+        memcpy(prev, row, rect.w);
+    }
+
+    uint32_t total = rect.w * rect.h;
+    // Almost everything black or white, either text or blank
+    if (mid * 100 <= total * CLASSIFY_TEXT_MID_PERCENT)
+        return TILE_TEXT;
+
+    int levels = 0;
+    for (int i = 0; i < 16; i++)
+        levels += (hist[i] * 100 > total);
+    if ((levels <= CLASSIFY_FLAT_LEVELS) &&
+            (edges * 100 <= total * CLASSIFY_FLAT_EDGE_PERCENT))
+        return TILE_FLAT;
+
+    return TILE_PHOTO;
+}
+
+// Classify every tile of the image, classes is tiles_x * tiles_y in size
+void classify_tiles(Canvas *src, uint8_t *classes, int tiles_x, int tiles_y) {
+    for (int ty = 0; ty < tiles_y; ty++) {
+        for (int tx = 0; tx < tiles_x; tx++) {
+            Rect rect = {
+                tx * CLASSIFY_TILE_SIZE, ty * CLASSIFY_TILE_SIZE,
+                CLASSIFY_TILE_SIZE, CLASSIFY_TILE_SIZE
+            };
+            if (rect.x + rect.w > src->width)
+                rect.w = src->width - rect.x;
+            if (rect.y + rect.h > src->height)
+                rect.h = src->height - rect.y;
+            classes[ty * tiles_x + tx] = classify_tile(src, rect);
+        }
+    }
+}
@@ -0,0 +1,175 @@
+//
+// NekoInk Image Viewer
+// Copyright 2024 Wenting Zhang
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+// 
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+//
+// File : client.c
+// Brief: Client library for drawing through the display daemon
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "config.h"
+#include "disp.h"
+#include "client.h"
+
+struct Client {
+    int fd;
+    ClientCanvas canvas;
+    size_t size;
+};
+
+static const char *mode_names[] = {
+    [WVMD_INIT] = "init",
+    [WVMD_DU] = "du",
+    [WVMD_GC16] = "gc16",
+    [WVMD_GC4] = "gc4",
+    [WVMD_A2] = "a2"
+};
+
+// Send a command line and read back the single line reply, without newline
+static int client_request(Client *client, const char *cmd, char *reply,
+        int size) {
+    int len = snprintf(reply, size, "%s\n", cmd);
+    if ((len >= size) ||
+            (send(client->fd, reply, len, MSG_NOSIGNAL) != len))
+        return -1;
+
+    len = 0;
+    while ((len == 0) || (reply[len - 1] != '\n')) {
+        if (len == size - 1)
+            return -1;
+        int count = read(client->fd, &reply[len], size - 1 - len);
+        if (count <= 0)
+            return -1;
+        len += count;
+    }
+    reply[len - 1] = '\0';
+    return 0;
+}
+
+// Connect to the daemon and map its screen canvas, returns NULL on failure
+Client *client_open(void) {
+    Client *client = calloc(1, sizeof(Client));
+    if (!client)
+        return NULL;
+
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    strncpy(addr.sun_path, SERVER_SOCKET_PATH, sizeof(addr.sun_path) - 1);
+    client->fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if ((client->fd < 0) ||
+            (connect(client->fd, (struct sockaddr *)&addr, sizeof(addr)) < 0)) {
+        fprintf(stderr, "Failed to connect to %s\n", SERVER_SOCKET_PATH);
+        goto fail;
+    }
+
+    // Shared memory only holds the pixels
+    char reply[SERVER_LINE_MAX];
+    int fmt;
+    if ((client_request(client, "info", reply, sizeof(reply)) < 0) ||
+            (sscanf(reply, "OK %d %d %d", &client->canvas.width,
+                &client->canvas.height, &fmt) != 3)) {
+        fprintf(stderr, "Failed to get canvas info\n");
+        goto fail;
+    }
+    // The daemon uses one of these, disp.c isn't part of the client library
+    if ((fmt != PIXFMT_Y8) && (fmt != PIXFMT_RGB888)) {
+        fprintf(stderr, "Unsupported canvas format %d\n", fmt);
+        goto fail;
+    }
+    client->canvas.pixelFormat = (PixelFormat)fmt;
+    size_t size = (size_t)client->canvas.width * client->canvas.height *
+            ((fmt == PIXFMT_RGB888) ? 3 : 1);
+
+    int shm_fd = shm_open(SERVER_SHM_NAME, O_RDWR, 0);
+    if (shm_fd < 0) {
+        fprintf(stderr, "Failed to open shared memory %s\n", SERVER_SHM_NAME);
+        goto fail;
+    }
+    struct stat st;
+    if ((fstat(shm_fd, &st) < 0) || ((size_t)st.st_size != size)) {
+        fprintf(stderr, "Unexpected shared memory size\n");
+        close(shm_fd);
+        goto fail;
+    }
+    client->canvas.buf = mmap(NULL, size, PROT_READ | PROT_WRITE,
+            MAP_SHARED, shm_fd, 0);
+    close(shm_fd);
+    if (client->canvas.buf == MAP_FAILED) {
+        fprintf(stderr, "Failed to map shared memory\n");
+        client->canvas.buf = NULL;
+        goto fail;
+    }
+    client->size = size;
+    return client;
+
+fail:
+    client_close(client);
+    return NULL;
+}
+
+void client_close(Client *client) {
+    if (client->canvas.buf)
+        munmap(client->canvas.buf, client->size);
+    if (client->fd >= 0)
+        close(client->fd);
+    free(client);
+}
+
+ClientCanvas *client_get_canvas(Client *client) {
+    return &client->canvas;
+}
+
+// Send a single command line (without newline) and wait for the reply.
+// Returns 0 if the daemon replied OK, -1 otherwise.
+int client_command(Client *client, const char *cmd) {
+    char buf[SERVER_LINE_MAX];
+    if (client_request(client, cmd, buf, sizeof(buf)) < 0)
+        return -1;
+    if (strcmp(buf, "OK") != 0) {
+        fprintf(stderr, "imgview: %s\n", buf);
+        return -1;
+    }
+    return 0;
+}
+
+// Update the region of the screen from the shared canvas
+int client_damage(Client *client, Rect rect, WaveformMode mode) {
+    char cmd[64];
+    snprintf(cmd, sizeof(cmd), "damage %d %d %d %d %s", rect.x, rect.y,
+            rect.w, rect.h, mode_names[mode]);
+    return client_command(client, cmd);
+}
+
+// Positive dy moves the content up, the canvas should hold the scrolled
+// content with the newly exposed rows drawn
+int client_scroll(Client *client, int dy, WaveformMode mode) {
+    char cmd[64];
+    snprintf(cmd, sizeof(cmd), "scroll %d %s", dy, mode_names[mode]);
+    return client_command(client, cmd);
+}
@@ -0,0 +1,54 @@
+//
+// NekoInk Image Viewer
+// Copyright 2024 Wenting Zhang
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+// 
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+//
+// File : client.h
+// Brief: Client library for drawing through the display daemon
+//
+#pragma once
+
+// Client library for drawing on the screen owned by imgview running in daemon
+// mode. Build client.c into the application, or link libimgview_client.a.
+//
+//   Client *client = client_open();
+//   ClientCanvas *canvas = client_get_canvas(client);
+//   ... draw into canvas->buf, in canvas->pixelFormat (Y8 or RGB888) ...
+//   client_damage(client, rect, WVMD_GC16);
+//   client_close(client);
+//
+// The daemon copies the region out of the shared canvas before processing it,
+// it may be drawn into again once client_damage returns.
+
+typedef struct Client Client;
+
+typedef struct {
+    int width;
+    int height;
+    PixelFormat pixelFormat;
+    uint8_t *buf; // Shared with the daemon, rows without padding
+} ClientCanvas;
+
+Client *client_open(void);
+void client_close(Client *client);
+ClientCanvas *client_get_canvas(Client *client);
+int client_command(Client *client, const char *cmd);
+int client_damage(Client *client, Rect rect, WaveformMode mode);
+int client_scroll(Client *client, int dy, WaveformMode mode);
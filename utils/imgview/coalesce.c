@@ -0,0 +1,158 @@
+//
+// NekoInk Image Viewer
+// Copyright 2024 Wenting Zhang
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+// 
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+//
+// File : coalesce.c
+// Brief: Merge bursts of small updates
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+#include "config.h"
+#include "disp.h"
+#include "coalesce.h"
+
+// Small updates arriving close together are held for up to the latency
+// budget, then merged into as few updates as worth it. Merging two regions
+// costs the pixels driven needlessly by covering their union, plus the area
+// moved to a slower waveform. Each update saved is worth COALESCE_UPDATE_COST
+// pixels. The merged region takes the higher priority mode, so pixels are
+// never driven by a weaker waveform than requested.
+typedef struct {
+    Rect rect;
+    WaveformMode mode;
+    bool partial;
+} PendingUpdate;
+
+static PendingUpdate pending[COALESCE_MAX_PENDING];
+static int pending_count;
+static uint32_t deadline;
+
+static uint32_t coalesce_get_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// Higher priority modes can stand in for lower ones
+static int coalesce_priority(WaveformMode mode) {
+    switch (mode) {
+    case WVMD_INIT: return 4;
+    case WVMD_GC16: return 3;
+    case WVMD_GC4: return 2;
+    case WVMD_DU: return 1;
+    default: return 0;
+    }
+}
+
+static int64_t coalesce_area(Rect rect) {
+    return (int64_t)rect.w * rect.h;
+}
+
+static int64_t coalesce_overlap(Rect a, Rect b) {
+    int x0 = (a.x > b.x) ? a.x : b.x;
+    int y0 = (a.y > b.y) ? a.y : b.y;
+    int x1 = (a.x + a.w < b.x + b.w) ? (a.x + a.w) : (b.x + b.w);
+    int y1 = (a.y + a.h < b.y + b.h) ? (a.y + a.h) : (b.y + b.h);
+    if ((x1 <= x0) || (y1 <= y0))
+        return 0;
+    return (int64_t)(x1 - x0) * (y1 - y0);
+}
+
+static int64_t coalesce_cost(PendingUpdate *a, PendingUpdate *b) {
+    Rect u = disp_union_rect(a->rect, b->rect);
+    int64_t cost = coalesce_area(u) - coalesce_area(a->rect) -
+            coalesce_area(b->rect) + coalesce_overlap(a->rect, b->rect);
+    int pa = coalesce_priority(a->mode);
+    int pb = coalesce_priority(b->mode);
+    if (pa > pb)
+        cost += coalesce_area(b->rect) - coalesce_overlap(a->rect, b->rect);
+    else if (pb > pa)
+        cost += coalesce_area(a->rect) - coalesce_overlap(a->rect, b->rect);
+    return cost;
+}
+
+// Merge the cheapest pair if it costs less than max_cost, returns false if
+// nothing was merged
+static bool coalesce_merge_cheapest(int64_t max_cost) {
+    int best_a = -1, best_b = -1;
+    int64_t best_cost = INT64_MAX;
+    for (int a = 0; a < pending_count; a++) {
+        for (int b = a + 1; b < pending_count; b++) {
+            int64_t cost = coalesce_cost(&pending[a], &pending[b]);
+            if (cost < best_cost) {
+                best_cost = cost;
+                best_a = a;
+                best_b = b;
+            }
+        }
+    }
+    if ((best_a < 0) || (best_cost > max_cost))
+        return false;
+
+    PendingUpdate *a = &pending[best_a];
+    PendingUpdate *b = &pending[best_b];
+    a->rect = disp_union_rect(a->rect, b->rect);
+    if (coalesce_priority(b->mode) > coalesce_priority(a->mode))
+        a->mode = b->mode;
+    a->partial = a->partial && b->partial;
+    pending[best_b] = pending[--pending_count];
+    return true;
+}
+
+// Queue an update, sent once the latency budget of the oldest pending update
+// runs out
+void coalesce_add(Rect rect, WaveformMode mode, bool partial) {
+    if ((rect.w == 0) && (rect.h == 0))
+        disp_get_size(&rect.w, &rect.h);
+    if (pending_count == COALESCE_MAX_PENDING)
+        coalesce_merge_cheapest(INT64_MAX);
+    if (pending_count == 0)
+        deadline = coalesce_get_ms() + COALESCE_BUDGET_MS;
+    pending[pending_count].rect = rect;
+    pending[pending_count].mode = mode;
+    pending[pending_count].partial = partial;
+    pending_count++;
+}
+
+// Send everything pending now
+void coalesce_flush(void) {
+    while (coalesce_merge_cheapest(COALESCE_UPDATE_COST))
+        ;
+    for (int i = 0; i < pending_count; i++)
+        disp_present(pending[i].rect, pending[i].mode, pending[i].partial,
+                false);
+    pending_count = 0;
+}
+
+// Returns the time in ms until the next step is due, or -1 if nothing is
+// pending
+int coalesce_step(void) {
+    if (pending_count == 0)
+        return -1;
+    int32_t remaining = (int32_t)(deadline - coalesce_get_ms());
+    if (remaining > 0)
+        return remaining;
+    coalesce_flush();
+    return -1;
+}
@@ -10,6 +10,8 @@
 // Target resolution
 #if defined(BUILD_PC_SIM)
 #define TITLE "IMGVIEW"
+// SDL events can't be waited on along with other fds, they are checked at
+// this rate
 #define TARGET_FPS (30)
 #define DISP_WIDTH (1448)
 #define DISP_HEIGHT (1072)
@@ -22,12 +24,32 @@
 
 #define ENABLE_COLOR
 
+// Colour pigment screens (ACeP/ Spectra), each pixel shows one of the palette
+// colours. Needs ENABLE_COLOR for RGB input, replaces the CFA processing.
+// ENABLE_CLASSIFY and ENABLE_WAVEFORM_SIM don't support it and are turned off.
+//#define ACEP_COLOR
+// Nearest palette colour table has 2^(3*bits) cells
+#define PALETTE_LUT_BITS (5)
+// Kept out of /tmp, the table is only used after checking it
+#define PALETTE_CACHE_FILE "/var/cache/imgview_palette.lut"
+#if defined(ACEP_COLOR) && !defined(ENABLE_COLOR)
+#error "ACEP_COLOR requires ENABLE_COLOR"
+#endif
+
 #ifdef ENABLE_COLOR
 // Options only applies if COLOR is enabled
 //#define ENABLE_LPF // Enable LPF to avoid jagged edges
 //#define ENABLE_BRIGHTEN // Copy component to neighbor pixels, only valid on SIM
 #endif
 
+// Tone adjustments, folded into a lookup table applied while sampling
+#define TONE_BRIGHTNESS (0.0f)
+#define TONE_CONTRAST (1.0f)
+#define TONE_GAMMA (1.0f)
+#define TONE_AUTO_LEVELS
+// Fraction of pixels clipped at each end when finding levels automatically
+#define TONE_AUTO_LEVELS_CLIP (0.005f)
+
 #define DEPTH_1BPP // monochrome
 //#define DEPTH_2BPP // 4 grey / 64 color
 //#define DEPTH_4BPP // 16 grey / 4096 color
@@ -45,3 +67,147 @@
     #define DITHERING_ERRBUF_LINES (2)
 #endif
 #define DITHERING_GAMMA_AWARE
+// Extra pixels re-dithered around a changed region for the diffused error to
+// settle back into the existing pattern
+#define DITHERING_INCREMENTAL_MARGIN (16)
+
+// Pen input
+#define STROKE_WIDTH (3)
+// Ink collected within the interval is sent as a single update
+#define STROKE_UPDATE_INTERVAL_MS (10)
+#define STROKE_WAVEFORM (WVMD_A2)
+
+// Animation playback
+#define ENABLE_ANIMATION
+// Frames decoded and scaled ahead of the one being displayed
+#define ANIM_PREFETCH_FRAMES (4)
+// Delay used for frames not specifying one, or an unreasonably short one
+#define ANIM_DEFAULT_DELAY_MS (100)
+// Granularity of changed region detection between frames
+#define ANIM_BAND_LINES (32)
+#define ANIM_MAX_RECTS (8)
+#define ANIM_WAVEFORM (WVMD_A2)
+
+// Pick quantization and waveform per tile by content, for mixed pages
+#define ENABLE_CLASSIFY
+#define CLASSIFY_TILE_SIZE (32)
+// Levels between these count as neither dark nor light
+#define CLASSIFY_DARK (32)
+#define CLASSIFY_LIGHT (224)
+// Text tiles have at most this many percent of such pixels
+#define CLASSIFY_TEXT_MID_PERCENT (10)
+// Flat tiles use at most this many of 16 level bins, with few sharp edges
+#define CLASSIFY_FLAT_LEVELS (4)
+#define CLASSIFY_FLAT_EDGE_PERCENT (5)
+// Difference between neighbouring pixels counting as an edge
+#define CLASSIFY_EDGE (64)
+#define CLASSIFY_MAX_RECTS (16)
+#define CLASSIFY_TEXT_WAVEFORM (WVMD_DU)
+// DU only drives to black or white, use GC16 with flat greys above 1bpp
+#define CLASSIFY_FLAT_WAVEFORM (WVMD_DU)
+#define CLASSIFY_PHOTO_WAVEFORM (WVMD_GC16)
+#ifdef ACEP_COLOR
+#undef ENABLE_CLASSIFY
+#endif
+
+// Clear ghosting left by fast (DU/ A2) updates, per tile of the screen
+#define ENABLE_REFRESH_SCHEDULER
+#define REFRESH_TILE_SIZE (64)
+// Fast updates on a tile before it is cleared once the screen is idle
+#define REFRESH_THRESHOLD (20)
+// Fast updates on a tile before it is cleared even if not idle
+#define REFRESH_FORCE_THRESHOLD (100)
+#define REFRESH_IDLE_MS (2000)
+#define REFRESH_MAX_RECTS (8)
+#define REFRESH_WAVEFORM (WVMD_GC16)
+
+// Hold small updates for up to the budget and merge them into fewer updates
+#define ENABLE_COALESCE
+#define COALESCE_BUDGET_MS (20)
+// Area in pixels an extra update is worth, pairs of updates are merged while
+// the area driven needlessly by merging them is smaller
+#define COALESCE_UPDATE_COST (128 * 128)
+#define COALESCE_MAX_PENDING (32)
+
+// Keep panel power on between updates while they come in quickly, saving
+// the power up time on each. Longer delays and a lower rate to trigger them
+// trade idle power for latency.
+#define ENABLE_POWER_POLICY
+// Updates within the window considered interaction
+#define POWER_BURST_UPDATES (3)
+#define POWER_BURST_WINDOW_MS (1000)
+// Power down delay used during interaction
+#define POWER_BURST_DELAY_MS (500)
+// Time without updates before the delay is dropped back to 0
+#define POWER_IDLE_MS (3000)
+
+// Render into spare pages of the virtual framebuffer so queued updates never
+// see pixels changing under them
+#define ENABLE_DOUBLE_BUFFER
+#define FB_MAX_PAGES (3)
+
+// Save the screen on exit and restore it on start instead of an INIT flash.
+// Assumes the panel kept the image while off, which nothing can confirm, so
+// it's off by default.
+//#define ENABLE_SNAPSHOT
+#define SNAPSHOT_FILE "/var/cache/imgview.snapshot"
+// Part of the snapshot validity check, a different waveform invalidates it
+#define SNAPSHOT_WAVEFORM_FILE "/lib/firmware/imx/epdc/epdc_E060SCM.fw"
+// Used to bring the EPDC state in line with the panel on start. DU only
+// drives black and white, greys need GC16.
+#ifdef DEPTH_1BPP
+#define SNAPSHOT_SYNC_WAVEFORM (WVMD_DU)
+#else
+#define SNAPSHOT_SYNC_WAVEFORM (WVMD_GC16)
+#endif
+
+// Show updates on SIM the way the panel would, frame by frame as driven by
+// the waveform, instead of instantly
+#define ENABLE_WAVEFORM_SIM
+// EPDC firmware (.fw), E Ink waveform (.wbf), or descriptor (.iwf) written by
+// the waveform dump tools with its CSV tables next to it. WFSIM_WAVEFORM in
+// the environment overrides.
+#define WFSIM_WAVEFORM_FILE "../../waveform/gdew101_gd/test_desc.iwf"
+// EPDC version the .fw file is built for, 1 or 2
+#define WFSIM_FW_VERSION (1)
+// Panel temperature in Celsius, selects the tables used
+#define WFSIM_TEMP (25)
+#define WFSIM_FRAME_RATE (85)
+// Updates driven at the same time, each needs a LUT on the EPDC
+#define WFSIM_MAX_LUTS (16)
+#define WFSIM_QUEUE_SIZE (64)
+// Reflectance change for every frame a pixel is driven, out of 255
+#define WFSIM_DRIVE_STEP (32)
+#ifdef ACEP_COLOR
+#undef ENABLE_WAVEFORM_SIM
+#endif
+
+// Record every display update for latency analysis
+#define ENABLE_STATS
+#define STATS_RING_SIZE (1024)
+// Threads waiting on update completion, bounds updates timed in parallel
+#define STATS_WAIT_THREADS (4)
+// CSV, or JSON if named *.json, written on exit
+#define STATS_LOG_FILE "/tmp/imgview_updates.csv"
+// Touch to photon latency of pen input, matched to the updates showing it
+#define STATS_INTERACTION_RING_SIZE (256)
+#define STATS_INTERACTION_LOG_FILE "/tmp/imgview_latency.csv"
+// Panel temperature in millidegree Celsius, comment out if not available
+#define STATS_TEMP_FILE "/sys/class/hwmon/hwmon0/temp1_input"
+
+// Event loop, input devices, timer, daemon sockets and update completion
+#define LOOP_MAX_FDS (SERVER_MAX_CLIENTS + 8)
+
+// Daemon mode
+#define SERVER_SOCKET_PATH "/tmp/imgview.sock"
+#define SERVER_SHM_NAME "/imgview_canvas"
+// Access to the shared canvas. Clients have to run as the daemon user, or be
+// in the group if one is set, along with a mode of 0660.
+#define SERVER_SHM_MODE (0600)
+//#define SERVER_SHM_GROUP "video"
+// Where the stats and latency commands write logs
+#define SERVER_EXPORT_DIR "/var/log/imgview"
+#define SERVER_MAX_CLIENTS (4)
+#define SERVER_LINE_MAX (512)
+// Changed regions reported by a scroll, merged beyond this
+#define SERVER_SCROLL_MAX_RECTS (8)
@@ -30,15 +30,21 @@
 #include <math.h>
 #include <assert.h>
 #include <string.h>
+#include <limits.h>
+#include <pthread.h>
 #include "config.h"
 #include "disp.h"
 #include "bluenoise.h"
+#include "stats.h"
+#include "refresh.h"
+#include "classify.h"
 #include "stb_image_resize.h"
 #include "stb_image.h"
 
 #if defined(BUILD_PC_SIM)
 // Use SDL on PC SIM
 #include <SDL.h>
+#include "wfsim.h"
 #elif defined(BUILD_NEKOINK)
 // Use FBDEV on NekoInk 1st gen
 #include <sys/types.h>
@@ -48,24 +54,50 @@
 #include <unistd.h>
 #include <linux/mxcfb.h>
 #include <sys/mman.h>
+#include <sys/eventfd.h>
 #endif
 
 #if defined(BUILD_PC_SIM)
 static SDL_Window *window;
 static SDL_Renderer *renderer;
 static SDL_Texture *texture;
+#ifdef ENABLE_WAVEFORM_SIM
+// Screen pixels go to the simulated frame buffer, the window shows the panel
+static bool wfsim_ready;
+#endif
 #elif defined(BUILD_NEKOINK)
-uint32_t marker_value = 0;
 int fd_fbdev;
 int fb_virtual_x;
 size_t fb_size;
 struct fb_var_screeninfo var_screeninfo;
 uint8_t *fbdev_fb;
+#ifdef ENABLE_DOUBLE_BUFFER
+// Each update reads from its own page of the virtual framebuffer through the
+// EPDC alternate buffer, so pixels never change under a queued update. A page
+// is only rewritten once the update reading it has been submitted.
+static int fb_pages; // 0 if not enough virtual space for double buffering
+static int fb_page; // Page for the next update
+static uint32_t fb_page_marker[FB_MAX_PAGES];
+// Marker only taken to know when the page is free, nobody else waits on it
+static bool fb_page_reap[FB_MAX_PAGES];
+static unsigned long fb_phys_addr;
+#endif
+#endif
+
+#if defined(BUILD_NEKOINK) && \
+        (defined(ENABLE_STATS) || defined(ENABLE_DOUBLE_BUFFER))
+// Threads wait on markers the caller doesn't, the driver only frees a marker
+// once it has been waited on
+#define DISP_MARKER_THREADS
 #endif
 
 static Canvas *screen;
+static uint32_t marker_value = 0;
 
-static int disp_get_bpp(PixelFormat fmt) {
+#define MIN(a, b) (((a) < (b)) ? (a) : (b))
+#define MAX(a, b) (((a) > (b)) ? (a) : (b))
+
+int disp_get_bpp(PixelFormat fmt) {
     switch(fmt) {
     case PIXFMT_Y1_PACKED:
         return 1;
@@ -187,7 +219,7 @@ uint32_t disp_conv_pix(PixelFormat dst, PixelFormat src, uint32_t color) {
         assert(0);
     }
 
-    y = (uint8_t)(r * 0.312f + g * 0.563f + b * 0.125f);
+    y = disp_luma(r, g, b);
     uint32_t target = 0;
     switch (dst) {
     case PIXFMT_Y1_LSB:
@@ -368,6 +400,98 @@ static uint8_t linear_to_srgb(uint16_t val) {
 #endif
 }
 
+static uint8_t clamp8(int32_t val) {
+    if (val > 255) return 255;
+    if (val < 0) return 0;
+    return val;
+}
+
+static int32_t clamp8s(int32_t val) {
+    if (val < -128) return -128;
+    if (val > 127) return 127;
+    return val;
+}
+
+static uint16_t clamp16(int32_t val) {
+    if (val > 65535) return 65535;
+    if (val < 0) return 0;
+    return val;
+}
+
+static int32_t clamp16s(int32_t val) {
+    if (val < -32768) return -32768;
+    if (val > 32767) return 32767;
+    return val;
+}
+
+static uint8_t add_saturate(uint8_t a, int8_t b) {
+    int32_t val = (int32_t)a + (int32_t)b;
+    return clamp8(val);
+}
+
+// Tone curve and conversion into linear space folded into one lookup table
+// per channel, applied while sampling the image at no extra cost. The output
+// is what the dithering works on.
+static uint8_t tone_lut[3][256];
+
+static void disp_find_levels(uint32_t *bins, uint32_t count, int *black,
+        int *white) {
+    uint32_t clip = (uint32_t)(count * TONE_AUTO_LEVELS_CLIP);
+    uint32_t sum = 0;
+    int lo = 0;
+    while ((lo < 255) && ((sum += bins[lo]) <= clip))
+        lo++;
+    sum = 0;
+    int hi = 255;
+    while ((hi > 0) && ((sum += bins[hi]) <= clip))
+        hi--;
+    if (hi <= lo) {
+        // Flat image, nothing to stretch
+        lo = 0;
+        hi = 255;
+    }
+    *black = lo;
+    *white = hi;
+}
+
+void disp_set_tone(ToneParams *params, Histogram *hist) {
+    int black = params->black_point;
+    int white = params->white_point;
+    if (params->auto_levels && hist && hist->count) {
+#ifdef ENABLE_COLOR
+        // Channels share one pair of levels, stretching them separately
+        // would shift the white balance
+        black = 255;
+        white = 0;
+        for (int c = 0; c < 3; c++) {
+            int lo, hi;
+            disp_find_levels(hist->bins[c], hist->count, &lo, &hi);
+            black = MIN(black, lo);
+            white = MAX(white, hi);
+        }
+#else
+        // Only the luma is shown
+        disp_find_levels(hist->luma, hist->count, &black, &white);
+#endif
+    }
+    if (white <= black)
+        white = black + 1;
+    for (int i = 0; i < 256; i++) {
+        float x = (float)(i - black) / (float)(white - black);
+        if (x < 0.0f) x = 0.0f;
+        if (x > 1.0f) x = 1.0f;
+        if (params->gamma != 1.0f)
+            x = powf(x, 1.0f / params->gamma);
+        x = (x - 0.5f) * params->contrast + 0.5f + params->brightness;
+        int32_t val = clamp8((int32_t)(x * 255.0f + 0.5f));
+#ifdef DITHERING_GAMMA_AWARE
+        val = srgb_to_linear(val);
+#endif
+        for (int c = 0; c < 3; c++)
+            tone_lut[c][i] = val;
+    }
+}
+
 #ifdef DITHERING_ORDERED
 #ifdef ENABLE_COLOR
 int8_t dithering_bias = 10;
@@ -401,31 +525,16 @@ int8_t dithering_map[4][4] = {
 #endif
 #endif
 
-static uint8_t clamp8(int32_t val) {
-    if (val > 255) return 255;
-    if (val < 0) return 0;
-    return val;
-}
-
-static int32_t clamp8s(int32_t val) {
-    if (val < -128) return -128;
-    if (val > 127) return 127;
-    return val;
-}
-
-static uint16_t clamp16(int32_t val) {
-    if (val > 65535) return 65535;
-    if (val < 0) return 0;
-    return val;
-}
-
-static uint8_t add_saturate(uint8_t a, int8_t b) {
-    int32_t val = (int32_t)a + (int32_t)b;
-    return clamp8(val);
-}
-
 // xRGB32
-#ifdef DEPTH_1BPP
+#ifdef ACEP_COLOR
+// Approximate appearance of the pigments, should be tuned for the screen.
+// Black, white, green, blue, red, yellow, orange
+#define SRGB_COLOR_POINTS 7
+uint32_t srgb_color_points[SRGB_COLOR_POINTS] = {
+    0x00191b1e, 0x00e6e6e0, 0x003a6b3c, 0x00383f84,
+    0x00a8362f, 0x00d8c847, 0x00c96d33
+};
+#elif defined(DEPTH_1BPP)
 #define SRGB_COLOR_POINTS 2
 uint32_t srgb_color_points[SRGB_COLOR_POINTS] = {
     0x00000000, 0x00FFFFFF
@@ -445,145 +554,444 @@ uint32_t srgb_color_points[SRGB_COLOR_POINTS] = {
 };
 #endif
 
-// In-accurate/ correct distance calculation in linear RGB space
-static float calculate_distance(uint32_t c1, uint32_t c2) {
+static int32_t disp_to_linear(uint8_t val) {
+#ifdef DITHERING_GAMMA_AWARE
+    return srgb_to_linear(val);
+#else
+    return val;
+#endif
+}
+
+// Squared distance in linear RGB space
+static int32_t calculate_distance(uint32_t c1, uint32_t c2) {
 #ifdef ACEP_COLOR
-    int32_t r1 = srgb_to_linear((c1 >> 16) & 0xff);
-    int32_t g1 = srgb_to_linear((c1 >> 8) & 0xff);
-    int32_t b1 = srgb_to_linear(c1 & 0xff);
-    int32_t r2 = srgb_to_linear((c2 >> 16) & 0xff);
-    int32_t g2 = srgb_to_linear((c2 >> 8) & 0xff);
-    int32_t b2 = srgb_to_linear(c2 & 0xff);
-    float dist = sqrtf(
-        powf((float)abs(r1 - r2), 2.f) +
-        powf((float)abs(g1 - g2), 2.f) +
-        powf((float)abs(b1 - b2), 2.f));
-    return dist;
+    int32_t dr = disp_to_linear((c1 >> 16) & 0xff) -
+            disp_to_linear((c2 >> 16) & 0xff);
+    int32_t dg = disp_to_linear((c1 >> 8) & 0xff) -
+            disp_to_linear((c2 >> 8) & 0xff);
+    int32_t db = disp_to_linear(c1 & 0xff) - disp_to_linear(c2 & 0xff);
+    return dr * dr + dg * dg + db * db;
 #else
-    int32_t y1 = srgb_to_linear(c1 & 0xff);
-    int32_t y2 = srgb_to_linear(c2 & 0xff);
-    return (float)abs(y1 - y2);
+    int32_t dy = disp_to_linear(c1 & 0xff) - disp_to_linear(c2 & 0xff);
+    return dy * dy;
 #endif
 }
 
+#ifdef ACEP_COLOR
+// Nearest palette colour lookup. The linear RGB cube is split into cells, each
+// listing the palette entries that could be the nearest one somewhere inside
+// the cell, closest to the cell centre first. A pixel only needs to be
+// compared against these few candidates.
+#define PALETTE_LUT_SHIFT (8 - PALETTE_LUT_BITS)
+#define PALETTE_LUT_SIZE (1 << PALETTE_LUT_BITS)
+#define PALETTE_LUT_CELLS (PALETTE_LUT_SIZE * PALETTE_LUT_SIZE * PALETTE_LUT_SIZE)
+#define PALETTE_LUT_CANDIDATES (8)
+#define PALETTE_LUT_NONE (0xff)
+#define PALETTE_CACHE_MAGIC (0x4c544150) // PATL
+#define PALETTE_CACHE_VERSION (1)
+
+static int32_t palette_linear[SRGB_COLOR_POINTS][3];
+static uint8_t palette_lut[PALETTE_LUT_CELLS][PALETTE_LUT_CANDIDATES];
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t hash;
+} PaletteCacheHeader;
+
+// FNV-1a over everything the table depends on
+static uint32_t palette_hash(void) {
+    uint32_t hash = 2166136261u;
+    hash = (hash ^ PALETTE_LUT_BITS) * 16777619u;
+    hash = (hash ^ PALETTE_LUT_CANDIDATES) * 16777619u;
+    for (int i = 0; i < SRGB_COLOR_POINTS; i++)
+        for (int c = 0; c < 3; c++)
+            hash = (hash ^ (uint32_t)palette_linear[i][c]) * 16777619u;
+    return hash;
+}
+
+static void palette_build_lut(void) {
+    int cell = 1 << PALETTE_LUT_SHIFT;
+    for (int i = 0; i < PALETTE_LUT_CELLS; i++) {
+        int32_t lo[3], hi[3], center[3];
+        lo[0] = (i >> (PALETTE_LUT_BITS * 2)) * cell;
+        lo[1] = ((i >> PALETTE_LUT_BITS) & (PALETTE_LUT_SIZE - 1)) * cell;
+        lo[2] = (i & (PALETTE_LUT_SIZE - 1)) * cell;
+        for (int c = 0; c < 3; c++) {
+            hi[c] = lo[c] + cell - 1;
+            center[c] = lo[c] + cell / 2;
+        }
+
+        // Any point in the cell is at most this far from its nearest colour
+        int32_t bound = INT32_MAX;
+        for (int j = 0; j < SRGB_COLOR_POINTS; j++) {
+            int32_t dmax = 0;
+            for (int c = 0; c < 3; c++) {
+                int32_t d = MAX(abs(palette_linear[j][c] - lo[c]),
+                        abs(palette_linear[j][c] - hi[c]));
+                dmax += d * d;
+            }
+            bound = MIN(bound, dmax);
+        }
+
+        // So only colours closer than that to the cell are candidates
+        int32_t cand_dist[SRGB_COLOR_POINTS];
+        uint8_t cand[SRGB_COLOR_POINTS];
+        int count = 0;
+        for (int j = 0; j < SRGB_COLOR_POINTS; j++) {
+            int32_t dmin = 0, dcenter = 0;
+            for (int c = 0; c < 3; c++) {
+                int32_t v = palette_linear[j][c];
+                int32_t d = (v < lo[c]) ? (lo[c] - v) :
+                        (v > hi[c]) ? (v - hi[c]) : 0;
+                dmin += d * d;
+                dcenter += (v - center[c]) * (v - center[c]);
+            }
+            if (dmin > bound)
+                continue;
+            int k = count++;
+            while ((k > 0) && (cand_dist[k - 1] > dcenter)) {
+                cand_dist[k] = cand_dist[k - 1];
+                cand[k] = cand[k - 1];
+                k--;
+            }
+            cand_dist[k] = dcenter;
+            cand[k] = j;
+        }
+        for (int k = 0; k < PALETTE_LUT_CANDIDATES; k++)
+            palette_lut[i][k] = (k < count) ? cand[k] : PALETTE_LUT_NONE;
+    }
+}
+
+// A loaded table is used for indexing, so every entry has to be in range:
+// at least one candidate, and nothing but PALETTE_LUT_NONE after the last
+static bool palette_check_lut(void) {
+    for (int i = 0; i < PALETTE_LUT_CELLS; i++) {
+        if (palette_lut[i][0] >= SRGB_COLOR_POINTS)
+            return false;
+        bool end = false;
+        for (int k = 1; k < PALETTE_LUT_CANDIDATES; k++) {
+            uint8_t idx = palette_lut[i][k];
+            if (idx == PALETTE_LUT_NONE)
+                end = true;
+            else if (end || (idx >= SRGB_COLOR_POINTS))
+                return false;
+        }
+    }
+    return true;
+}
+
+// Build the lookup table for the palette, or load it from the cache file if
+// it was built for the same palette before
+static void palette_init(void) {
+    for (int i = 0; i < SRGB_COLOR_POINTS; i++) {
+        palette_linear[i][0] = disp_to_linear((srgb_color_points[i] >> 16) & 0xff);
+        palette_linear[i][1] = disp_to_linear((srgb_color_points[i] >> 8) & 0xff);
+        palette_linear[i][2] = disp_to_linear(srgb_color_points[i] & 0xff);
+    }
+
+    uint32_t hash = palette_hash();
+    PaletteCacheHeader header;
+    FILE *fp = fopen(PALETTE_CACHE_FILE, "rb");
+    if (fp) {
+        uint8_t extra;
+        bool valid = (fread(&header, sizeof(header), 1, fp) == 1) &&
+                (header.magic == PALETTE_CACHE_MAGIC) &&
+                (header.version == PALETTE_CACHE_VERSION) &&
+                (header.hash == hash) &&
+                (fread(palette_lut, sizeof(palette_lut), 1, fp) == 1) &&
+                (fread(&extra, 1, 1, fp) == 0) &&
+                palette_check_lut();
+        fclose(fp);
+        if (valid) {
+            printf("Palette LUT loaded from %s\n", PALETTE_CACHE_FILE);
+            return;
+        }
+    }
+
+    palette_build_lut();
+
+    fp = fopen(PALETTE_CACHE_FILE, "wb");
+    if (!fp) {
+        fprintf(stderr, "Failed to write palette LUT cache %s\n",
+                PALETTE_CACHE_FILE);
+        return;
+    }
+    header.magic = PALETTE_CACHE_MAGIC;
+    header.version = PALETTE_CACHE_VERSION;
+    header.hash = hash;
+    fwrite(&header, sizeof(header), 1, fp);
+    fwrite(palette_lut, sizeof(palette_lut), 1, fp);
+    fclose(fp);
+}
+
+// Input in linear space, 0-255 per channel
+static int palette_lookup(int32_t r, int32_t g, int32_t b) {
+    const uint8_t *cand = palette_lut[
+            ((r >> PALETTE_LUT_SHIFT) << (PALETTE_LUT_BITS * 2)) |
+            ((g >> PALETTE_LUT_SHIFT) << PALETTE_LUT_BITS) |
+            (b >> PALETTE_LUT_SHIFT)];
+    int best = cand[0];
+    if (cand[1] == PALETTE_LUT_NONE)
+        return best;
+    int32_t dmin = INT32_MAX;
+    for (int i = 0; (i < PALETTE_LUT_CANDIDATES) &&
+            (cand[i] != PALETTE_LUT_NONE); i++) {
+        int32_t dr = r - palette_linear[cand[i]][0];
+        int32_t dg = g - palette_linear[cand[i]][1];
+        int32_t db = b - palette_linear[cand[i]][2];
+        int32_t d = dr * dr + dg * dg + db * db;
+        if (d < dmin) {
+            dmin = d;
+            best = cand[i];
+        }
+    }
+    return best;
+}
+#endif
+
 static uint32_t pick_closest_color(uint32_t c) {
+#ifdef ACEP_COLOR
+    return srgb_color_points[palette_lookup(disp_to_linear((c >> 16) & 0xff),
+            disp_to_linear((c >> 8) & 0xff), disp_to_linear(c & 0xff))];
+#else
     uint32_t cc = srgb_color_points[0];
-    float dmin = calculate_distance(srgb_color_points[0], c);
+    int32_t dmin = calculate_distance(srgb_color_points[0], c);
     for (int i = 1; i < SRGB_COLOR_POINTS; i++) {
-        float d = calculate_distance(srgb_color_points[i], c);
+        int32_t d = calculate_distance(srgb_color_points[i], c);
         if (d < dmin) {
-            d = dmin;
+            dmin = d;
             cc = srgb_color_points[i];
         }
     }
     return cc;
+#endif
 }
 
-// Process image to be displayed on EPD
-void disp_filtering_image(Canvas *src, Rect src_rect, Rect dst_rect) {
-    uint8_t *src_raw = (uint8_t *)src->buf;
+#ifdef DITHERING_ERROR_DIFFUSION
+// One tap of the error diffusion kernel, the error pushed to the pixel at
+// (x + dx, y + dy) is (error * factor) >> 3
+typedef struct {
+    int8_t dx;
+    int8_t dy;
+    int8_t factor;
+} DiffusionTap;
+
+#ifdef ENABLE_COLOR
+// . . * . . 1
+// 2 . . 3 . .
+// . 4 . . 5 .
+// . . 6 . . .
+// Star is the pixel in question, the error is pushed to the pixels
+// labeled 1-6 (neighboring pixels in the same color).
+// 1.4-5, 1.7-3, 2.8-2, 3-2/1
+static const DiffusionTap diffusion_kernel[] = {
+    { 3, 0, 2}, // 1 D=3
+    {-2, 1, 3}, // 2 D=1.7
+    { 1, 1, 5}, // 3 D=1.4
+    {-1, 2, 3}, // 4 D=1.7
+    { 2, 2, 2}, // 5 D=2.8
+    { 0, 3, 1}, // 6 D=3
+};
+#else
+#if 1
+// Floyd-Steinberg
+// . * 1
+// 2 3 4
+// Star is the pixel in question, the error is pushed to the pixels
+// labeled 1-4
+static const DiffusionTap diffusion_kernel[] = {
+    { 1, 0, 7},
+    {-1, 1, 3},
+    { 0, 1, 5},
+    { 1, 1, 1},
+};
+#else
+// Two-Row Sierra
+static const DiffusionTap diffusion_kernel[] = {
+    { 1, 0, 4},
+    { 2, 0, 3},
+    {-2, 1, 1},
+    {-1, 1, 2},
+    { 0, 1, 3},
+    { 1, 1, 2},
+    { 2, 1, 1},
+};
+#endif
+#endif
+#define DIFFUSION_TAPS (sizeof(diffusion_kernel) / sizeof(*diffusion_kernel))
+
+// Quantization error left by every screen pixel at its last dithering pass.
+// Used to reconstruct the error flowing into a rectangle from its surrounding
+// pixels, so a small region could be re-dithered without visible seams.
+static int16_t *dither_err_map;
+#endif
+
 #if defined(BUILD_PC_SIM)
-    uint32_t *dst_raw = (uint32_t *)screen->buf;
+#define SCREEN_PIX(x, y) ((uint32_t *)screen->buf)[(y) * screen->width + (x)]
 #elif defined(BUILD_NEKOINK)
-    uint8_t *dst_raw = (uint8_t *)screen->buf;
+#define SCREEN_PIX(x, y) ((uint8_t *)screen->buf)[(y) * screen->width + (x)]
 #endif
-    uint32_t dst_w = screen->width;
-    uint32_t src_x = src_rect.x;
-    uint32_t src_y = src_rect.y;
-    uint32_t w = src_rect.w;
-    uint32_t h = src_rect.h;
-    uint32_t dst_x = dst_rect.x;
-    uint32_t dst_y = dst_rect.y;
-    if ((w == 0) && (h == 0)) {
-        w = src->width;
-        h = src->height;
-    }
 
-    int32_t eb_max = 0;
-    int32_t eb_min = 0;
+static Rect disp_clip_rect(Rect rect) {
+    if (rect.x < 0) { rect.w += rect.x; rect.x = 0; }
+    if (rect.y < 0) { rect.h += rect.y; rect.y = 0; }
+    if (rect.x + rect.w > screen->width) rect.w = screen->width - rect.x;
+    if (rect.y + rect.h > screen->height) rect.h = screen->height - rect.y;
+    if (rect.w < 0) rect.w = 0;
+    if (rect.h < 0) rect.h = 0;
+    return rect;
+}
+
+// Convert one source pixel into the 8bpp value of the screen pixel (dx, dy),
+// in linear space if DITHERING_GAMMA_AWARE
+static uint8_t disp_sample_pix(Canvas *src, int sx, int sy, int dx, int dy) {
+    uint8_t *src_raw = (uint8_t *)src->buf;
+    uint8_t pix;
+
+#define SRC_PIX(x, y, comp) src_raw[((y) * src->width + (x)) * 3 + comp]
 
 #ifdef ENABLE_COLOR
-    assert(src->pixelFormat == PIXFMT_RGB888);
+    uint32_t comp = get_panel_color_component(dx, dy);
+    pix = SRC_PIX(sx, sy, comp);
+    #ifdef ENABLE_LPF
+    // Low pass filtering to reduce the color/ jagged egdes
+    uint32_t pix_u = (sy == 0) ? pix : SRC_PIX(sx, sy - 1, comp);
+    uint32_t pix_d = (sy == (src->height - 1)) ? pix :
+            SRC_PIX(sx, sy + 1, comp);
+    uint32_t pix_l = (sx == 0) ? pix : SRC_PIX(sx - 1, sy, comp);
+    uint32_t pix_r = (sx == (src->width - 1)) ? pix :
+            SRC_PIX(sx + 1, sy, comp);
+    pix = pix >> 1; // /2
+    pix_u = pix_u >> 3; // /8
+    pix_d = pix_d >> 3;
+    pix_l = pix_l >> 3;
+    pix_r = pix_r >> 3;
+    pix = pix + pix_u + pix_d + pix_l + pix_r;
+    #endif
+    pix = tone_lut[comp][pix];
 #else
-    assert(src->pixelFormat == PIXFMT_Y8);
+    pix = tone_lut[0][src_raw[sy * src->width + sx]];
 #endif
 
-#ifdef DITHERING_ERROR_DIFFUSION
-    int32_t *err_buf = malloc(w * DITHERING_ERRBUF_LINES * sizeof(int32_t));
-    assert(err_buf);
-#endif
+#undef SRC_PIX
 
-#define SRC_PIX(x, y, comp) src_raw[((src_y + y) * w + src_x + x) * 3 + comp]
-#define DST_PIX(x, y) dst_raw[(dst_y + y) * dst_w + dst_x + x]
+    return pix;
+}
 
-    // Convert to 8bpp in target buffer
-    for (int y = 0; y < h; y++) {
-        for (int x = 0; x < w; x++) {
-            uint8_t pix;
+// Convert source pixels into 8bpp values in the screen buffer
+static void disp_sample_rect(Canvas *src, int src_x, int src_y, Rect dst) {
 #ifdef ENABLE_COLOR
-            uint32_t comp = get_panel_color_component(dst_x + x, dst_y + y);
-            pix = SRC_PIX(x, y, comp);
-    #ifdef ENABLE_LPF
-            // Low pass filtering to reduce the color/ jagged egdes
-            uint32_t pix_u = (y == 0) ? pix : SRC_PIX(x, y - 1, comp);
-            uint32_t pix_d = (y == (h - 1)) ? pix : SRC_PIX(x, y + 1, comp);
-            uint32_t pix_l = (x == 0) ? pix : SRC_PIX(x - 1, y, comp);
-            uint32_t pix_r = (x == (w - 1)) ? pix : SRC_PIX(x + 1, y, comp);
-            pix = pix >> 1; // /2
-            pix_u = pix_u >> 3; // /8
-            pix_d = pix_d >> 3;
-            pix_l = pix_l >> 3;
-            pix_r = pix_r >> 3;
-            pix = pix + pix_u + pix_d + pix_l + pix_r;
-    #endif
+    assert(src->pixelFormat == PIXFMT_RGB888);
 #else
-            pix = src_raw[(src_y + y) * w + src_x + x];
+    assert(src->pixelFormat == PIXFMT_Y8);
+#endif
+
+    for (int y = 0; y < dst.h; y++) {
+        for (int x = 0; x < dst.w; x++) {
+            SCREEN_PIX(dst.x + x, dst.y + y) = disp_sample_pix(src,
+                    src_x + x, src_y + y, dst.x + x, dst.y + y);
+        }
+    }
+}
+
+// Quantize the pixel down to the bpp required
+static int32_t disp_quantize_pix(int32_t pix) {
+    int32_t new_pix;
+#ifdef DEPTH_1BPP
+    new_pix = (pix & 0x80) ? 0xff : 0x00;
+#elif (defined(DEPTH_2BPP))
+    new_pix = pix & 0xc0;
+    new_pix |= new_pix >> 2;
+    new_pix |= new_pix >> 4;
+#elif (defined(DEPTH_4BPP))
+    new_pix = pix & 0xf0;
+    new_pix |= new_pix >> 4;
+    //new_pix = pix;
+#elif (defined(DEPTH_8BPP))
+    new_pix = pix;
 #endif
-            DST_PIX(x, y) = pix;
+    return new_pix;
+}
+
+#ifdef DITHERING_ERROR_DIFFUSION
+// Add the error diffused into row y of the rect by pixels outside of the rect,
+// using the quantization error they left in the previous pass
+static void disp_seed_error_row(int32_t *row_err, Rect rect, int y) {
+    for (int t = 0; t < DIFFUSION_TAPS; t++) {
+        int dx = diffusion_kernel[t].dx;
+        int sy = y - diffusion_kernel[t].dy;
+        int x0 = rect.x;
+        int x1 = rect.x + rect.w;
+        if (sy < 0)
+            continue;
+        if (sy >= rect.y) {
+            // Source row is inside the rect, only columns near the left or
+            // right edge receive error from outside
+            if (dx > 0)
+                x1 = MIN(x1, rect.x + dx);
+            else if (dx < 0)
+                x0 = MAX(x0, rect.x + rect.w + dx);
+            else
+                continue;
+        }
+        for (int x = x0; x < x1; x++) {
+            int sx = x - dx;
+            if ((sx < 0) || (sx >= screen->width))
+                continue;
+            int32_t err = dither_err_map[sy * screen->width + sx];
+            row_err[x - rect.x] += (err * diffusion_kernel[t].factor) >> 3;
         }
     }
+}
+#endif
+
+// Quantize color in the screen buffer into requested bit depth and do
+// optional dithering. If seeded, error diffusion continues from the pixels
+// surrounding the rect instead of restarting from zero at its edge.
+static void disp_dither_rect(Rect rect, bool seeded) {
+    uint32_t w = rect.w;
+    uint32_t h = rect.h;
 
 #ifdef DITHERING_ERROR_DIFFUSION
+    int32_t *err_buf = malloc(w * DITHERING_ERRBUF_LINES * sizeof(int32_t));
+    assert(err_buf);
     memset(err_buf, 0, w * DITHERING_ERRBUF_LINES * sizeof(*err_buf));
 #endif
 
-    // Quantize color into requested bit depth and do optional dithering
+#define DST_PIX(x, y) SCREEN_PIX(rect.x + (x), rect.y + (y))
+
     for (int y = 0; y < h; y++) {
+#ifdef DITHERING_ERROR_DIFFUSION
+        int32_t *row_err = &err_buf[(y % DITHERING_ERRBUF_LINES) * w];
+        if (seeded)
+            disp_seed_error_row(row_err, rect, rect.y + y);
+#endif
         for (int x = 0; x < w; x++) {
-            int32_t pix = (int32_t)DST_PIX(x, y);
+            int32_t pix = (int32_t)(uint8_t)DST_PIX(x, y);
 
-#ifdef DITHERING_GAMMA_AWARE
-            int32_t pix_linear = (int32_t)srgb_to_linear(pix);
-#else
-            int32_t pix_linear = pix; // ignore gamma, assume linear is the same as srgb
-#endif
-            printf("X: %d, Y: %d, P LIN = %d\n", x, y, pix_linear);
+            // Already converted into linear space by the tone LUT if gamma
+            // aware, otherwise assume linear is the same as srgb
+            int32_t pix_linear = pix;
 
 #ifdef DITHERING_ERROR_DIFFUSION
             // Add in error term
-            int32_t eb_val = err_buf[(y % DITHERING_ERRBUF_LINES) * w + x];
-
-            pix_linear += eb_val / 2;
-
-            printf("ERR = %d, PACC = %d\n", eb_val, pix_linear);
-            
-            if (eb_val < eb_min) eb_min = eb_val;
-            if (eb_val > eb_max) eb_max = eb_val;
+            pix_linear += row_err[x] / 2;
 #endif
 
 #ifdef DITHERING_ORDERED
     #ifdef ENABLE_COLOR
-            pix_linear = pix_linear + (int32_t)dithering_map[y % 6 * 6 + x % 6] + dithering_bias;
+            pix_linear = pix_linear + (int32_t)dithering_map[(rect.y + y) % 6 * 6 + (rect.x + x) % 6] + dithering_bias;
     #else
-            pix_linear = pix_linear + (int32_t)dithering_map[y % 4][x % 4] + dithering_bias;
+            pix_linear = pix_linear + (int32_t)dithering_map[(rect.y + y) % 4][(rect.x + x) % 4] + dithering_bias;
     #endif
 #endif
 
 #ifdef DITHERING_BLUE_NOISE
     #ifdef ENABLE_COLOR
-            pix_linear = pix_linear + (int32_t)noise_map[y % 120][x / 3 % 40];
+            pix_linear = pix_linear + (int32_t)noise_map[(rect.y + y) % 120][(rect.x + x) / 3 % 40];
     #else
-            pix_linear = pix_linear + (int32_t)noise_map[y % 32][x % 32];
+            pix_linear = pix_linear + (int32_t)noise_map[(rect.y + y) % 32][(rect.x + x) % 32];
     #endif
 #endif
 
@@ -597,20 +1005,7 @@ void disp_filtering_image(Canvas *src, Rect src_rect, Rect dst_rect) {
 #endif
 
             // Quantize the pixel down to the bpp required
-            int32_t new_pix;
-#ifdef DEPTH_1BPP
-            new_pix = (pix & 0x80) ? 0xff : 0x00;
-#elif (defined(DEPTH_2BPP))
-            new_pix = pix & 0xc0;
-            new_pix |= new_pix >> 2;
-            new_pix |= new_pix >> 4;
-#elif (defined(DEPTH_4BPP))
-            new_pix = pix & 0xf0;
-            new_pix |= new_pix >> 4;
-            //new_pix = pix;
-#elif (defined(DEPTH_8BPP))
-            new_pix = pix;
-#endif
+            int32_t new_pix = disp_quantize_pix(pix);
             // uint32_t pix_32 = ((uint32_t)pix << 16) | ((uint32_t)pix << 8) | ((uint32_t)pix);
             // uint32_t new_pix_32 = pick_closest_color(pix_32);
             // new_pix = new_pix_32 & 0xff;
@@ -622,135 +1017,854 @@ void disp_filtering_image(Canvas *src, Rect src_rect, Rect dst_rect) {
     #else
             int32_t quant_error = pix - new_pix;
     #endif
-
-            printf("QE: %d\n", quant_error);
-
-            pix = new_pix;
-
-    #define DIFFUSE_ERROR(x, y, w, h, error, factor, sum)\
-            diffused_err = (error * factor) >> 3; \
-            if (((y) >= 0) && ((x) >= 0) && ((y) < h) && ((x) < w)) \
-                err_buf[((y) % DITHERING_ERRBUF_LINES) * w + x] += diffused_err; \
-            printf("DF %d to X%d Y%d\n", diffused_err, x, y);
-
-    int32_t diffused_err;
-
-    #ifdef ENABLE_COLOR
-            // . . * . . 1
-            // 2 . . 3 . .
-            // . 4 . . 5 .
-            // . . 6 . . .
-            // Star is the pixel in question, the error is pushed to the pixels
-            // labeled 1-6 (neighboring pixels in the same color).
-            // 1.4-5, 1.7-3, 2.8-2, 3-2/1
-            DIFFUSE_ERROR(x + 3, y + 0, w, h, quant_error, 2, 16); // 1 D=3
-            DIFFUSE_ERROR(x - 2, y + 1, w, h, quant_error, 3, 16); // 2 D=1.7
-            DIFFUSE_ERROR(x + 1, y + 1, w, h, quant_error, 5, 16); // 3 D=1.4
-            DIFFUSE_ERROR(x - 1, y + 2, w, h, quant_error, 3, 16); // 4 D=1.7
-            DIFFUSE_ERROR(x + 2, y + 2, w, h, quant_error, 2, 16); // 5 D=2.8
-            DIFFUSE_ERROR(x    , y + 3, w, h, quant_error, 1, 16); // 6 D=3
-    #else
-            #if 1
-            // Floyd-Steinberg
-            // . * 1
-            // 2 3 4
-            // Star is the pixel in question, the error is pushed to the pixels
-            // labeled 1-4
-            DIFFUSE_ERROR(x + 1, y + 0, w, h, quant_error, 7, 16);
-            DIFFUSE_ERROR(x - 1, y + 1, w, h, quant_error, 3, 16);
-            DIFFUSE_ERROR(x    , y + 1, w, h, quant_error, 5, 16);
-            DIFFUSE_ERROR(x + 1, y + 1, w, h, quant_error, 1, 16);
-            #else
-            // Two-Row Sierra
-            DIFFUSE_ERROR(x + 1, y + 0, w, h, quant_error, 4, 16);
-            DIFFUSE_ERROR(x + 2, y + 0, w, h, quant_error, 3, 16);
-            DIFFUSE_ERROR(x - 2, y + 1, w, h, quant_error, 1, 16);
-            DIFFUSE_ERROR(x - 1, y + 1, w, h, quant_error, 2, 16);
-            DIFFUSE_ERROR(x,     y + 1, w, h, quant_error, 3, 16);
-            DIFFUSE_ERROR(x + 1, y + 1, w, h, quant_error, 2, 16);
-            DIFFUSE_ERROR(x + 2, y + 1, w, h, quant_error, 1, 16);
-            #endif
-    #endif
-#else
-            // Does not apply error diffusion dithering
-            pix = new_pix;
+            dither_err_map[(rect.y + y) * screen->width + rect.x + x] =
+                    (int16_t)clamp16s(quant_error);
+
+            for (int t = 0; t < DIFFUSION_TAPS; t++) {
+                int ex = x + diffusion_kernel[t].dx;
+                int ey = y + diffusion_kernel[t].dy;
+                if ((ex >= 0) && (ex < w) && (ey < h))
+                    err_buf[(ey % DITHERING_ERRBUF_LINES) * w + ex] +=
+                            (quant_error * diffusion_kernel[t].factor) >> 3;
+            }
 #endif
-            DST_PIX(x, y) = pix;
+            DST_PIX(x, y) = new_pix;
         }
 #ifdef DITHERING_ERROR_DIFFUSION
         // Clear errbuf of current line
-        memset(&err_buf[(y % DITHERING_ERRBUF_LINES) * w], 0, w * sizeof(*err_buf));
-        // print errbuf of next line
-        printf("- ERRBUF -\n");
-        for (int i = 0; i < w; i++) {
-            printf("%d: %d\n", i, err_buf[((y + 1) % DITHERING_ERRBUF_LINES) * w + i]);
-        }
+        memset(row_err, 0, w * sizeof(*err_buf));
 #endif
     }
 
-    printf("Max accumulated error: %d, min: %d\n", eb_max, eb_min);
+#undef DST_PIX
 
 #ifdef DITHERING_ERROR_DIFFUSION
     free(err_buf);
 #endif
+}
 
+#ifdef ACEP_COLOR
+static uint32_t disp_palette_output(int idx) {
 #if defined(BUILD_PC_SIM)
-    // Reformat for ARGB8888 buffer
-    for (int y = 0; y < h; y++) {
+    return 0xff000000 | srgb_color_points[idx];
+#elif defined(BUILD_NEKOINK)
+    // Palette index as 4bpp grey level, mapped to pigments by the waveform
+    return (idx << 4) | idx;
+#endif
+}
+
+// Floyd-Steinberg error diffusion in linear RGB to the palette colours. Works
+// from the source directly, as the screen buffer has no room for RGB values.
+// Error is not carried over from outside of the rect.
+static void disp_dither_rect_palette(Canvas *src, int src_x, int src_y,
+        Rect rect) {
+    int w = rect.w;
+    int32_t *err_buf = calloc(w * 3 * 2, sizeof(int32_t));
+    assert(err_buf);
+    assert(src->pixelFormat == PIXFMT_RGB888);
+
+    for (int y = 0; y < rect.h; y++) {
+        int32_t *cur = &err_buf[(y & 1) * w * 3];
+        int32_t *next = &err_buf[(~y & 1) * w * 3];
+        uint8_t *rdptr = &src->buf[((src_y + y) * src->width + src_x) * 3];
         for (int x = 0; x < w; x++) {
-            uint32_t pix = DST_PIX(x, y);
+            int32_t rgb[3];
+            for (int c = 0; c < 3; c++)
+                rgb[c] = clamp8(tone_lut[c][rdptr[x * 3 + c]] +
+                        cur[x * 3 + c] / 16);
+            int idx = palette_lookup(rgb[0], rgb[1], rgb[2]);
+            for (int c = 0; c < 3; c++) {
+                int32_t err = rgb[c] - palette_linear[idx][c];
+                if (x + 1 < w) {
+                    cur[(x + 1) * 3 + c] += err * 7;
+                    next[(x + 1) * 3 + c] += err * 1;
+                }
+                if (x > 0)
+                    next[(x - 1) * 3 + c] += err * 3;
+                next[x * 3 + c] += err * 5;
+            }
+            SCREEN_PIX(rect.x + x, rect.y + y) = disp_palette_output(idx);
+        }
+        memset(cur, 0, w * 3 * sizeof(int32_t));
+    }
+
+    free(err_buf);
+}
+#endif
+
+// Copy pixels of the rect in the screen buffer to the output device
+static void disp_copy_rect(Rect rect) {
+#if defined(BUILD_PC_SIM)
+#ifdef ENABLE_WAVEFORM_SIM
+    if (wfsim_ready) {
+        uint8_t *wrptr = wfsim_get_fb() + rect.y * screen->width + rect.x;
+        for (int y = rect.y; y < rect.y + rect.h; y++) {
+            for (int x = rect.x; x < rect.x + rect.w; x++) {
+                #ifdef ENABLE_COLOR
+                uint32_t shift = get_panel_color_shift(x, y);
+                #else
+                uint32_t shift = 0;
+                #endif
+                wrptr[x - rect.x] = (SCREEN_PIX(x, y) >> shift) & 0xff;
+            }
+            wrptr += screen->width;
+        }
+        return;
+    }
+#endif
+    SDL_Rect sdl_rect = {rect.x, rect.y, rect.w, rect.h};
+    uint8_t *texture_pixels;
+    int texture_pitch;
+    SDL_LockTexture(texture, &sdl_rect, (void **)&texture_pixels, &texture_pitch);
+    assert(texture_pitch == (screen->width * 4));
+    for (int y = rect.y; y < rect.y + rect.h; y++) {
+        memcpy(texture_pixels, &SCREEN_PIX(rect.x, y), rect.w * 4);
+        texture_pixels += texture_pitch;
+    }
+    SDL_UnlockTexture(texture);
+#elif defined(BUILD_NEKOINK)
+#ifdef ENABLE_DOUBLE_BUFFER
+    // Copied into a page when presented
+    if (fb_pages)
+        return;
+#endif
+    // TODO: Directly write into FB?
+    uint8_t *wrptr = fbdev_fb + rect.y * fb_virtual_x + rect.x;
+    for (int y = rect.y; y < rect.y + rect.h; y++) {
+        memcpy(wrptr, &SCREEN_PIX(rect.x, y), rect.w);
+        wrptr += fb_virtual_x;
+    }
+#endif
+}
+
+#if defined(BUILD_PC_SIM)
+// Reformat a quantized 8bpp pixel for the ARGB8888 screen buffer
+static uint32_t disp_format_pix(int x, int y, uint32_t pix) {
     #ifdef ENABLE_COLOR
-            uint32_t shift = get_panel_color_shift(dst_x + x, dst_y + y);
-            pix <<= shift;
-            //pix |= (pix << 16) | (pix << 8);
+    uint32_t shift = get_panel_color_shift(x, y);
+    pix <<= shift;
+    //pix |= (pix << 16) | (pix << 8);
     #else
-            pix |= (pix << 16) | (pix << 8);
+    pix |= (pix << 16) | (pix << 8);
     #endif
-            pix |= 0xff000000;
-            DST_PIX(x, y) = pix;
+    pix |= 0xff000000;
+    return pix;
+}
+#elif defined(BUILD_NEKOINK)
+#define disp_format_pix(x, y, pix) (pix)
+#endif
+
+// Push the processed pixels of the rect to the output device
+static void disp_output_rect(Rect rect) {
+#if defined(BUILD_PC_SIM)
+    // Reformat for ARGB8888 buffer
+    for (int y = rect.y; y < rect.y + rect.h; y++) {
+        for (int x = rect.x; x < rect.x + rect.w; x++) {
+            SCREEN_PIX(x, y) = disp_format_pix(x, y, SCREEN_PIX(x, y));
         }
     }
 
     #ifdef ENABLE_BRIGHTEN
     // Brighten image, not recommended
-    for (int y = 0; y < h; y++) {
-        for (int x = 0; x < (w - 1); x++) {
-            uint32_t pix = DST_PIX(x, y);
+    for (int y = rect.y; y < rect.y + rect.h; y++) {
+        for (int x = rect.x; x < (rect.x + rect.w - 1); x++) {
+            uint32_t pix = SCREEN_PIX(x, y);
             uint32_t shift = get_panel_color_shift(x, y);
             uint32_t cm = 0xff << shift;
             pix &= cm;
-            DST_PIX(x + 1, y) |= pix;
-            if (y < (h - 1))
-                DST_PIX(x + 1, y + 1) |= pix;
+            SCREEN_PIX(x + 1, y) |= pix;
+            if (y < (rect.y + rect.h - 1))
+                SCREEN_PIX(x + 1, y + 1) |= pix;
+        }
+    }
+    #endif
+#endif
+    disp_copy_rect(rect);
+}
+
+// Process image to be displayed on EPD
+void disp_filtering_image(Canvas *src, Rect src_rect, Rect dst_rect) {
+    if ((src_rect.w == 0) && (src_rect.h == 0)) {
+        src_rect.w = src->width;
+        src_rect.h = src->height;
+    }
+    dst_rect.w = src_rect.w;
+    dst_rect.h = src_rect.h;
+    dst_rect = disp_clip_rect(dst_rect);
+
+#ifdef ACEP_COLOR
+    disp_dither_rect_palette(src, src_rect.x, src_rect.y, dst_rect);
+    disp_copy_rect(dst_rect);
+#else
+    // Convert to 8bpp in target buffer
+    disp_sample_rect(src, src_rect.x, src_rect.y, dst_rect);
+    disp_dither_rect(dst_rect, false);
+    disp_output_rect(dst_rect);
+#endif
+}
+
+// Re-process only a changed region of a screen sized source image. The region
+// is grown by a margin where the changed error diffusion pattern settles, and
+// error flowing in from the untouched pixels is restored from the error map.
+// Returns the region actually written, which is the one to present.
+Rect disp_filtering_image_update(Canvas *src, Rect rect) {
+    assert((src->width == screen->width) && (src->height == screen->height));
+
+#if defined(DITHERING_ERROR_DIFFUSION) || defined(ACEP_COLOR)
+    // Error only flows rightwards and downwards, the rows above are unaffected
+    rect.x -= DITHERING_INCREMENTAL_MARGIN;
+    rect.w += DITHERING_INCREMENTAL_MARGIN * 2;
+    rect.h += DITHERING_INCREMENTAL_MARGIN;
+#endif
+    rect = disp_clip_rect(rect);
+    if ((rect.w == 0) || (rect.h == 0))
+        return rect;
+
+#ifdef ACEP_COLOR
+    disp_dither_rect_palette(src, rect.x, rect.y, rect);
+    disp_copy_rect(rect);
+#else
+    disp_sample_rect(src, rect.x, rect.y, rect);
+    disp_dither_rect(rect, true);
+    disp_output_rect(rect);
+#endif
+    return rect;
+}
+
+// Scroll the screen by dy rows, positive moving the content up. The source
+// image should already hold the scrolled content. Dithered rows still on
+// screen are moved along with their error, only the newly exposed rows are
+// processed. Rows exposed at the bottom pick up the error of the retained row
+// above, rows exposed at the top can't as error doesn't flow upwards. Returns
+// up to max_rects regions which actually changed on the screen.
+int disp_scroll(Canvas *src, int dy, Rect *rects, int max_rects) {
+    assert((src->width == screen->width) && (src->height == screen->height));
+    assert(max_rects > 0);
+
+    int w = screen->width;
+    int h = screen->height;
+    size_t stride = (size_t)w * (disp_get_bpp(screen->pixelFormat) / 8);
+    uint8_t *old = malloc(stride * h);
+    assert(old);
+    memcpy(old, screen->buf, stride * h);
+
+    Rect exposed;
+#ifdef ENABLE_COLOR
+    // Moving by other than whole periods of the colour filter would put the
+    // dithered components under the wrong colour
+    bool reuse = (dy % 3 == 0);
+#else
+    bool reuse = true;
+#endif
+    // Not abs(dy), which overflows for INT_MIN
+    if (!reuse || (dy >= h) || (dy <= -h)) {
+        exposed = (Rect){0, 0, w, h};
+    }
+    else if (dy > 0) {
+        memmove(screen->buf, screen->buf + stride * dy, stride * (h - dy));
+#ifdef DITHERING_ERROR_DIFFUSION
+        memmove(dither_err_map, dither_err_map + (size_t)w * dy,
+                (size_t)w * (h - dy) * sizeof(int16_t));
+#endif
+        exposed = (Rect){0, h - dy, w, dy};
+    }
+    else {
+        memmove(screen->buf + stride * -dy, screen->buf, stride * (h + dy));
+#ifdef DITHERING_ERROR_DIFFUSION
+        memmove(dither_err_map + (size_t)w * -dy, dither_err_map,
+                (size_t)w * (h + dy) * sizeof(int16_t));
+#endif
+        exposed = (Rect){0, 0, w, -dy};
+    }
+
+    if (exposed.h) {
+#ifdef ACEP_COLOR
+        disp_dither_rect_palette(src, exposed.x, exposed.y, exposed);
+#else
+        disp_sample_rect(src, exposed.x, exposed.y, exposed);
+        disp_dither_rect(exposed, dy > 0);
+        disp_output_rect(exposed);
+#endif
+    }
+
+    // Collect runs of changed rows, merging into the last rect once full
+    int count = 0;
+    bool in_run = false;
+    for (int y = 0; y < h; y++) {
+        uint8_t *new_row = screen->buf + stride * y;
+        uint8_t *old_row = old + stride * y;
+        if (memcmp(new_row, old_row, stride) == 0) {
+            in_run = false;
+            continue;
+        }
+        int x0 = 0, x1 = w - 1;
+        int bypp = stride / w;
+        while (memcmp(new_row + x0 * bypp, old_row + x0 * bypp, bypp) == 0)
+            x0++;
+        while (memcmp(new_row + x1 * bypp, old_row + x1 * bypp, bypp) == 0)
+            x1--;
+        Rect row = {x0, y, x1 - x0 + 1, 1};
+        if (in_run || (count == max_rects)) {
+            rects[count - 1] = disp_union_rect(rects[count - 1], row);
+        }
+        else {
+            rects[count++] = row;
+            in_run = true;
+        }
+    }
+    free(old);
+
+    for (int i = 0; i < count; i++)
+        disp_copy_rect(rects[i]);
+    return count;
+}
+
+#ifdef ENABLE_CLASSIFY
+// Quantize without dithering, for bilevel content
+static void disp_threshold_rect(Rect rect) {
+    for (int y = rect.y; y < rect.y + rect.h; y++) {
+        for (int x = rect.x; x < rect.x + rect.w; x++) {
+            SCREEN_PIX(x, y) = disp_quantize_pix(SCREEN_PIX(x, y));
+#ifdef DITHERING_ERROR_DIFFUSION
+            dither_err_map[y * screen->width + x] = 0;
+#endif
+        }
+    }
+}
+
+// Quantize with blue noise, flat areas get a regular texture without the
+// artifacts error diffusion leaves on them
+static void disp_noise_rect(Rect rect) {
+    for (int y = rect.y; y < rect.y + rect.h; y++) {
+        for (int x = rect.x; x < rect.x + rect.w; x++) {
+            int32_t pix = SCREEN_PIX(x, y);
+#ifdef ENABLE_COLOR
+            pix += (int32_t)noise_map[y % 120][x / 3 % 40];
+#else
+            pix += (int32_t)noise_map[y % 32][x % 32];
+#endif
+            SCREEN_PIX(x, y) = disp_quantize_pix(clamp8(pix));
+#ifdef DITHERING_ERROR_DIFFUSION
+            dither_err_map[y * screen->width + x] = 0;
+#endif
+        }
+    }
+}
+
+// Filter a screen sized image, quantizing each tile according to its content.
+// Tiles are batched into update rects per class, returned along with the
+// waveform to present each with, fast ones first. Returns the rect count.
+int disp_filtering_classified(Canvas *src, Rect *rects, WaveformMode *modes,
+        int max_rects) {
+    static const WaveformMode class_modes[TILE_CLASSES] = {
+        [TILE_TEXT] = CLASSIFY_TEXT_WAVEFORM,
+        [TILE_FLAT] = CLASSIFY_FLAT_WAVEFORM,
+        [TILE_PHOTO] = CLASSIFY_PHOTO_WAVEFORM
+    };
+
+    assert((src->width == screen->width) && (src->height == screen->height));
+    assert(max_rects >= TILE_CLASSES);
+
+    int tiles_x = (src->width + CLASSIFY_TILE_SIZE - 1) / CLASSIFY_TILE_SIZE;
+    int tiles_y = (src->height + CLASSIFY_TILE_SIZE - 1) / CLASSIFY_TILE_SIZE;
+    uint8_t *classes = malloc(tiles_x * tiles_y);
+    bool *mask = malloc(tiles_x * tiles_y * sizeof(bool));
+    assert(classes && mask);
+    classify_tiles(src, classes, tiles_x, tiles_y);
+
+    Rect full = {0, 0, screen->width, screen->height};
+    disp_sample_rect(src, 0, 0, full);
+#ifdef DITHERING_ERROR_DIFFUSION
+    // Seeding reads cells of runs not processed yet in this pass, these must
+    // not bring in error left by the previous image
+    memset(dither_err_map, 0,
+            (size_t)screen->width * screen->height * sizeof(int16_t));
+#endif
+
+    // Quantize runs of tiles in the same class. Diffused runs are processed
+    // top to bottom and seeded, so the error flows across runs.
+    for (int ty = 0; ty < tiles_y; ty++) {
+        int tx = 0;
+        while (tx < tiles_x) {
+            int start = tx;
+            uint8_t class = classes[ty * tiles_x + tx];
+            while ((tx < tiles_x) && (classes[ty * tiles_x + tx] == class))
+                tx++;
+            Rect run = {
+                start * CLASSIFY_TILE_SIZE, ty * CLASSIFY_TILE_SIZE,
+                (tx - start) * CLASSIFY_TILE_SIZE, CLASSIFY_TILE_SIZE
+            };
+            run = disp_clip_rect(run);
+            if (class == TILE_TEXT)
+                disp_threshold_rect(run);
+            else if (class == TILE_FLAT)
+                disp_noise_rect(run);
+            else
+                disp_dither_rect(run, true);
         }
     }
+    disp_output_rect(full);
+
+    int count = 0;
+    bool merged[CLASSIFY_MAX_RECTS];
+    assert(max_rects <= CLASSIFY_MAX_RECTS);
+    for (int c = 0; c < TILE_CLASSES; c++) {
+        for (int i = 0; i < tiles_x * tiles_y; i++)
+            mask[i] = (classes[i] == c);
+        // Leave at least one rect for each of the remaining classes
+        int budget = max_rects - count - (TILE_CLASSES - 1 - c);
+        int n = disp_tiles_to_rects(mask, tiles_x, tiles_y, CLASSIFY_TILE_SIZE,
+                screen->width, screen->height, &rects[count], budget, merged);
+        for (int i = 0; i < n; i++) {
+            // A merged rect may cover other classes, use a waveform safe for
+            // any content
+            modes[count + i] = merged[i] ? CLASSIFY_PHOTO_WAVEFORM :
+                    class_modes[c];
+        }
+        count += n;
+    }
+
+    free(classes);
+    free(mask);
+    return count;
+}
+#endif
+
+#ifdef ENABLE_ANIMATION
+static int64_t disp_rect_area(Rect rect) {
+    return (int64_t)rect.w * rect.h;
+}
+
+// Render a frame of an animation from a screen sized source image. Pixels are
+// quantized with position stable blue noise instead of the configured
+// dithering, so areas not changing between frames stay identical. Only changed
+// pixels are written. The changed regions are collected per band of rows and
+// returned, merging neighbouring bands when it doesn't add much area.
+int disp_filtering_frame(Canvas *src, Rect *rects, int max_rects) {
+    int count = 0;
+
+    assert((src->width == screen->width) && (src->height == screen->height));
+    assert(max_rects > 0);
+
+    for (int y0 = 0; y0 < screen->height; y0 += ANIM_BAND_LINES) {
+        int y1 = MIN(y0 + ANIM_BAND_LINES, screen->height);
+        int min_x = screen->width, max_x = -1;
+        int min_y = screen->height, max_y = -1;
+        for (int y = y0; y < y1; y++) {
+            for (int x = 0; x < screen->width; x++) {
+#ifdef ACEP_COLOR
+                uint8_t *rdptr = &src->buf[(y * src->width + x) * 3];
+                int32_t noise = (int32_t)noise_map[y % 120][x % 40];
+                uint32_t pix = disp_palette_output(palette_lookup(
+                        clamp8(tone_lut[0][rdptr[0]] + noise),
+                        clamp8(tone_lut[1][rdptr[1]] + noise),
+                        clamp8(tone_lut[2][rdptr[2]] + noise)));
+#else
+                int32_t pix = disp_sample_pix(src, x, y, x, y);
+    #ifdef ENABLE_COLOR
+                pix += (int32_t)noise_map[y % 120][x / 3 % 40];
+    #else
+                pix += (int32_t)noise_map[y % 32][x % 32];
     #endif
+                pix = disp_format_pix(x, y, disp_quantize_pix(clamp8(pix)));
+#endif
+                if (SCREEN_PIX(x, y) == pix)
+                    continue;
+                SCREEN_PIX(x, y) = pix;
+#ifdef DITHERING_ERROR_DIFFUSION
+                dither_err_map[y * screen->width + x] = 0;
+#endif
+                min_x = MIN(min_x, x);
+                max_x = MAX(max_x, x);
+                min_y = MIN(min_y, y);
+                max_y = MAX(max_y, y);
+            }
+        }
+        if (max_x < 0)
+            continue;
+        Rect rect = {min_x, min_y, max_x - min_x + 1, max_y - min_y + 1};
+        if (count > 0) {
+            Rect merged = disp_union_rect(rects[count - 1], rect);
+            int64_t sum = disp_rect_area(rects[count - 1]) +
+                    disp_rect_area(rect);
+            if ((count == max_rects) ||
+                    (disp_rect_area(merged) <= sum * 3 / 2)) {
+                rects[count - 1] = merged;
+                continue;
+            }
+        }
+        rects[count++] = rect;
+    }
+
+    for (int i = 0; i < count; i++)
+        disp_copy_rect(rects[i]);
+    return count;
+}
+#endif
+
+Rect disp_union_rect(Rect a, Rect b) {
+    if ((a.w <= 0) || (a.h <= 0))
+        return b;
+    if ((b.w <= 0) || (b.h <= 0))
+        return a;
+    Rect r;
+    r.x = MIN(a.x, b.x);
+    r.y = MIN(a.y, b.y);
+    r.w = MAX(a.x + a.w, b.x + b.w) - r.x;
+    r.h = MAX(a.y + a.h, b.y + b.h) - r.y;
+    return r;
+}
+
+// Group the tiles set in the mask into rects. Runs of tiles in a row are
+// merged, and extended downwards while the row below has the same run. Once
+// max_rects are used, further runs are merged into the rect growing the least,
+// which may then cover tiles not in the mask, flagged in merged if provided.
+// Rects are clipped to w x h.
+int disp_tiles_to_rects(const bool *mask, int tiles_x, int tiles_y,
+        int tile_size, int w, int h, Rect *rects, int max_rects,
+        bool *merged) {
+    int count = 0;
+    for (int ty = 0; ty < tiles_y; ty++) {
+        int tx = 0;
+        while (tx < tiles_x) {
+            if (!mask[ty * tiles_x + tx]) {
+                tx++;
+                continue;
+            }
+            int start = tx;
+            while ((tx < tiles_x) && mask[ty * tiles_x + tx])
+                tx++;
+            Rect run = {
+                start * tile_size, ty * tile_size,
+                (tx - start) * tile_size, tile_size
+            };
+            // Extend a rect ending right above with the same run
+            int i;
+            for (i = 0; i < count; i++) {
+                if ((rects[i].x == run.x) && (rects[i].w == run.w) &&
+                        (rects[i].y + rects[i].h == run.y)) {
+                    rects[i].h += run.h;
+                    break;
+                }
+            }
+            if (i < count)
+                continue;
+            if (count == max_rects) {
+                int best = 0;
+                int64_t best_growth = INT64_MAX;
+                for (i = 0; i < count; i++) {
+                    Rect u = disp_union_rect(rects[i], run);
+                    int64_t growth = (int64_t)u.w * u.h -
+                            (int64_t)rects[i].w * rects[i].h;
+                    if (growth < best_growth) {
+                        best_growth = growth;
+                        best = i;
+                    }
+                }
+                rects[best] = disp_union_rect(rects[best], run);
+                if (merged)
+                    merged[best] = true;
+                continue;
+            }
+            if (merged)
+                merged[count] = false;
+            rects[count++] = run;
+        }
+    }
+    for (int i = 0; i < count; i++) {
+        rects[i].w = MIN(rects[i].w, w - rects[i].x);
+        rects[i].h = MIN(rects[i].h, h - rects[i].y);
+    }
+    return count;
+}
+
+// Draw a line with a square pen directly into the screen and output buffer,
+// bypassing dithering. Intended for pure black/ white content that could be
+// updated with fast waveforms. Returns the area touched.
+Rect disp_draw_line(int x0, int y0, int x1, int y1, int width, uint8_t color) {
+    Rect bound;
+    bound.x = MIN(x0, x1) - width / 2;
+    bound.y = MIN(y0, y1) - width / 2;
+    bound.w = abs(x1 - x0) + width;
+    bound.h = abs(y1 - y0) + width;
+    bound = disp_clip_rect(bound);
+    if ((bound.w == 0) || (bound.h == 0))
+        return bound;
+
+#if defined(BUILD_PC_SIM)
+    uint32_t pix = 0xff000000 | ((uint32_t)color << 16) |
+            ((uint32_t)color << 8) | color;
+#elif defined(BUILD_NEKOINK)
+    uint8_t pix = color;
+#endif
+
+    // Bresenham, stamping the pen at every step
+    int dx = abs(x1 - x0);
+    int dy = -abs(y1 - y0);
+    int sx = (x0 < x1) ? 1 : -1;
+    int sy = (y0 < y1) ? 1 : -1;
+    int err = dx + dy;
+    while (1) {
+        int px0 = MAX(x0 - width / 2, bound.x);
+        int py0 = MAX(y0 - width / 2, bound.y);
+        int px1 = MIN(x0 - width / 2 + width, bound.x + bound.w);
+        int py1 = MIN(y0 - width / 2 + width, bound.y + bound.h);
+        for (int y = py0; y < py1; y++)
+            for (int x = px0; x < px1; x++)
+                SCREEN_PIX(x, y) = pix;
+        if ((x0 == x1) && (y0 == y1))
+            break;
+        int e2 = err * 2;
+        if (e2 >= dy) {
+            err += dy;
+            x0 += sx;
+        }
+        if (e2 <= dx) {
+            err += dx;
+            y0 += sy;
+        }
+    }
 
-    uint32_t *texture_pixels;
+    disp_copy_rect(bound);
+    return bound;
+}
+
+#if defined(BUILD_PC_SIM) && defined(ENABLE_WAVEFORM_SIM)
+// Show the simulated panel reflectance in the window
+static void disp_render_panel(Rect rect) {
+    SDL_Rect sdl_rect = {rect.x, rect.y, rect.w, rect.h};
+    uint8_t *texture_pixels;
     int texture_pitch;
-    SDL_LockTexture(texture, NULL, (void **)&texture_pixels, &texture_pitch);
-    assert(texture_pitch == (screen->width * 4));
-    memcpy(texture_pixels, screen->buf, screen->height * texture_pitch);
+    uint8_t *panel = wfsim_get_panel();
+    SDL_LockTexture(texture, &sdl_rect, (void **)&texture_pixels, &texture_pitch);
+    for (int y = rect.y; y < rect.y + rect.h; y++) {
+        uint32_t *wrptr = (uint32_t *)texture_pixels;
+        for (int x = rect.x; x < rect.x + rect.w; x++)
+            *wrptr++ = disp_format_pix(x, y, panel[y * screen->width + x]);
+        texture_pixels += texture_pitch;
+    }
     SDL_UnlockTexture(texture);
-#elif defined(BUILD_NEKOINK)
-    // TODO: Directly write into FB?
-    uint8_t *wrptr = fbdev_fb;
-    uint8_t *rdptr = dst_raw;
-    for (int i = 0; i < screen->height; i++) {
-        memcpy(wrptr, rdptr, screen->width);
-        wrptr += fb_virtual_x;
-        rdptr += screen->width;
+    SDL_RenderCopy(renderer, texture, NULL, NULL);
+    SDL_RenderPresent(renderer);
+}
+#endif
+
+static uint32_t disp_next_marker(void) {
+    // 0 means no marker
+    if (++marker_value == 0)
+        marker_value = 1;
+    return marker_value;
+}
+
+#if defined(BUILD_NEKOINK)
+#ifdef DISP_MARKER_THREADS
+// With stats, completion of every update is waited on by a small pool of
+// threads, so updates running in parallel each get their own completion time.
+// Nothing else waits on markers directly, as the driver frees a marker once
+// waited. Without stats, only markers taken for double buffering pages are
+// handed to them, once the page has been reused.
+#define MARKER_QUEUE_SIZE (64)
+static pthread_t marker_threads[STATS_WAIT_THREADS];
+static pthread_mutex_t marker_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t marker_cond = PTHREAD_COND_INITIALIZER;
+static uint32_t marker_queue[MARKER_QUEUE_SIZE];
+static uint32_t marker_head; // Next to be queued
+static uint32_t marker_tail; // Next to be waited
+static bool marker_quit;
+// Signalled on every completed update, for the event loop to wake up on
+static int complete_fd = -1;
+
+static void *disp_marker_thread(void *arg) {
+    pthread_mutex_lock(&marker_lock);
+    while (1) {
+        while ((marker_head == marker_tail) && !marker_quit)
+            pthread_cond_wait(&marker_cond, &marker_lock);
+        if (marker_head == marker_tail)
+            break;
+        uint32_t marker = marker_queue[marker_tail++ % MARKER_QUEUE_SIZE];
+        pthread_mutex_unlock(&marker_lock);
+
+        struct mxcfb_update_marker_data update_marker_data = {
+            .update_marker = marker
+        };
+        int ret = ioctl(fd_fbdev, MXCFB_WAIT_FOR_UPDATE_COMPLETE,
+                &update_marker_data);
+#ifdef ENABLE_STATS
+        stats_update_complete(marker, ret >= 0,
+                (ret >= 0) && update_marker_data.collision_test);
+        uint64_t one = 1;
+        ssize_t len = write(complete_fd, &one, sizeof(one));
+        (void)len;
+#else
+        (void)ret;
+#endif
+
+        pthread_mutex_lock(&marker_lock);
+        pthread_cond_broadcast(&marker_cond);
     }
+    pthread_mutex_unlock(&marker_lock);
+    return NULL;
+}
+
+static void disp_track_marker(uint32_t marker) {
+    pthread_mutex_lock(&marker_lock);
+    // The driver keeps every marker until it's waited on, so wait for room
+    // instead of dropping one
+    while (marker_head - marker_tail >= MARKER_QUEUE_SIZE)
+        pthread_cond_wait(&marker_cond, &marker_lock);
+    marker_queue[marker_head++ % MARKER_QUEUE_SIZE] = marker;
+    pthread_cond_broadcast(&marker_cond);
+    pthread_mutex_unlock(&marker_lock);
+}
 #endif
 
+static void disp_wait_complete(uint32_t marker) {
+#ifdef ENABLE_STATS
+    pthread_mutex_lock(&marker_lock);
+    while (!stats_update_done(marker))
+        pthread_cond_wait(&marker_cond, &marker_lock);
+    pthread_mutex_unlock(&marker_lock);
+#else
+    struct mxcfb_update_marker_data update_marker_data = {
+        .update_marker = marker
+    };
+    if (ioctl(fd_fbdev, MXCFB_WAIT_FOR_UPDATE_COMPLETE,
+            &update_marker_data) < 0) {
+        fprintf(stderr, "Failed waiting for update complete\n");
+    }
+#endif
+}
+
+#ifdef ENABLE_DOUBLE_BUFFER
+static void disp_wait_submitted(uint32_t marker) {
+#ifdef MXCFB_WAIT_FOR_UPDATE_SUBMISSION
+    // Pixels are taken from the buffer on submission
+    ioctl(fd_fbdev, MXCFB_WAIT_FOR_UPDATE_SUBMISSION, &marker);
+#else
+    disp_wait_complete(marker);
+#endif
+}
+#endif
+#endif
+
+#if defined(BUILD_NEKOINK) && defined(ENABLE_SNAPSHOT)
+// The panel keeps its image while powered off, so the last presented frame is
+// saved on exit. If the next start finds the same panel and waveform, it
+// continues from that frame instead of clearing with an INIT flash.
+#define SNAPSHOT_MAGIC (0x50414e53) // SNAP
+
+typedef struct {
+    uint32_t magic;
+    uint32_t hash;
+    int32_t width;
+    int32_t height;
+} SnapshotHeader;
+
+static uint32_t disp_fnv1a(uint32_t hash, const void *data, size_t len) {
+    const uint8_t *ptr = data;
+    for (size_t i = 0; i < len; i++)
+        hash = (hash ^ ptr[i]) * 16777619u;
+    return hash;
+}
+
+// Anything changing how the frame maps to the panel state
+static uint32_t disp_snapshot_hash(const char *epdc_id) {
+    uint32_t hash = 2166136261u;
+    hash = disp_fnv1a(hash, epdc_id, strlen(epdc_id));
+    hash = disp_fnv1a(hash, &var_screeninfo.xres, sizeof(uint32_t));
+    hash = disp_fnv1a(hash, &var_screeninfo.yres, sizeof(uint32_t));
+    hash = disp_fnv1a(hash, &var_screeninfo.rotate, sizeof(uint32_t));
+    hash = disp_fnv1a(hash, &var_screeninfo.grayscale, sizeof(uint32_t));
+
+    FILE *fp = fopen(SNAPSHOT_WAVEFORM_FILE, "rb");
+    if (fp) {
+        uint8_t buf[4096];
+        size_t len;
+        while ((len = fread(buf, 1, sizeof(buf), fp)) > 0)
+            hash = disp_fnv1a(hash, buf, len);
+        fclose(fp);
+    }
+    return hash;
+}
+
+// Returns true if the screen is known to show the snapshot
+static bool disp_snapshot_load(uint32_t hash) {
+    FILE *fp = fopen(SNAPSHOT_FILE, "rb");
+    if (!fp)
+        return false;
+    SnapshotHeader header;
+    bool valid = (fread(&header, sizeof(header), 1, fp) == 1) &&
+            (header.magic == SNAPSHOT_MAGIC) && (header.hash == hash) &&
+            (header.width == screen->width) &&
+            (header.height == screen->height) &&
+            (fread(screen->buf, screen->width * screen->height, 1, fp) == 1);
+    fclose(fp);
+    // Only valid for this start, a crash must not leave a stale one behind
+    unlink(SNAPSHOT_FILE);
+    if (!valid)
+        return false;
+
+    // Framebuffer content says nothing reliable about what the EPDC believes
+    // the panel shows, so always sync its state by updating to the snapshot,
+    // which drives pixels already there
+    for (int y = 0; y < screen->height; y++)
+        memcpy(&fbdev_fb[y * fb_virtual_x], &screen->buf[y * screen->width],
+                screen->width);
+    Rect zero_rect = {0};
+    disp_present(zero_rect, SNAPSHOT_SYNC_WAVEFORM, true, true);
+    printf("Restored screen from snapshot\n");
+    return true;
+}
+
+static void disp_snapshot_save(uint32_t hash) {
+    // Write then rename, so power loss never leaves a partial snapshot
+    FILE *fp = fopen(SNAPSHOT_FILE ".tmp", "wb");
+    if (!fp) {
+        fprintf(stderr, "Failed to save snapshot %s\n", SNAPSHOT_FILE);
+        return;
+    }
+    SnapshotHeader header = {
+        .magic = SNAPSHOT_MAGIC,
+        .hash = hash,
+        .width = screen->width,
+        .height = screen->height
+    };
+    bool ok = (fwrite(&header, sizeof(header), 1, fp) == 1) &&
+            (fwrite(screen->buf, screen->width * screen->height, 1, fp) == 1);
+    ok = (fclose(fp) == 0) && ok;
+    if (ok)
+        rename(SNAPSHOT_FILE ".tmp", SNAPSHOT_FILE);
+    else
+        unlink(SNAPSHOT_FILE ".tmp");
 }
 
+static uint32_t snapshot_hash;
+#endif
+
 void disp_init(void) {
 
+#ifdef ENABLE_STATS
+    stats_init();
+#endif
+
 #if defined(DITHERING_GAMMA_AWARE)
     build_gamma_table();
 #endif
 
+    ToneParams tone_identity = {
+        .brightness = 0.0f,
+        .contrast = 1.0f,
+        .gamma = 1.0f,
+        .black_point = 0,
+        .white_point = 255,
+        .auto_levels = false
+    };
+    disp_set_tone(&tone_identity, NULL);
+
+#ifdef ACEP_COLOR
+    palette_init();
+#endif
+
     printf("pixel to output mapping\n");
     for (int i = 0; i < 255; i++) {
         printf("%d: %d\n", i, pick_closest_color(i) & 0xff);
@@ -780,6 +1894,17 @@ void disp_init(void) {
             SDL_TEXTUREACCESS_STREAMING, w, h);
 
     screen = disp_create(w, h, PIXFMT_ARGB8888);
+
+#ifdef ENABLE_WAVEFORM_SIM
+    wfsim_ready = (wfsim_init(w, h) == 0);
+    if (wfsim_ready) {
+        Rect full = {0, 0, w, h};
+        disp_render_panel(full);
+    }
+    else {
+        printf("Updates are shown instantly\n");
+    }
+#endif
 #elif defined(BUILD_NEKOINK)
     char devname[] = "/dev/fbxx";
     char epdcid[] = "mxc_epdc_fb";
@@ -836,11 +1961,21 @@ void disp_init(void) {
 
     fbdev_fb = (uint8_t *)mmap(0, fb_size,
             PROT_READ | PROT_WRITE, MAP_SHARED, fd_fbdev, 0);
-    if ((int32_t)fbdev_fb <= 0) {
+    if (fbdev_fb == MAP_FAILED) {
         fprintf(stderr, "Failed to set screen mode\n");
         exit(1);
     }
 
+#ifdef ENABLE_DOUBLE_BUFFER
+    fb_pages = MIN(var_screeninfo.yres_virtual / var_screeninfo.yres,
+            FB_MAX_PAGES);
+    if (fb_pages < 2) {
+        printf("Not enough virtual screen space for double buffering\n");
+        fb_pages = 0;
+    }
+    fb_phys_addr = fix_screeninfo.smem_start;
+#endif
+
     // Disable auto update mode (region mode)
     uint32_t auto_update_mode = AUTO_UPDATE_MODE_REGION_MODE;
     if (ioctl(fd_fbdev, MXCFB_SET_AUTO_UPDATE_MODE, &auto_update_mode) < 0) {
@@ -868,44 +2003,149 @@ void disp_init(void) {
         exit(1);
     }
 
-    // Set power down delay
-    uint32_t powerdown_delay = 0;
-    if (ioctl(fd_fbdev, MXCFB_SET_PWRDOWN_DELAY, &powerdown_delay) < 0) {
-        fprintf(stderr, "Failed to set power down delay\n");
-    }
+    // Panel power is turned off right after updates unless raised later on
+    disp_set_powerdown_delay(0);
 
     screen = disp_create(w, h, PIXFMT_Y8);
 
-    // Clear screen
-    Rect zero_rect = {0};
-    memset(fbdev_fb, 0xff, fb_size);
-    disp_present(zero_rect, WVMD_INIT, false, true);
+#ifdef ENABLE_STATS
+    complete_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+#endif
+#ifdef DISP_MARKER_THREADS
+    for (int i = 0; i < STATS_WAIT_THREADS; i++)
+        pthread_create(&marker_threads[i], NULL, disp_marker_thread, NULL);
+#endif
+
+    bool restored = false;
+#ifdef ENABLE_SNAPSHOT
+    snapshot_hash = disp_snapshot_hash(epdcid);
+    restored = disp_snapshot_load(snapshot_hash);
+#endif
+    if (!restored) {
+        // Clear screen
+        Rect zero_rect = {0};
+        memset(fbdev_fb, 0xff, fb_size);
+        memset(screen->buf, 0xff, w * h);
+        disp_present(zero_rect, WVMD_INIT, false, true);
+    }
     //memset(fbdev_fb, 0x00, fb_size);
     //disp_present(zero_rect, WVMD_GC16, true, true);
 #endif
+
+#ifdef DITHERING_ERROR_DIFFUSION
+    dither_err_map = calloc(screen->width * screen->height, sizeof(int16_t));
+    assert(dither_err_map);
+#endif
+
+#ifdef ENABLE_REFRESH_SCHEDULER
+    refresh_init(screen->width, screen->height);
+#endif
 }
 
 void disp_deinit(void) {
 #if defined(BUILD_PC_SIM)
+#ifdef ENABLE_WAVEFORM_SIM
+    if (wfsim_ready) {
+        wfsim_deinit();
+        wfsim_ready = false;
+    }
+#endif
     SDL_DestroyWindow(window);
     SDL_Quit();
 #elif defined(BUILD_NEKOINK)
+#ifdef ENABLE_SNAPSHOT
+    disp_snapshot_save(snapshot_hash);
+#endif
+#ifdef ENABLE_DOUBLE_BUFFER
+    // Leave the final frame in the first page like without double buffering
+    if (fb_pages) {
+        for (int i = 0; i < fb_pages; i++) {
+            if (fb_page_reap[i])
+                disp_track_marker(fb_page_marker[i]);
+        }
+        fb_pages = 0;
+        Rect full = {0, 0, screen->width, screen->height};
+        disp_copy_rect(full);
+    }
+#endif
+#ifdef DISP_MARKER_THREADS
+    // Pending updates finish within the driver timeout
+    pthread_mutex_lock(&marker_lock);
+    marker_quit = true;
+    pthread_cond_broadcast(&marker_cond);
+    pthread_mutex_unlock(&marker_lock);
+    for (int i = 0; i < STATS_WAIT_THREADS; i++)
+        pthread_join(marker_threads[i], NULL);
+#endif
+#ifdef ENABLE_STATS
+    close(complete_fd);
+    complete_fd = -1;
+#endif
     munmap(fbdev_fb, fb_size);
     close(fd_fbdev);
 #endif
+
+#ifdef ENABLE_STATS
+    stats_print(stdout);
+    if (stats_export(STATS_LOG_FILE) < 0)
+        fprintf(stderr, "Failed to write update log %s\n", STATS_LOG_FILE);
+    if (stats_export_interactions(STATS_INTERACTION_LOG_FILE) < 0)
+        fprintf(stderr, "Failed to write latency log %s\n",
+                STATS_INTERACTION_LOG_FILE);
+#endif
+
+#ifdef DITHERING_ERROR_DIFFUSION
+    free(dither_err_map);
+#endif
+
+#ifdef ENABLE_REFRESH_SCHEDULER
+    refresh_deinit();
+#endif
 }
 
-void disp_present(Rect dest_rect, WaveformMode mode, bool partial, bool wait) {
-#if defined(BUILD_PC_SIM)
-    SDL_RenderCopy(renderer, texture, NULL, NULL);
-    SDL_RenderPresent(renderer);
-#elif defined(BUILD_NEKOINK)
+// Returns the marker of the update, or 0 if completion times aren't recorded
+uint32_t disp_present(Rect dest_rect, WaveformMode mode, bool partial,
+        bool wait) {
     if ((dest_rect.w == 0) && (dest_rect.h == 0)) {
         dest_rect.w = screen->width;
         dest_rect.h = screen->height;
     }
+#ifdef ENABLE_REFRESH_SCHEDULER
+    refresh_note_update(dest_rect, mode, partial);
+#endif
+#if defined(BUILD_PC_SIM)
+#ifdef ENABLE_WAVEFORM_SIM
+    if (wfsim_ready) {
+        // Takes as long as the waveform, the window follows in disp_step
+        uint32_t marker = disp_next_marker();
+#ifdef ENABLE_STATS
+        stats_update_submit(marker, mode, dest_rect, partial);
+        stats_update_sent(marker);
+#endif
+        wfsim_submit(dest_rect, mode, partial, marker);
+        if (wait) {
+            int timeout;
+            while ((timeout = disp_step()) >= 0) {
+                if (wfsim_update_done(marker))
+                    break;
+                SDL_Delay(timeout);
+            }
+        }
+        return marker;
+    }
+#endif
+#ifdef ENABLE_STATS
+    uint32_t marker = disp_next_marker();
+    stats_update_submit(marker, mode, dest_rect, partial);
+#endif
+    SDL_RenderCopy(renderer, texture, NULL, NULL);
+    SDL_RenderPresent(renderer);
+#ifdef ENABLE_STATS
+    stats_update_complete(marker, true, false);
+    return marker;
+#endif
+#elif defined(BUILD_NEKOINK)
     struct mxcfb_update_data update_data;
-    struct mxcfb_update_marker_data update_marker_data;
 
     update_data.update_mode = partial ? UPDATE_MODE_PARTIAL : UPDATE_MODE_FULL;
     update_data.waveform_mode = mode;
@@ -916,29 +2156,139 @@ void disp_present(Rect dest_rect, WaveformMode mode, bool partial, bool wait) {
     update_data.temp = TEMP_USE_AMBIENT;
     update_data.flags = 0;
 
+#ifdef ENABLE_STATS
+    // Every update is tracked
+    update_data.update_marker = disp_next_marker();
+#else
     if (wait)
-        update_data.update_marker = ++marker_value;
+        update_data.update_marker = disp_next_marker();
     else
         update_data.update_marker = 0;
+#endif
 
+#ifdef ENABLE_DOUBLE_BUFFER
+    if (fb_pages) {
+        // Page should no longer be in use, normally never waits unless the
+        // updates are queued up
+        if (fb_page_marker[fb_page]) {
+            disp_wait_submitted(fb_page_marker[fb_page]);
+            if (fb_page_reap[fb_page])
+                disp_track_marker(fb_page_marker[fb_page]);
+        }
+        size_t page_offset = (size_t)fb_page * screen->height * fb_virtual_x;
+        uint8_t *wrptr = fbdev_fb + page_offset + dest_rect.y * fb_virtual_x +
+                dest_rect.x;
+        for (int y = dest_rect.y; y < dest_rect.y + dest_rect.h; y++) {
+            memcpy(wrptr, &SCREEN_PIX(dest_rect.x, y), dest_rect.w);
+            wrptr += fb_virtual_x;
+        }
+
+        update_data.flags |= EPDC_FLAG_USE_ALT_BUFFER;
+        update_data.alt_buffer_data.phys_addr = fb_phys_addr + page_offset;
+        update_data.alt_buffer_data.width = fb_virtual_x;
+        update_data.alt_buffer_data.height = screen->height;
+        update_data.alt_buffer_data.alt_update_region =
+                update_data.update_region;
+        fb_page_reap[fb_page] = !update_data.update_marker;
+        if (!update_data.update_marker)
+            update_data.update_marker = disp_next_marker();
+        fb_page_marker[fb_page] = update_data.update_marker;
+        fb_page = (fb_page + 1) % fb_pages;
+    }
+#endif
+
+#ifdef ENABLE_STATS
+    stats_update_submit(update_data.update_marker, mode, dest_rect, partial);
+#endif
     if (ioctl(fd_fbdev, MXCFB_SEND_UPDATE, &update_data) < 0) {
         fprintf(stderr, "Failed sending udpdate\n");
-        return;
+#ifdef ENABLE_STATS
+        stats_update_complete(update_data.update_marker, false, false);
+#endif
+        return 0;
     }
+#ifdef ENABLE_STATS
+    stats_update_sent(update_data.update_marker);
+    disp_track_marker(update_data.update_marker);
+#endif
 
-    if (wait) {
-        update_marker_data.update_marker = marker_value;
-        if (ioctl(fd_fbdev, MXCFB_WAIT_FOR_UPDATE_COMPLETE,
-                &update_marker_data) < 0) {
-            fprintf(stderr, "Failed waiting for update complete\n");
-        }
+    if (wait)
+        disp_wait_complete(update_data.update_marker);
+#ifdef ENABLE_STATS
+    return update_data.update_marker;
+#endif
+#endif
+    return 0;
+}
+
+// Time in ms the panel power is kept on after updates complete
+void disp_set_powerdown_delay(uint32_t delay_ms) {
+#if defined(BUILD_NEKOINK)
+    if (ioctl(fd_fbdev, MXCFB_SET_PWRDOWN_DELAY, &delay_ms) < 0) {
+        fprintf(stderr, "Failed to set power down delay\n");
+        return;
     }
 #endif
+#ifdef ENABLE_STATS
+    stats_power_delay(delay_ms);
+#endif
+}
+
+// Check if an update returned by disp_present has completed, without waiting
+bool disp_update_done(uint32_t marker) {
+#if defined(BUILD_PC_SIM) && defined(ENABLE_WAVEFORM_SIM)
+    if (wfsim_ready)
+        return wfsim_update_done(marker);
+    return true;
+#elif defined(BUILD_NEKOINK) && defined(ENABLE_STATS)
+    pthread_mutex_lock(&marker_lock);
+    bool done = stats_update_done(marker);
+    pthread_mutex_unlock(&marker_lock);
+    return done;
+#else
+    return true;
+#endif
 }
 
-Canvas *disp_load_image(char *filename) {
+// Advance the simulated panel and show it. Returns the time in ms until the
+// next step is due, or -1 if nothing is pending.
+int disp_step(void) {
+#if defined(BUILD_PC_SIM) && defined(ENABLE_WAVEFORM_SIM)
+    if (!wfsim_ready)
+        return -1;
+    Rect dirty;
+    int timeout = wfsim_step(&dirty);
+    if (dirty.w && dirty.h)
+        disp_render_panel(dirty);
+    return timeout;
+#else
+    return -1;
+#endif
+}
+
+// Readable whenever an update has completed since last read, -1 if completion
+// isn't tracked. Reading it is left to the caller.
+int disp_get_complete_fd(void) {
+#if defined(BUILD_NEKOINK) && defined(ENABLE_STATS)
+    return complete_fd;
+#else
+    return -1;
+#endif
+}
+
+// Size of the screen actually in use, which may differ from the configured
+// one on SIM with display scaling
+void disp_get_size(int *w, int *h) {
+    *w = screen->width;
+    *h = screen->height;
+}
+
+// Load an image, optionally collecting its histogram while copying it out
+Canvas *disp_load_image(char *filename, Histogram *hist) {
     int x, y, n;
     unsigned char *data = stbi_load(filename, &x, &y, &n, 0);
+    if (!data)
+        return NULL;
     PixelFormat fmt;
     if (n == 1)
         fmt = PIXFMT_Y8;
@@ -949,6 +2299,33 @@ Canvas *disp_load_image(char *filename) {
     else
         return NULL; // YA88 not supported
     Canvas *canvas = disp_create(x, y, fmt);
-    memcpy(canvas->buf, data, x * y * n);
+    if (!hist) {
+        memcpy(canvas->buf, data, x * y * n);
+    }
+    else {
+        memset(hist, 0, sizeof(*hist));
+        uint8_t *rdptr = data;
+        uint8_t *wrptr = canvas->buf;
+        for (int i = 0; i < x * y; i++) {
+            if (n == 1) {
+                hist->bins[0][*rdptr]++;
+            }
+            else {
+                hist->bins[0][rdptr[0]]++;
+                hist->bins[1][rdptr[1]]++;
+                hist->bins[2][rdptr[2]]++;
+                hist->luma[disp_luma(rdptr[0], rdptr[1], rdptr[2])]++;
+            }
+            for (int j = 0; j < n; j++)
+                *wrptr++ = *rdptr++;
+        }
+        if (n == 1) {
+            memcpy(hist->bins[1], hist->bins[0], sizeof(hist->bins[0]));
+            memcpy(hist->bins[2], hist->bins[0], sizeof(hist->bins[0]));
+            memcpy(hist->luma, hist->bins[0], sizeof(hist->luma));
+        }
+        hist->count = x * y;
+    }
+    stbi_image_free(data);
     return canvas;
 }
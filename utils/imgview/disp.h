@@ -74,12 +74,50 @@ typedef struct {
     int h;
 } Rect;
 
+typedef struct {
+    uint32_t bins[3][256]; // R, G, B. Greyscale images fill all three
+    uint32_t luma[256];
+    uint32_t count;
+} Histogram;
+
+typedef struct {
+    float brightness; // Added to the output, -1.0 to 1.0
+    float contrast; // Scale around mid grey, 1.0 to keep
+    float gamma; // Midtone adjustment, above 1.0 brightens, 1.0 to keep
+    uint8_t black_point; // Input level mapped to black
+    uint8_t white_point; // Input level mapped to white
+    bool auto_levels; // Derive black/ white point from the histogram
+} ToneParams;
+
+// Weights of R, G, B out of 256, used wherever colour is turned into grey
+static inline uint8_t disp_luma(uint8_t r, uint8_t g, uint8_t b) {
+    return (r * 80 + g * 144 + b * 32) >> 8;
+}
+
+int disp_get_bpp(PixelFormat fmt);
 Canvas *disp_create(int w, int h, PixelFormat fmt);
 void disp_free(Canvas *canvas);
 void disp_conv(Canvas *dst, Canvas *src);
 void disp_scale_image_fit(Canvas *src, Canvas *dst);
 void disp_filtering_image(Canvas *src, Rect src_rect, Rect dst_rect);
+Rect disp_filtering_image_update(Canvas *src, Rect rect);
+int disp_scroll(Canvas *src, int dy, Rect *rects, int max_rects);
+Rect disp_union_rect(Rect a, Rect b);
+int disp_tiles_to_rects(const bool *mask, int tiles_x, int tiles_y,
+        int tile_size, int w, int h, Rect *rects, int max_rects,
+        bool *merged);
+int disp_filtering_classified(Canvas *src, Rect *rects, WaveformMode *modes,
+        int max_rects);
+int disp_filtering_frame(Canvas *src, Rect *rects, int max_rects);
+Rect disp_draw_line(int x0, int y0, int x1, int y1, int width, uint8_t color);
 void disp_init(void);
 void disp_deinit(void);
-void disp_present(Rect dest_rect, WaveformMode mode, bool partial, bool wait);
-Canvas *disp_load_image(char *filename);
\ No newline at end of file
+uint32_t disp_present(Rect dest_rect, WaveformMode mode, bool partial,
+        bool wait);
+bool disp_update_done(uint32_t marker);
+int disp_step(void);
+void disp_set_powerdown_delay(uint32_t delay_ms);
+int disp_get_complete_fd(void);
+void disp_get_size(int *w, int *h);
+void disp_set_tone(ToneParams *params, Histogram *hist);
+Canvas *disp_load_image(char *filename, Histogram *hist);
\ No newline at end of file
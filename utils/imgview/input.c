@@ -0,0 +1,213 @@
+//
+// NekoInk Image Viewer
+// Copyright 2024 Wenting Zhang
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+// 
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+//
+// File : input.c
+// Brief: Touch and pen input from evdev
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <linux/input.h>
+#include "config.h"
+#include "input.h"
+
+// Only single touch/ pen is tracked, multi-touch devices report slot 0
+static struct {
+    struct input_absinfo abs_x;
+    struct input_absinfo abs_y;
+    int screen_w;
+    int screen_h;
+    int slot;
+    int raw_x;
+    int raw_y;
+    bool down; // State reported by the device
+    bool was_down; // State reported to the application
+    bool realtime; // Device timestamps couldn't be switched to monotonic
+    int last_x;
+    int last_y;
+} input;
+
+static int input_scale(int val, struct input_absinfo *abs, int size) {
+    int range = abs->maximum - abs->minimum;
+    if (range <= 0)
+        return val;
+    val = (val - abs->minimum) * (size - 1) / range;
+    if (val < 0) val = 0;
+    if (val >= size) val = size - 1;
+    return val;
+}
+
+int input_open(const char *devname, int screen_w, int screen_h) {
+    int fd = open(devname, O_RDONLY | O_NONBLOCK);
+    if (fd < 0) {
+        fprintf(stderr, "Failed to open input device %s\n", devname);
+        return -1;
+    }
+
+    // Prefer multi-touch axes, fall back to single touch/ pen axes
+    if ((ioctl(fd, EVIOCGABS(ABS_MT_POSITION_X), &input.abs_x) < 0) ||
+            (input.abs_x.maximum == 0)) {
+        if (ioctl(fd, EVIOCGABS(ABS_X), &input.abs_x) < 0) {
+            fprintf(stderr, "Failed to get X axis info for %s\n", devname);
+            close(fd);
+            return -1;
+        }
+    }
+    if ((ioctl(fd, EVIOCGABS(ABS_MT_POSITION_Y), &input.abs_y) < 0) ||
+            (input.abs_y.maximum == 0)) {
+        if (ioctl(fd, EVIOCGABS(ABS_Y), &input.abs_y) < 0) {
+            fprintf(stderr, "Failed to get Y axis info for %s\n", devname);
+            close(fd);
+            return -1;
+        }
+    }
+    printf("Opened input device %s, X %d-%d, Y %d-%d\n", devname,
+            input.abs_x.minimum, input.abs_x.maximum,
+            input.abs_y.minimum, input.abs_y.maximum);
+
+    // Timestamps are compared against CLOCK_MONOTONIC for latency
+    int clock_id = CLOCK_MONOTONIC;
+    input.realtime = (ioctl(fd, EVIOCSCLOCKID, &clock_id) < 0);
+
+    input.screen_w = screen_w;
+    input.screen_h = screen_h;
+    input.slot = 0;
+    input.down = false;
+    input.was_down = false;
+    return fd;
+}
+
+void input_close(int fd) {
+    close(fd);
+}
+
+// Current CLOCK_MONOTONIC time, the clock input timestamps are in
+uint64_t input_get_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static uint64_t input_event_us(struct input_event *ev) {
+#ifdef input_event_sec
+    uint64_t us = (uint64_t)ev->input_event_sec * 1000000 + ev->input_event_usec;
+#else
+    uint64_t us = (uint64_t)ev->time.tv_sec * 1000000 + ev->time.tv_usec;
+#endif
+    if (input.realtime) {
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        uint64_t real_us = (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+        us = us - real_us + input_get_us();
+    }
+    return us;
+}
+
+// Read all pending events, translated to pointer events. Returns the number of
+// events written, or -1 if the device is gone. Events left once the buffer is
+// full stay in the device for the next call.
+int input_read(int fd, InputEvent *events, int max_events) {
+    struct input_event ev[64];
+    int count = 0;
+
+    while (count < max_events) {
+        // Every pointer event ends with a report, so reading no more device
+        // events than there is room left never produces more than fits
+        int space = max_events - count;
+        size_t size = sizeof(ev);
+        if (space < 64)
+            size = space * sizeof(*ev);
+        ssize_t len = read(fd, ev, size);
+        if (len == 0)
+            return -1;
+        if (len < 0) {
+            if (errno == EINTR)
+                continue;
+            // ENODEV once the device is unplugged
+            return (errno == EAGAIN) ? count : -1;
+        }
+        uint64_t read_us = input_get_us();
+        for (int i = 0; i < len / sizeof(*ev); i++) {
+            if (ev[i].type == EV_ABS) {
+                switch (ev[i].code) {
+                case ABS_MT_SLOT:
+                    input.slot = ev[i].value;
+                    break;
+                case ABS_MT_TRACKING_ID:
+                    if (input.slot == 0)
+                        input.down = (ev[i].value >= 0);
+                    break;
+                case ABS_MT_POSITION_X:
+                    if (input.slot == 0)
+                        input.raw_x = ev[i].value;
+                    break;
+                case ABS_MT_POSITION_Y:
+                    if (input.slot == 0)
+                        input.raw_y = ev[i].value;
+                    break;
+                case ABS_X:
+                    input.raw_x = ev[i].value;
+                    break;
+                case ABS_Y:
+                    input.raw_y = ev[i].value;
+                    break;
+                }
+            }
+            else if ((ev[i].type == EV_KEY) && (ev[i].code == BTN_TOUCH)) {
+                input.down = (ev[i].value != 0);
+            }
+            else if ((ev[i].type == EV_SYN) && (ev[i].code == SYN_REPORT)) {
+                int x = input_scale(input.raw_x, &input.abs_x, input.screen_w);
+                int y = input_scale(input.raw_y, &input.abs_y, input.screen_h);
+                if (input.down && !input.was_down) {
+                    events[count].type = INPUT_DOWN;
+                }
+                else if (input.down && ((x != input.last_x) ||
+                        (y != input.last_y))) {
+                    events[count].type = INPUT_MOVE;
+                }
+                else if (!input.down && input.was_down) {
+                    events[count].type = INPUT_UP;
+                }
+                else {
+                    continue;
+                }
+                events[count].x = x;
+                events[count].y = y;
+                events[count].time_us = input_event_us(&ev[i]);
+                events[count].read_us = read_us;
+                count++;
+                input.was_down = input.down;
+                input.last_x = x;
+                input.last_y = y;
+            }
+        }
+    }
+    return count;
+}
@@ -0,0 +1,45 @@
+//
+// NekoInk Image Viewer
+// Copyright 2024 Wenting Zhang
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+// 
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+//
+// File : input.h
+// Brief: Touch and pen input from evdev
+//
+#pragma once
+
+typedef enum {
+    INPUT_DOWN,
+    INPUT_MOVE,
+    INPUT_UP
+} InputEventType;
+
+typedef struct {
+    InputEventType type;
+    int x; // In screen coordinates
+    int y;
+    uint64_t time_us; // Kernel timestamp of the event, CLOCK_MONOTONIC
+    uint64_t read_us; // When it was read by the application
+} InputEvent;
+
+int input_open(const char *devname, int screen_w, int screen_h);
+void input_close(int fd);
+int input_read(int fd, InputEvent *events, int max_events);
+uint64_t input_get_us(void);
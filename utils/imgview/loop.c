@@ -0,0 +1,148 @@
+//
+// NekoInk Image Viewer
+// Copyright 2024 Wenting Zhang
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+// 
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+//
+// File : loop.c
+// Brief: Event loop waiting on fds and timers
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include "config.h"
+#include "loop.h"
+
+// Event loop sleeping until any registered fd is ready or the timeout set by
+// the caller expires. The timeout is kept in a timerfd watched along with the
+// other fds, so there is no polling and nothing runs while idle.
+// Events carry the slot index along with its generation, bumped whenever the
+// slot is freed. An fd removed by a handler can't have its remaining events
+// in the batch delivered to a new fd taking the same slot.
+typedef struct {
+    int fd;
+    uint32_t generation;
+    LoopHandler handler;
+    void *arg;
+} LoopSource;
+
+static int epoll_fd = -1;
+static int timer_fd = -1;
+static LoopSource sources[LOOP_MAX_FDS];
+
+static void loop_timer_handler(int fd, uint32_t events, void *arg) {
+    // Only drained here, the caller works out what is due after waking up
+    uint64_t expirations;
+    ssize_t len = read(fd, &expirations, sizeof(expirations));
+    (void)len;
+}
+
+int loop_init(void) {
+    for (int i = 0; i < LOOP_MAX_FDS; i++) {
+        sources[i].fd = -1;
+        sources[i].generation = 0;
+    }
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd < 0) {
+        fprintf(stderr, "Failed to create epoll instance\n");
+        return -1;
+    }
+    timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if ((timer_fd < 0) ||
+            (loop_add_fd(timer_fd, loop_timer_handler, NULL) < 0)) {
+        fprintf(stderr, "Failed to create loop timer\n");
+        loop_deinit();
+        return -1;
+    }
+    return 0;
+}
+
+void loop_deinit(void) {
+    if (timer_fd >= 0)
+        close(timer_fd);
+    if (epoll_fd >= 0)
+        close(epoll_fd);
+    timer_fd = -1;
+    epoll_fd = -1;
+}
+
+// Watch fd for input, handler is called from loop_wait once it's readable
+int loop_add_fd(int fd, LoopHandler handler, void *arg) {
+    if (epoll_fd < 0)
+        return -1;
+    for (int i = 0; i < LOOP_MAX_FDS; i++) {
+        if (sources[i].fd >= 0)
+            continue;
+        struct epoll_event ev = {
+            .events = EPOLLIN,
+            .data.u64 = ((uint64_t)sources[i].generation << 32) | i
+        };
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0)
+            return -1;
+        sources[i].fd = fd;
+        sources[i].handler = handler;
+        sources[i].arg = arg;
+        return 0;
+    }
+    fprintf(stderr, "Too many fds in event loop\n");
+    return -1;
+}
+
+// Should be called before the fd is closed
+void loop_remove_fd(int fd) {
+    for (int i = 0; i < LOOP_MAX_FDS; i++) {
+        if (sources[i].fd == fd) {
+            epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+            sources[i].fd = -1;
+            sources[i].generation++;
+            return;
+        }
+    }
+}
+
+// Sleep until any fd is ready or timeout in ms has passed, -1 for no timeout,
+// then run handlers of ready fds. Returns early if interrupted by a signal.
+void loop_wait(int timeout) {
+    struct itimerspec its = {0};
+    if (timeout > 0) {
+        its.it_value.tv_sec = timeout / 1000;
+        its.it_value.tv_nsec = (timeout % 1000) * 1000000;
+    }
+    // Zero value disarms the timer
+    timerfd_settime(timer_fd, 0, &its, NULL);
+
+    struct epoll_event events[LOOP_MAX_FDS];
+    int count = epoll_wait(epoll_fd, events, LOOP_MAX_FDS,
+            (timeout == 0) ? 0 : -1);
+    if ((count < 0) && (errno != EINTR))
+        fprintf(stderr, "Failed waiting for events\n");
+    for (int i = 0; i < count; i++) {
+        LoopSource *source = &sources[(uint32_t)events[i].data.u64];
+        // Handlers may remove sources, including ones still in the list
+        if ((source->fd >= 0) &&
+                (source->generation == (uint32_t)(events[i].data.u64 >> 32)))
+            source->handler(source->fd, events[i].events, source->arg);
+    }
+}
@@ -27,9 +27,22 @@
 #include <stdlib.h>
 #include <stdbool.h>
 #include <stdint.h>
+#include <string.h>
 #include <time.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/epoll.h>
 #include "config.h"
 #include "disp.h"
+#include "stroke.h"
+#include "anim.h"
+#include "server.h"
+#include "refresh.h"
+#include "coalesce.h"
+#include "power.h"
+
+#include "input.h"
+#include "loop.h"
 
 #if defined(BUILD_PC_SIM)
 #include <SDL.h>
@@ -42,6 +55,54 @@
     printf("%.2f ms\n", (double)t / CLOCKS_PER_SEC * 1000);\
 }
 
+// Leave the main loop on SIGINT/ SIGTERM so the display is shut down cleanly
+static volatile sig_atomic_t quit_requested;
+
+static void signal_handler(int sig) {
+    quit_requested = 1;
+}
+
+// Earlier of two timeouts in ms, -1 meaning none
+static int main_min_timeout(int a, int b) {
+    if (a < 0)
+        return b;
+    if (b < 0)
+        return a;
+    return (a < b) ? a : b;
+}
+
+static void main_input_handler(int fd, uint32_t events, void *arg) {
+    int *fd_input = arg;
+    InputEvent input_events[64];
+    int count = -1;
+    // A removed device is reported as a hangup, which stays set and would
+    // wake the loop forever
+    if (!(events & (EPOLLHUP | EPOLLERR)))
+        count = input_read(fd, input_events, 64);
+    if (count < 0) {
+        // Device is gone
+        loop_remove_fd(fd);
+        input_close(fd);
+        *fd_input = -1;
+        return;
+    }
+    for (int i = 0; i < count; i++) {
+        stroke_note_input(input_events[i].time_us, input_events[i].read_us);
+        if (input_events[i].type == INPUT_DOWN)
+            stroke_pen_down(input_events[i].x, input_events[i].y);
+        else if (input_events[i].type == INPUT_MOVE)
+            stroke_pen_move(input_events[i].x, input_events[i].y);
+        else
+            stroke_pen_up();
+    }
+}
+
+static void main_complete_handler(int fd, uint32_t events, void *arg) {
+    uint64_t count;
+    ssize_t len = read(fd, &count, sizeof(count));
+    (void)len;
+}
+
 void dump_hex(uint8_t *buf, int count) {
     for (int i = 0; i < count / 16; i++) {
         for (int j = 0; j < 16; j++) {
@@ -53,71 +114,206 @@ void dump_hex(uint8_t *buf, int count) {
 
 int main(int argc, char *argv[]) {
     if (argc < 2) {
-        fprintf(stderr, "Usage: imgview <path_to_image>\n");
+        fprintf(stderr, "Usage: imgview <path_to_image> [input_device]\n");
+        fprintf(stderr, "       imgview -d [input_device]\n");
         return 1;
     }
+    // Daemon mode, images are shown on request from socket clients
+    bool daemon_mode = (strcmp(argv[1], "-d") == 0);
 
 #ifdef ENABLE_COLOR
-    Canvas *target = disp_create(DISP_WIDTH, DISP_HEIGHT, PIXFMT_RGB888);
+    PixelFormat target_fmt = PIXFMT_RGB888;
 #else
-    Canvas *target = disp_create(DISP_WIDTH, DISP_HEIGHT, PIXFMT_Y8);
+    PixelFormat target_fmt = PIXFMT_Y8;
 #endif
-    Rect zero_rect = {0};
+    struct sigaction sa = {.sa_handler = signal_handler};
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
 
     disp_init();
 
-    Canvas *image;
-    
-    printf("Loading image: ");
-    PROFILE(image = disp_load_image(argv[1]));
-
-    if (image->pixelFormat != target->pixelFormat) {
-        Canvas *image_new = disp_create(image->width, image->height, target->pixelFormat);
+    // Sized as the screen, which may differ from DISP_WIDTH x DISP_HEIGHT
+    int width, height;
+    disp_get_size(&width, &height);
+    Canvas *target;
+    if (daemon_mode) {
+        // Shared with client processes
+        target = server_create_canvas(width, height, target_fmt);
+        if (!target) {
+            disp_deinit();
+            return 1;
+        }
+    }
+    else {
+        target = disp_create(width, height, target_fmt);
+    }
+    if (loop_init() < 0) {
+        disp_deinit();
+        return 1;
+    }
 
-        printf("Converting image: ");
-        PROFILE(disp_conv(image_new, image));
-        disp_free(image);
-        image = image_new;
+    Anim *anim = NULL;
+    if (daemon_mode) {
+        if (server_open(target) < 0) {
+            server_close();
+            loop_deinit();
+            disp_deinit();
+            return 1;
+        }
+    }
+#ifdef ENABLE_ANIMATION
+    else {
+        anim = anim_load(argv[1], target);
     }
+#endif
 
-    printf("Scaling image: ");
-    PROFILE(disp_scale_image_fit(image, target));
+    if (!anim && !daemon_mode) {
+        Canvas *image;
+        Histogram hist;
 
-    printf("Filtering image: ");
-    PROFILE(disp_filtering_image(target, zero_rect, zero_rect));
+        printf("Loading image: ");
+        PROFILE(image = disp_load_image(argv[1], &hist));
+        if (!image) {
+            fprintf(stderr, "Failed to load image %s\n", argv[1]);
+            loop_deinit();
+            disp_deinit();
+            return 1;
+        }
 
-    printf("Present image: ");
-    PROFILE(disp_present(zero_rect, WVMD_GC16, true, true));
+        ToneParams tone = {
+            .brightness = TONE_BRIGHTNESS,
+            .contrast = TONE_CONTRAST,
+            .gamma = TONE_GAMMA,
+            .black_point = 0,
+            .white_point = 255,
+#ifdef TONE_AUTO_LEVELS
+            .auto_levels = true
+#else
+            .auto_levels = false
+#endif
+        };
+        disp_set_tone(&tone, &hist);
 
-#if defined(BUILD_PC_SIM)
-    SDL_Event event;
-    float time_delta = 0.0f;
-    int last_ticks = SDL_GetTicks();
-    bool running = true;
+        if (image->pixelFormat != target->pixelFormat) {
+            Canvas *image_new = disp_create(image->width, image->height, target->pixelFormat);
+
+            printf("Converting image: ");
+            PROFILE(disp_conv(image_new, image));
+            disp_free(image);
+            image = image_new;
+        }
 
-    while (running) {
-        int cur_ticks = SDL_GetTicks();
-        time_delta -= cur_ticks - last_ticks; // Actual ticks passed since last iteration
-        time_delta += 1000.0f / (float)TARGET_FPS; // Time allocated for this iteration
-        last_ticks = cur_ticks;
+        printf("Scaling image: ");
+        PROFILE(disp_scale_image_fit(image, target));
 
-        // Process SDL events
+#ifdef ENABLE_CLASSIFY
+        Rect rects[CLASSIFY_MAX_RECTS];
+        WaveformMode modes[CLASSIFY_MAX_RECTS];
+        int count;
+
+        printf("Filtering image: ");
+        PROFILE(count = disp_filtering_classified(target, rects, modes,
+                CLASSIFY_MAX_RECTS));
+
+        printf("Present image (%d regions): ", count);
+        PROFILE(for (int i = 0; i < count; i++)
+                disp_present(rects[i], modes[i], true, i == count - 1));
+#else
+        Rect zero_rect = {0};
+
+        printf("Filtering image: ");
+        PROFILE(disp_filtering_image(target, zero_rect, zero_rect));
+
+        printf("Present image: ");
+        PROFILE(disp_present(zero_rect, WVMD_GC16, true, true));
+#endif
+    }
+
+    // Draw with pen/ touch on top of the image
+    int fd_input = -1;
+    if (argc > 2) {
+        fd_input = input_open(argv[2], width, height);
+        if ((fd_input >= 0) &&
+                (loop_add_fd(fd_input, main_input_handler, &fd_input) < 0)) {
+            input_close(fd_input);
+            fd_input = -1;
+        }
+    }
+    // Woken up by finished updates, for animation pacing
+    int fd_complete = disp_get_complete_fd();
+    if (fd_complete >= 0)
+        loop_add_fd(fd_complete, main_complete_handler, NULL);
+
+    // Sleep until there is input, a command, a finished update or a timer
+    // is due. Every part returns how long until it needs to run again.
+    int timeout = 0;
+#if defined(BUILD_PC_SIM)
+    bool running = true;
+#elif defined(BUILD_NEKOINK)
+    bool running = (fd_input >= 0) || anim || daemon_mode;
+#endif
+    while (running && !quit_requested) {
+#if defined(BUILD_PC_SIM)
+        // SDL has no fd to wait on, its events are checked at TARGET_FPS
+        if ((timeout < 0) || (timeout > 1000 / TARGET_FPS))
+            timeout = 1000 / TARGET_FPS;
+#endif
+        loop_wait(timeout);
+#if defined(BUILD_PC_SIM)
+        SDL_Event event;
+        // SDL timestamps are in its own ticks, input latency is left out
+        uint64_t now = input_get_us();
         while (SDL_PollEvent(&event)) {
             if (event.type == SDL_QUIT) {
                 running = false;
             }
-            else {
-                // handle events
+            else if ((event.type == SDL_MOUSEBUTTONDOWN) &&
+                    (event.button.button == SDL_BUTTON_LEFT)) {
+                stroke_note_input(now, now);
+                stroke_pen_down(event.button.x, event.button.y);
+            }
+            else if ((event.type == SDL_MOUSEMOTION) &&
+                    (event.motion.state & SDL_BUTTON_LMASK)) {
+                stroke_note_input(now, now);
+                stroke_pen_move(event.motion.x, event.motion.y);
+            }
+            else if ((event.type == SDL_MOUSEBUTTONUP) &&
+                    (event.button.button == SDL_BUTTON_LEFT)) {
+                stroke_note_input(now, now);
+                stroke_pen_up();
             }
         }
+#elif defined(BUILD_NEKOINK)
+        running = (fd_input >= 0) || anim || daemon_mode;
+#endif
 
-        // Wait for next frame
-        int time_to_wait = time_delta - (SDL_GetTicks() - last_ticks);
-        if (time_to_wait > 0)
-            SDL_Delay(time_to_wait);
-    }
+        timeout = stroke_flush(false);
+        if (anim)
+            timeout = main_min_timeout(timeout, anim_step(anim));
+#ifdef ENABLE_COALESCE
+        timeout = main_min_timeout(timeout, coalesce_step());
 #endif
+#ifdef ENABLE_REFRESH_SCHEDULER
+        timeout = main_min_timeout(timeout, refresh_step());
+#endif
+#ifdef ENABLE_POWER_POLICY
+        timeout = main_min_timeout(timeout, power_step());
+#endif
+        timeout = main_min_timeout(timeout, disp_step());
+    }
 
+    if (fd_input >= 0) {
+        loop_remove_fd(fd_input);
+        input_close(fd_input);
+    }
+    if (anim)
+        anim_free(anim);
+
+#ifdef ENABLE_COALESCE
+    coalesce_flush();
+#endif
+    server_close();
+    loop_deinit();
     disp_deinit();
 
     return 0;
@@ -0,0 +1,108 @@
+//
+// NekoInk Image Viewer
+// Copyright 2024 Wenting Zhang
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+// 
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+//
+// File : mxcfb.h
+// Brief: i.MX EPDC framebuffer interface for the mock backend
+//
+#pragma once
+
+// Definitions of the i.MX EPDC framebuffer interface used by imgview, laid
+// out like the vendor kernel uapi header. Only used for building against the
+// mock backend on machines without the vendor kernel headers.
+
+#include <stdint.h>
+#include <linux/fb.h>
+#include <linux/types.h>
+#include <sys/ioctl.h>
+
+#define GRAYSCALE_8BIT                  0x1
+#define GRAYSCALE_8BIT_INVERTED         0x2
+
+#define AUTO_UPDATE_MODE_REGION_MODE    0
+#define AUTO_UPDATE_MODE_AUTOMATIC_MODE 1
+
+#define UPDATE_SCHEME_SNAPSHOT          0
+#define UPDATE_SCHEME_QUEUE             1
+#define UPDATE_SCHEME_QUEUE_AND_MERGE   2
+
+#define UPDATE_MODE_PARTIAL             0x0
+#define UPDATE_MODE_FULL                0x1
+
+#define TEMP_USE_AMBIENT                0x1000
+
+#define EPDC_FLAG_ENABLE_INVERSION      0x01
+#define EPDC_FLAG_FORCE_MONOCHROME      0x02
+#define EPDC_FLAG_USE_ALT_BUFFER        0x100
+#define EPDC_FLAG_TEST_COLLISION        0x200
+
+#define FB_POWERDOWN_DISABLE            -1
+
+struct mxcfb_rect {
+    __u32 top;
+    __u32 left;
+    __u32 width;
+    __u32 height;
+};
+
+struct mxcfb_waveform_modes {
+    int mode_init;
+    int mode_du;
+    int mode_gc4;
+    int mode_gc8;
+    int mode_gc16;
+    int mode_gc32;
+};
+
+struct mxcfb_alt_buffer_data {
+    __u32 phys_addr;
+    __u32 width; // Width of the entire buffer
+    __u32 height; // Height of the entire buffer
+    struct mxcfb_rect alt_update_region; // Region within the buffer
+};
+
+struct mxcfb_update_data {
+    struct mxcfb_rect update_region;
+    __u32 waveform_mode;
+    __u32 update_mode;
+    __u32 update_marker;
+    int temp;
+    unsigned int flags;
+    int dither_mode;
+    int quant_bit;
+    struct mxcfb_alt_buffer_data alt_buffer_data;
+};
+
+struct mxcfb_update_marker_data {
+    __u32 update_marker;
+    __u32 collision_test;
+};
+
+#define MXCFB_SET_WAVEFORM_MODES        _IOW('F', 0x2B, struct mxcfb_waveform_modes)
+#define MXCFB_SET_TEMPERATURE           _IOW('F', 0x2C, int32_t)
+#define MXCFB_SET_AUTO_UPDATE_MODE      _IOW('F', 0x2D, __u32)
+#define MXCFB_SEND_UPDATE               _IOW('F', 0x2E, struct mxcfb_update_data)
+#define MXCFB_WAIT_FOR_UPDATE_COMPLETE  _IOWR('F', 0x2F, struct mxcfb_update_marker_data)
+#define MXCFB_SET_PWRDOWN_DELAY         _IOW('F', 0x30, int32_t)
+#define MXCFB_GET_PWRDOWN_DELAY         _IOR('F', 0x31, int32_t)
+#define MXCFB_SET_UPDATE_SCHEME         _IOW('F', 0x32, __u32)
+// Not in every vendor kernel, returns once the update has started
+#define MXCFB_WAIT_FOR_UPDATE_SUBMISSION _IOW('F', 0x37, __u32)
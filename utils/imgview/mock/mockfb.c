@@ -0,0 +1,568 @@
+//
+// NekoInk Image Viewer
+// Copyright 2024 Wenting Zhang
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+// 
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+//
+// File : mockfb.c
+// Brief: User space mock of the i.MX EPDC framebuffer
+//
+#define _GNU_SOURCE // memfd_create
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <linux/mxcfb.h>
+#include "config.h"
+
+// User space stand-in for the i.MX EPDC framebuffer, so the device build can
+// run on any Linux machine. Linked with -Wl,--wrap=open,--wrap=close,
+// --wrap=ioctl, see MOCK=1 in Makefile. Opening /dev/fb0 returns a memfd
+// backed framebuffer, ioctls on it are handled here and everything else is
+// passed through.
+//
+// Updates are run by a thread modelling the EPDC: each takes a fixed time per
+// waveform mode, up to MOCK_LUTS run at once, and an update overlapping a
+// running one waits for it and reports a collision. With the queue and merge
+// scheme, overlapping compatible updates still queued are merged. Panel
+// power is modelled with the power down delay, updates starting with the
+// rails off take longer.
+//
+// Environment:
+//   MOCKFB_LATENCY   Update time in ms per waveform mode number, comma
+//                    separated starting from mode 0
+//   MOCKFB_POWERUP   Rail power up time in ms
+//   MOCKFB_LUTS      Updates running at once
+//   MOCKFB_SCALE     Divide all times by this, to run tests faster
+//   MOCKFB_TRACE     Print every update as it starts and completes
+//   MOCKFB_DUMP      Write what the panel shows as PGM on close
+//
+// Collisions are tested on rects, the real EPDC only collides on pixels
+// actually changing in both updates.
+
+#define MOCK_DEVICE "/dev/fb0"
+#define MOCK_ID "mxc_epdc_fb"
+#define MOCK_PAGES (3) // Virtual yres in screens
+#define MOCK_PHYS_BASE (0x80000000u)
+#define MOCK_MODES (8)
+#define MOCK_QUEUE_SIZE (64)
+#define MOCK_MAX_MERGE (8)
+#define MOCK_MAX_MARKERS (256)
+#define MOCK_TIMEOUT_MS (5000)
+
+static const uint32_t default_latency_ms[MOCK_MODES] = {
+    2000, // INIT
+    260, // DU
+    450, // GC16
+    340, // GC4
+    120, // A2
+    450, 450, 450
+};
+
+typedef struct {
+    struct mxcfb_update_data data;
+    uint32_t markers[MOCK_MAX_MERGE];
+    int marker_count;
+    bool active;
+    bool collision;
+    uint64_t start_us;
+    uint64_t end_us;
+} MockUpdate;
+
+typedef enum {
+    MARKER_FREE,
+    MARKER_QUEUED,
+    MARKER_ACTIVE,
+    MARKER_DONE
+} MarkerState;
+
+typedef struct {
+    uint32_t marker;
+    MarkerState state;
+    bool collision;
+    uint64_t done_us; // For evicting markers never waited on
+} MockMarker;
+
+int __real_open(const char *pathname, int flags, ...);
+int __real_close(int fd);
+int __real_ioctl(int fd, unsigned long request, ...);
+
+static int mock_fd = -1;
+static struct fb_var_screeninfo var;
+static struct fb_fix_screeninfo fix;
+static uint8_t *fb; // Mapping of the memfd, what the application writes
+static uint8_t *panel; // What the panel shows
+static size_t fb_size;
+
+static pthread_t epdc_thread;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+static bool quit;
+static MockUpdate queue[MOCK_QUEUE_SIZE]; // In submission order
+static int queue_count;
+static MockMarker markers[MOCK_MAX_MARKERS];
+static uint32_t scheme = UPDATE_SCHEME_QUEUE_AND_MERGE;
+static int32_t pwrdown_delay;
+static uint64_t rails_off_us; // Rails are off after this if nothing runs
+
+static uint32_t latency_ms[MOCK_MODES];
+static uint32_t powerup_ms = 20;
+static int luts = 16;
+static float scale = 1.0f;
+static bool trace;
+
+static uint64_t mock_get_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void mock_load_config(void) {
+    memcpy(latency_ms, default_latency_ms, sizeof(latency_ms));
+    char *env = getenv("MOCKFB_LATENCY");
+    for (int i = 0; env && *env && (i < MOCK_MODES); i++) {
+        char *end;
+        latency_ms[i] = strtoul(env, &end, 10);
+        env = (*end == ',') ? end + 1 : NULL;
+    }
+    if ((env = getenv("MOCKFB_POWERUP")))
+        powerup_ms = strtoul(env, NULL, 10);
+    if ((env = getenv("MOCKFB_LUTS")) && (atoi(env) > 0))
+        luts = atoi(env);
+    if ((env = getenv("MOCKFB_SCALE")) && (atof(env) > 0.0f))
+        scale = atof(env);
+    trace = (getenv("MOCKFB_TRACE") != NULL);
+}
+
+static MockMarker *mock_find_marker(uint32_t marker) {
+    for (int i = 0; i < MOCK_MAX_MARKERS; i++) {
+        if ((markers[i].state != MARKER_FREE) && (markers[i].marker == marker))
+            return &markers[i];
+    }
+    return NULL;
+}
+
+static bool mock_add_marker(uint32_t marker) {
+    MockMarker *slot = NULL;
+    for (int i = 0; i < MOCK_MAX_MARKERS; i++) {
+        if (markers[i].state == MARKER_FREE) {
+            slot = &markers[i];
+            break;
+        }
+        // Driver keeps markers until waited, drop the oldest never waited
+        if ((markers[i].state == MARKER_DONE) &&
+                (!slot || (markers[i].done_us < slot->done_us)))
+            slot = &markers[i];
+    }
+    if (!slot)
+        return false;
+    slot->marker = marker;
+    slot->state = MARKER_QUEUED;
+    slot->collision = false;
+    return true;
+}
+
+static bool mock_overlap(struct mxcfb_rect *a, struct mxcfb_rect *b) {
+    return (a->left < b->left + b->width) && (b->left < a->left + a->width) &&
+            (a->top < b->top + b->height) && (b->top < a->top + a->height);
+}
+
+static struct mxcfb_rect mock_union(struct mxcfb_rect *a,
+        struct mxcfb_rect *b) {
+    struct mxcfb_rect r;
+    r.left = (a->left < b->left) ? a->left : b->left;
+    r.top = (a->top < b->top) ? a->top : b->top;
+    uint32_t right = a->left + a->width;
+    uint32_t bottom = a->top + a->height;
+    if (b->left + b->width > right) right = b->left + b->width;
+    if (b->top + b->height > bottom) bottom = b->top + b->height;
+    r.width = right - r.left;
+    r.height = bottom - r.top;
+    return r;
+}
+
+// Latch the pixels the update drives to, from the alt buffer if used
+static void mock_latch(MockUpdate *update) {
+    struct mxcfb_rect *r = &update->data.update_region;
+    uint8_t *src = fb;
+    uint32_t stride = var.xres_virtual;
+    struct mxcfb_rect *src_r = r;
+    if (update->data.flags & EPDC_FLAG_USE_ALT_BUFFER) {
+        struct mxcfb_alt_buffer_data *alt = &update->data.alt_buffer_data;
+        src = fb + (alt->phys_addr - fix.smem_start);
+        stride = alt->width;
+        src_r = &alt->alt_update_region;
+    }
+    for (uint32_t y = 0; y < r->height; y++) {
+        memcpy(&panel[(r->top + y) * var.xres + r->left],
+                &src[(src_r->top + y) * stride + src_r->left], r->width);
+    }
+}
+
+static void mock_set_markers(MockUpdate *update, MarkerState state) {
+    for (int i = 0; i < update->marker_count; i++) {
+        MockMarker *marker = mock_find_marker(update->markers[i]);
+        if (!marker)
+            continue;
+        marker->state = state;
+        marker->collision = update->collision;
+        marker->done_us = mock_get_us();
+    }
+}
+
+static void mock_start(MockUpdate *update, uint64_t now, bool rails_on) {
+    uint32_t mode = update->data.waveform_mode;
+    uint64_t duration = latency_ms[(mode < MOCK_MODES) ? mode : 0] * 1000ull;
+    if (!rails_on)
+        duration += powerup_ms * 1000ull;
+    update->active = true;
+    update->start_us = now;
+    update->end_us = now + (uint64_t)(duration / scale);
+    mock_latch(update);
+    mock_set_markers(update, MARKER_ACTIVE);
+    if (trace) {
+        struct mxcfb_rect *r = &update->data.update_region;
+        printf("mockfb: start marker %u mode %u %u,%u %ux%u%s%s\n",
+                update->markers[0], mode, r->left, r->top, r->width,
+                r->height, update->collision ? " collision" : "",
+                rails_on ? "" : " power up");
+    }
+}
+
+static void *mock_epdc_thread(void *arg) {
+    pthread_mutex_lock(&lock);
+    while (!quit) {
+        uint64_t now = mock_get_us();
+
+        // Retire finished updates
+        int running = 0;
+        for (int i = 0; i < queue_count; i++) {
+            if (!queue[i].active)
+                continue;
+            if (queue[i].end_us > now) {
+                running++;
+                continue;
+            }
+            mock_set_markers(&queue[i], MARKER_DONE);
+            if (trace)
+                printf("mockfb: done marker %u after %.1f ms\n",
+                        queue[i].markers[0],
+                        (now - queue[i].start_us) / 1000.0f);
+            memmove(&queue[i], &queue[i + 1],
+                    (queue_count - i - 1) * sizeof(MockUpdate));
+            queue_count--;
+            i--;
+            if (pwrdown_delay >= 0)
+                rails_off_us = now + pwrdown_delay * 1000ull;
+            pthread_cond_broadcast(&cond);
+        }
+
+        // Start queued updates not overlapping anything submitted before
+        for (int i = 0; i < queue_count; i++) {
+            if (queue[i].active)
+                continue;
+            bool blocked = false;
+            for (int j = 0; j < i; j++) {
+                if (mock_overlap(&queue[j].data.update_region,
+                        &queue[i].data.update_region)) {
+                    if (queue[j].active)
+                        queue[i].collision = true;
+                    blocked = true;
+                    break;
+                }
+            }
+            if (blocked || (running >= luts))
+                continue;
+            bool rails_on = (running > 0) || (pwrdown_delay < 0) ||
+                    (now < rails_off_us);
+            mock_start(&queue[i], now, rails_on);
+            running++;
+            pthread_cond_broadcast(&cond);
+        }
+
+        // Sleep until the next update finishes or one is submitted
+        uint64_t next = UINT64_MAX;
+        for (int i = 0; i < queue_count; i++) {
+            if (queue[i].active && (queue[i].end_us < next))
+                next = queue[i].end_us;
+        }
+        if (next == UINT64_MAX) {
+            pthread_cond_wait(&cond, &lock);
+        }
+        else {
+            struct timespec ts;
+            clock_gettime(CLOCK_REALTIME, &ts);
+            uint64_t ns = ts.tv_nsec + (next - now) * 1000;
+            ts.tv_sec += ns / 1000000000;
+            ts.tv_nsec = ns % 1000000000;
+            pthread_cond_timedwait(&cond, &lock, &ts);
+        }
+    }
+    pthread_mutex_unlock(&lock);
+    return NULL;
+}
+
+static int mock_send_update(struct mxcfb_update_data *data) {
+    struct mxcfb_rect *r = &data->update_region;
+    if ((r->width == 0) || (r->height == 0) ||
+            (r->left + r->width > var.xres) || (r->top + r->height > var.yres))
+        return -EINVAL;
+    if (data->flags & EPDC_FLAG_USE_ALT_BUFFER) {
+        struct mxcfb_alt_buffer_data *alt = &data->alt_buffer_data;
+        uint64_t offset = alt->phys_addr - fix.smem_start;
+        uint64_t end = offset + (uint64_t)(alt->alt_update_region.top +
+                alt->alt_update_region.height) * alt->width;
+        if ((alt->phys_addr < fix.smem_start) || (end > fb_size) ||
+                (alt->alt_update_region.width != r->width) ||
+                (alt->alt_update_region.height != r->height))
+            return -EINVAL;
+    }
+
+    pthread_mutex_lock(&lock);
+    if (data->update_marker && !mock_add_marker(data->update_marker)) {
+        pthread_mutex_unlock(&lock);
+        return -ENOMEM;
+    }
+
+    // Merge into a queued update it overlaps, if compatible. Can't be moved
+    // past an overlapping update otherwise.
+    if (scheme == UPDATE_SCHEME_QUEUE_AND_MERGE) {
+        for (int i = queue_count - 1; i >= 0; i--) {
+            MockUpdate *update = &queue[i];
+            if (!mock_overlap(&update->data.update_region, r))
+                continue;
+            if (update->active || (update->marker_count == MOCK_MAX_MERGE) ||
+                    (update->data.waveform_mode != data->waveform_mode) ||
+                    (update->data.update_mode != data->update_mode) ||
+                    (update->data.flags != data->flags) ||
+                    (update->data.alt_buffer_data.phys_addr !=
+                    data->alt_buffer_data.phys_addr))
+                break;
+            update->data.update_region = mock_union(
+                    &update->data.update_region, r);
+            update->data.alt_buffer_data.alt_update_region = mock_union(
+                    &update->data.alt_buffer_data.alt_update_region,
+                    &data->alt_buffer_data.alt_update_region);
+            if (data->update_marker)
+                update->markers[update->marker_count++] = data->update_marker;
+            pthread_mutex_unlock(&lock);
+            return 0;
+        }
+    }
+
+    while ((queue_count == MOCK_QUEUE_SIZE) && !quit)
+        pthread_cond_wait(&cond, &lock);
+    MockUpdate *update = &queue[queue_count++];
+    memset(update, 0, sizeof(*update));
+    update->data = *data;
+    if (data->update_marker)
+        update->markers[update->marker_count++] = data->update_marker;
+    pthread_cond_broadcast(&cond);
+    pthread_mutex_unlock(&lock);
+    return 0;
+}
+
+// Wait for the marker to reach state, the marker is freed once complete
+static int mock_wait_marker(uint32_t marker, MarkerState state,
+        uint32_t *collision) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_sec += MOCK_TIMEOUT_MS / 1000;
+
+    pthread_mutex_lock(&lock);
+    MockMarker *m = mock_find_marker(marker);
+    if (!m) {
+        pthread_mutex_unlock(&lock);
+        return -EINVAL;
+    }
+    while (m->state < state) {
+        if (pthread_cond_timedwait(&cond, &lock, &ts) == ETIMEDOUT) {
+            pthread_mutex_unlock(&lock);
+            return -ETIMEDOUT;
+        }
+    }
+    if (collision)
+        *collision = m->collision;
+    if (state == MARKER_DONE)
+        m->state = MARKER_FREE;
+    pthread_mutex_unlock(&lock);
+    return 0;
+}
+
+static int mock_open_device(void) {
+    mock_load_config();
+    int fd = memfd_create("mockfb", MFD_CLOEXEC);
+    if (fd < 0)
+        return -1;
+
+    memset(&var, 0, sizeof(var));
+    var.xres = DISP_WIDTH;
+    var.yres = DISP_HEIGHT;
+    var.xres_virtual = DISP_WIDTH;
+    var.yres_virtual = DISP_HEIGHT * MOCK_PAGES;
+    var.bits_per_pixel = 8;
+    var.grayscale = GRAYSCALE_8BIT;
+    fb_size = (size_t)var.xres_virtual * var.yres_virtual;
+    memset(&fix, 0, sizeof(fix));
+    strcpy(fix.id, MOCK_ID);
+    fix.smem_start = MOCK_PHYS_BASE;
+    fix.smem_len = fb_size;
+    fix.line_length = var.xres_virtual;
+
+    if (ftruncate(fd, fb_size) < 0) {
+        __real_close(fd);
+        return -1;
+    }
+    // Separate mapping for the panel side, the application maps the fd
+    fb = mmap(NULL, fb_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    panel = malloc((size_t)var.xres * var.yres);
+    if ((fb == MAP_FAILED) || !panel) {
+        __real_close(fd);
+        return -1;
+    }
+    memset(panel, 0xff, (size_t)var.xres * var.yres);
+
+    quit = false;
+    queue_count = 0;
+    memset(markers, 0, sizeof(markers));
+    pwrdown_delay = 0;
+    rails_off_us = 0;
+    pthread_create(&epdc_thread, NULL, mock_epdc_thread, NULL);
+    mock_fd = fd;
+    printf("mockfb: %s as %dx%d %s\n", MOCK_DEVICE, var.xres, var.yres,
+            MOCK_ID);
+    return fd;
+}
+
+static void mock_close_device(void) {
+    // Let updates already queued finish, like the driver would
+    pthread_mutex_lock(&lock);
+    while (queue_count)
+        pthread_cond_wait(&cond, &lock);
+    quit = true;
+    pthread_cond_broadcast(&cond);
+    pthread_mutex_unlock(&lock);
+    pthread_join(epdc_thread, NULL);
+
+    char *dump = getenv("MOCKFB_DUMP");
+    FILE *fp = dump ? fopen(dump, "wb") : NULL;
+    if (fp) {
+        fprintf(fp, "P5\n%d %d\n255\n", var.xres, var.yres);
+        fwrite(panel, var.xres, var.yres, fp);
+        fclose(fp);
+    }
+    munmap(fb, fb_size);
+    free(panel);
+    mock_fd = -1;
+}
+
+int __wrap_open(const char *pathname, int flags, ...) {
+    mode_t mode = 0;
+    if (flags & (O_CREAT | O_TMPFILE)) {
+        va_list args;
+        va_start(args, flags);
+        mode = va_arg(args, mode_t);
+        va_end(args);
+    }
+    if (strcmp(pathname, MOCK_DEVICE) == 0) {
+        if (mock_fd >= 0) {
+            errno = EBUSY;
+            return -1;
+        }
+        return mock_open_device();
+    }
+    return __real_open(pathname, flags, mode);
+}
+
+int __wrap_close(int fd) {
+    if ((fd >= 0) && (fd == mock_fd))
+        mock_close_device();
+    return __real_close(fd);
+}
+
+static int mock_ioctl(unsigned long request, void *arg) {
+    switch (request) {
+    case FBIOGET_FSCREENINFO:
+        *(struct fb_fix_screeninfo *)arg = fix;
+        return 0;
+    case FBIOGET_VSCREENINFO:
+        *(struct fb_var_screeninfo *)arg = var;
+        return 0;
+    case FBIOPUT_VSCREENINFO: {
+        // Only the 8 bit greyscale mode exists, geometry is fixed
+        struct fb_var_screeninfo *v = arg;
+        if (v->bits_per_pixel != 8)
+            return -EINVAL;
+        var.rotate = v->rotate;
+        var.yoffset = v->yoffset;
+        *v = var;
+        return 0;
+    }
+    case MXCFB_SET_WAVEFORM_MODES:
+    case MXCFB_SET_TEMPERATURE:
+    case MXCFB_SET_AUTO_UPDATE_MODE:
+        return 0;
+    case MXCFB_SET_UPDATE_SCHEME:
+        pthread_mutex_lock(&lock);
+        scheme = *(uint32_t *)arg;
+        pthread_mutex_unlock(&lock);
+        return 0;
+    case MXCFB_SET_PWRDOWN_DELAY:
+        pthread_mutex_lock(&lock);
+        pwrdown_delay = *(int32_t *)arg;
+        pthread_mutex_unlock(&lock);
+        return 0;
+    case MXCFB_GET_PWRDOWN_DELAY:
+        *(int32_t *)arg = pwrdown_delay;
+        return 0;
+    case MXCFB_SEND_UPDATE:
+        return mock_send_update(arg);
+    case MXCFB_WAIT_FOR_UPDATE_COMPLETE: {
+        struct mxcfb_update_marker_data *data = arg;
+        return mock_wait_marker(data->update_marker, MARKER_DONE,
+                &data->collision_test);
+    }
+    case MXCFB_WAIT_FOR_UPDATE_SUBMISSION:
+        return mock_wait_marker(*(uint32_t *)arg, MARKER_ACTIVE, NULL);
+    }
+    return -ENOTTY;
+}
+
+int __wrap_ioctl(int fd, unsigned long request, ...) {
+    va_list args;
+    va_start(args, request);
+    void *arg = va_arg(args, void *);
+    va_end(args);
+    if ((fd < 0) || (fd != mock_fd))
+        return __real_ioctl(fd, request, arg);
+    int ret = mock_ioctl(request, arg);
+    if (ret < 0) {
+        errno = -ret;
+        return -1;
+    }
+    return ret;
+}
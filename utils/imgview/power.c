@@ -0,0 +1,79 @@
+//
+// NekoInk Image Viewer
+// Copyright 2024 Wenting Zhang
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+// 
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+//
+// File : power.c
+// Brief: Adaptive panel power down delay
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+#include "config.h"
+#include "disp.h"
+#include "power.h"
+
+// The EPDC turns the panel rails off after the power down delay once updates
+// are done, and turning them back on delays the next update. Idle screens
+// want the rails off right away, but during interaction the delay is raised
+// so following updates find the rails still on. The update rate over a short
+// window tells the two apart.
+static uint32_t update_times[POWER_BURST_UPDATES];
+static uint32_t update_count;
+static bool raised;
+
+static uint32_t power_get_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// Called once per update event, before it is sent. A classified image or a
+// scrolled screen goes out as several presents but is one event, counting
+// each present would take a single image for a burst. Refreshes and screen
+// clears aren't interaction and are left out.
+void power_note_update(void) {
+    uint32_t now = power_get_ms();
+    update_times[update_count++ % POWER_BURST_UPDATES] = now;
+    if (raised || (update_count < POWER_BURST_UPDATES))
+        return;
+    // Oldest of the last POWER_BURST_UPDATES updates
+    uint32_t oldest = update_times[update_count % POWER_BURST_UPDATES];
+    if (now - oldest <= POWER_BURST_WINDOW_MS) {
+        disp_set_powerdown_delay(POWER_BURST_DELAY_MS);
+        raised = true;
+    }
+}
+
+// Drop the delay back once idle. Returns the time in ms until the next step
+// is due, or -1 if nothing is pending.
+int power_step(void) {
+    if (!raised)
+        return -1;
+    uint32_t last = update_times[(update_count - 1) % POWER_BURST_UPDATES];
+    uint32_t idle = power_get_ms() - last;
+    if (idle < POWER_IDLE_MS)
+        return POWER_IDLE_MS - idle;
+    disp_set_powerdown_delay(0);
+    raised = false;
+    return -1;
+}
@@ -0,0 +1,142 @@
+//
+// NekoInk Image Viewer
+// Copyright 2024 Wenting Zhang
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+// 
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+//
+// File : refresh.c
+// Brief: Ghosting aware clearing refresh of screen tiles
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+#include "config.h"
+#include "disp.h"
+#include "refresh.h"
+
+// Fast updates (DU/ A2) leave ghosting behind which builds up over repeated
+// updates. The screen is split into tiles counting fast updates since the
+// last full update with a clearing waveform, tiles over the threshold are
+// cleared by themselves once the screen is idle.
+static uint16_t *tile_count;
+static bool *tile_mask;
+static int tiles_x;
+static int tiles_y;
+static int screen_w;
+static int screen_h;
+static uint32_t last_update;
+static bool pending; // Any tile over the threshold
+
+static uint32_t refresh_get_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+void refresh_init(int width, int height) {
+    screen_w = width;
+    screen_h = height;
+    tiles_x = (width + REFRESH_TILE_SIZE - 1) / REFRESH_TILE_SIZE;
+    tiles_y = (height + REFRESH_TILE_SIZE - 1) / REFRESH_TILE_SIZE;
+    tile_count = calloc(tiles_x * tiles_y, sizeof(uint16_t));
+    tile_mask = malloc(tiles_x * tiles_y * sizeof(bool));
+    pending = false;
+}
+
+void refresh_deinit(void) {
+    free(tile_count);
+    free(tile_mask);
+    tile_count = NULL;
+}
+
+// Called for every update sent to the screen
+void refresh_note_update(Rect rect, WaveformMode mode, bool partial) {
+    if (!tile_count)
+        return;
+    last_update = refresh_get_ms();
+
+    bool fast = (mode == WVMD_DU) || (mode == WVMD_A2);
+    // Partial updates only drive changed pixels, they don't clear anything
+    bool clearing = ((mode == WVMD_GC16) || (mode == WVMD_INIT)) && !partial;
+    if (!fast && !clearing)
+        return;
+
+    int tx0 = rect.x / REFRESH_TILE_SIZE;
+    int ty0 = rect.y / REFRESH_TILE_SIZE;
+    int tx1 = (rect.x + rect.w - 1) / REFRESH_TILE_SIZE;
+    int ty1 = (rect.y + rect.h - 1) / REFRESH_TILE_SIZE;
+    for (int ty = ty0; ty <= ty1; ty++) {
+        for (int tx = tx0; tx <= tx1; tx++) {
+            uint16_t *count = &tile_count[ty * tiles_x + tx];
+            if (fast) {
+                if (*count < UINT16_MAX)
+                    (*count)++;
+                if (*count >= REFRESH_THRESHOLD)
+                    pending = true;
+                continue;
+            }
+            // Only clear tiles fully covered, tiles on the edge of the screen
+            // are smaller
+            int x0 = tx * REFRESH_TILE_SIZE;
+            int y0 = ty * REFRESH_TILE_SIZE;
+            int x1 = x0 + REFRESH_TILE_SIZE;
+            int y1 = y0 + REFRESH_TILE_SIZE;
+            if (x1 > screen_w) x1 = screen_w;
+            if (y1 > screen_h) y1 = screen_h;
+            if ((rect.x <= x0) && (rect.y <= y0) &&
+                    (rect.x + rect.w >= x1) && (rect.y + rect.h >= y1))
+                *count = 0;
+        }
+    }
+}
+
+// Collect tiles needing refresh into rects, returns the count
+static int refresh_collect(Rect *rects, int max_rects, uint16_t threshold) {
+    for (int i = 0; i < tiles_x * tiles_y; i++)
+        tile_mask[i] = (tile_count[i] >= threshold);
+    return disp_tiles_to_rects(tile_mask, tiles_x, tiles_y, REFRESH_TILE_SIZE,
+            screen_w, screen_h, rects, max_rects, NULL);
+}
+
+// Refresh tiles over the threshold if the screen has been idle long enough,
+// or tiles far over it right away. Returns the time in ms until the next
+// step is due, or -1 if nothing is pending.
+int refresh_step(void) {
+    if (!tile_count || !pending)
+        return -1;
+
+    uint32_t idle = refresh_get_ms() - last_update;
+    uint16_t threshold = REFRESH_THRESHOLD;
+    if (idle < REFRESH_IDLE_MS)
+        threshold = REFRESH_FORCE_THRESHOLD;
+
+    Rect rects[REFRESH_MAX_RECTS];
+    int count = refresh_collect(rects, REFRESH_MAX_RECTS, threshold);
+    // Counters are reset as the updates are noted
+    for (int i = 0; i < count; i++)
+        disp_present(rects[i], REFRESH_WAVEFORM, false, false);
+
+    if (threshold == REFRESH_THRESHOLD) {
+        pending = false;
+        return -1;
+    }
+    return REFRESH_IDLE_MS - idle;
+}
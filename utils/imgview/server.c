@@ -0,0 +1,587 @@
+//
+// NekoInk Image Viewer
+// Copyright 2024 Wenting Zhang
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+// 
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+//
+// File : server.c
+// Brief: Display daemon with a local socket command interface
+//
+#define _GNU_SOURCE // accept4
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <grp.h>
+#include "config.h"
+#include "disp.h"
+#include "server.h"
+#include "stats.h"
+#include "coalesce.h"
+#include "loop.h"
+#include "power.h"
+
+// Daemon mode: the display is initialized once, then clients send one command
+// per line over a UNIX socket and get a single line reply, "OK" or "ERR ...".
+//
+//   show <file>                    Show image on the full screen
+//   region <x> <y> <w> <h> <file>  Fit image into a region, update only that
+//   mode <init|du|gc16|gc4|a2>     Waveform used for following updates
+//   mode auto                      Waveform picked per tile by content for
+//                                  show, gc16 for others (ENABLE_CLASSIFY)
+//   clear                          Clear screen to white with a full flash
+//   damage <x> <y> <w> <h> [mode]  Update region drawn by a shm client
+//   scroll <dy> [mode]             Shm canvas scrolled up by dy rows (down if
+//                                  negative), only new rows are dithered
+//   info                           Reply "OK <width> <height> <format>"
+//   stats <name>                   Write update log, JSON if *.json else CSV
+//   latency [name]                 Touch to photon latency summary, or log
+//
+// Logs are written into SERVER_EXPORT_DIR, the name can't contain a path.
+//
+// e.g. echo "show /root/a.png" | socat - UNIX-CONNECT:/tmp/imgview.sock
+//
+// Pixels of the screen canvas are mirrored in POSIX shared memory
+// (SERVER_SHM_NAME), so client processes can draw into it directly and only
+// report the damaged region. See client.h for the client side. The geometry
+// and format are only kept here, damaged regions are copied out of the shared
+// memory before they are processed.
+
+typedef struct {
+    int fd; // -1 if unused
+    int len;
+    char line[SERVER_LINE_MAX];
+} ServerClient;
+
+static int listen_fd = -1;
+static ServerClient clients[SERVER_MAX_CLIENTS];
+static Canvas *screen;
+static WaveformMode server_mode = WVMD_GC16;
+#ifdef ENABLE_CLASSIFY
+static bool server_mode_auto = true;
+#endif
+static int shm_fd = -1;
+static uint8_t *shm_pixels;
+static size_t shm_size;
+
+static const char *mode_names[] = {
+    [WVMD_INIT] = "init",
+    [WVMD_DU] = "du",
+    [WVMD_GC16] = "gc16",
+    [WVMD_GC4] = "gc4",
+    [WVMD_A2] = "a2"
+};
+
+static void server_fill_white(Canvas *canvas) {
+    memset(canvas->buf, 0xff, (size_t)canvas->width * canvas->height *
+            (disp_get_bpp(canvas->pixelFormat) / 8));
+}
+
+// Create the screen canvas along with the shared memory mirroring its pixels,
+// returns NULL on failure
+Canvas *server_create_canvas(int w, int h, PixelFormat fmt) {
+    shm_size = (size_t)w * h * (disp_get_bpp(fmt) / 8);
+    // An object left behind could have been created by anyone, start afresh
+    shm_unlink(SERVER_SHM_NAME);
+    shm_fd = shm_open(SERVER_SHM_NAME, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC,
+            SERVER_SHM_MODE);
+    if (shm_fd < 0) {
+        fprintf(stderr, "Failed to create shared memory %s\n", SERVER_SHM_NAME);
+        return NULL;
+    }
+    bool ok = true;
+#ifdef SERVER_SHM_GROUP
+    struct group *grp = getgrnam(SERVER_SHM_GROUP);
+    ok = grp && (fchown(shm_fd, -1, grp->gr_gid) == 0);
+#endif
+    // Not narrowed by the umask
+    ok = ok && (fchmod(shm_fd, SERVER_SHM_MODE) == 0);
+    if (!ok || (ftruncate(shm_fd, shm_size) < 0)) {
+        fprintf(stderr, "Failed to set up shared memory\n");
+        goto fail;
+    }
+    shm_pixels = mmap(NULL, shm_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+            shm_fd, 0);
+    if (shm_pixels == MAP_FAILED) {
+        fprintf(stderr, "Failed to map shared memory\n");
+        shm_pixels = NULL;
+        goto fail;
+    }
+    return disp_create(w, h, fmt);
+
+fail:
+    close(shm_fd);
+    shm_fd = -1;
+    shm_unlink(SERVER_SHM_NAME);
+    return NULL;
+}
+
+// A client shrinking the shared memory would fault the daemon on access
+static bool server_shm_valid(void) {
+    struct stat st;
+    return (fstat(shm_fd, &st) == 0) && ((size_t)st.st_size == shm_size);
+}
+
+// Copy a rect of the shared memory into the screen canvas, or back
+static void server_shm_copy(Rect rect, bool to_shm) {
+    size_t bypp = disp_get_bpp(screen->pixelFormat) / 8;
+    for (int y = rect.y; y < rect.y + rect.h; y++) {
+        size_t offset = ((size_t)y * screen->width + rect.x) * bypp;
+        if (to_shm)
+            memcpy(&shm_pixels[offset], &screen->buf[offset], rect.w * bypp);
+        else
+            memcpy(&screen->buf[offset], &shm_pixels[offset], rect.w * bypp);
+    }
+}
+
+static void server_accept(int fd, uint32_t events, void *arg);
+
+static void server_drop(ServerClient *client) {
+    loop_remove_fd(client->fd);
+    close(client->fd);
+    client->fd = -1;
+}
+
+// Socket is served from the event loop, which should be set up first
+int server_open(Canvas *target) {
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    strncpy(addr.sun_path, SERVER_SOCKET_PATH, sizeof(addr.sun_path) - 1);
+
+    listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (listen_fd < 0) {
+        fprintf(stderr, "Failed to create socket\n");
+        return -1;
+    }
+    // Remove the socket left by a previous instance
+    unlink(SERVER_SOCKET_PATH);
+    if ((bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) ||
+            (listen(listen_fd, SERVER_MAX_CLIENTS) < 0)) {
+        fprintf(stderr, "Failed to listen on %s: %s\n", SERVER_SOCKET_PATH,
+                strerror(errno));
+        close(listen_fd);
+        listen_fd = -1;
+        return -1;
+    }
+
+    if (loop_add_fd(listen_fd, server_accept, NULL) < 0) {
+        close(listen_fd);
+        listen_fd = -1;
+        return -1;
+    }
+    for (int i = 0; i < SERVER_MAX_CLIENTS; i++)
+        clients[i].fd = -1;
+    // Matches the screen after init, regions are dithered against this
+    screen = target;
+    server_fill_white(screen);
+    memset(shm_pixels, 0xff, shm_size);
+    printf("Listening on %s\n", SERVER_SOCKET_PATH);
+    return 0;
+}
+
+void server_close(void) {
+    for (int i = 0; i < SERVER_MAX_CLIENTS; i++) {
+        if (clients[i].fd >= 0)
+            server_drop(&clients[i]);
+    }
+    if (listen_fd >= 0) {
+        loop_remove_fd(listen_fd);
+        close(listen_fd);
+        unlink(SERVER_SOCKET_PATH);
+        listen_fd = -1;
+    }
+    if (shm_fd >= 0) {
+        munmap(shm_pixels, shm_size);
+        close(shm_fd);
+        shm_unlink(SERVER_SHM_NAME);
+        shm_pixels = NULL;
+        shm_fd = -1;
+    }
+}
+
+static void server_reply(ServerClient *client, const char *msg) {
+    char buf[256];
+    int len = snprintf(buf, sizeof(buf), "%s\n", msg);
+    if (len >= (int)sizeof(buf)) {
+        len = sizeof(buf) - 1;
+        buf[len - 1] = '\n';
+    }
+    // Replies are short, a client not reading them is simply dropped
+    if (send(client->fd, buf, len, MSG_NOSIGNAL) != len)
+        server_drop(client);
+}
+
+// Load the image fitted into the rect of the screen canvas
+static bool server_load_image(const char *filename, Rect rect) {
+    Histogram hist;
+    Canvas *image = disp_load_image((char *)filename, &hist);
+    if (!image)
+        return false;
+
+    ToneParams tone = {
+        .brightness = TONE_BRIGHTNESS,
+        .contrast = TONE_CONTRAST,
+        .gamma = TONE_GAMMA,
+        .black_point = 0,
+        .white_point = 255,
+#ifdef TONE_AUTO_LEVELS
+        .auto_levels = true
+#else
+        .auto_levels = false
+#endif
+    };
+    disp_set_tone(&tone, &hist);
+
+    if (image->pixelFormat != screen->pixelFormat) {
+        Canvas *image_new = disp_create(image->width, image->height,
+                screen->pixelFormat);
+        disp_conv(image_new, image);
+        disp_free(image);
+        image = image_new;
+    }
+
+    if ((rect.w == screen->width) && (rect.h == screen->height)) {
+        server_fill_white(screen);
+        disp_scale_image_fit(image, screen);
+    }
+    else {
+        Canvas *fit = disp_create(rect.w, rect.h, screen->pixelFormat);
+        server_fill_white(fit);
+        disp_scale_image_fit(image, fit);
+        int bypp = disp_get_bpp(screen->pixelFormat) / 8;
+        for (int y = 0; y < rect.h; y++) {
+            memcpy(&screen->buf[((rect.y + y) * screen->width + rect.x) * bypp],
+                    &fit->buf[y * rect.w * bypp], rect.w * bypp);
+        }
+        disp_free(fit);
+    }
+    disp_free(image);
+    // Clients see what's on the screen
+    server_shm_copy(rect, true);
+    return true;
+}
+
+// Region updates may be held back and merged with others close in time. The
+// rects are from one request, which counts as a single update event.
+static void server_present(const Rect *rects, int count, WaveformMode mode) {
+#ifdef ENABLE_POWER_POLICY
+    if (count > 0)
+        power_note_update();
+#endif
+    for (int i = 0; i < count; i++) {
+#ifdef ENABLE_COALESCE
+        coalesce_add(rects[i], mode, true);
+#else
+        disp_present(rects[i], mode, true, false);
+#endif
+    }
+}
+
+static void server_cmd_show(ServerClient *client, const char *filename) {
+    Rect full = {0, 0, screen->width, screen->height};
+    if (!server_load_image(filename, full)) {
+        server_reply(client, "ERR failed to load image");
+        return;
+    }
+#ifdef ENABLE_COALESCE
+    // Keep the order with region updates still held back
+    coalesce_flush();
+#endif
+    Rect zero_rect = {0};
+#ifdef ENABLE_POWER_POLICY
+    power_note_update();
+#endif
+#ifdef ENABLE_CLASSIFY
+    // Quantized per tile by content, the waveform is too unless a mode is set
+    Rect rects[CLASSIFY_MAX_RECTS];
+    WaveformMode modes[CLASSIFY_MAX_RECTS];
+    int count = disp_filtering_classified(screen, rects, modes,
+            CLASSIFY_MAX_RECTS);
+    if (server_mode_auto) {
+        for (int i = 0; i < count; i++)
+            disp_present(rects[i], modes[i], true, false);
+    }
+    else {
+        disp_present(zero_rect, server_mode, true, false);
+    }
+#else
+    disp_filtering_image(screen, zero_rect, zero_rect);
+    disp_present(zero_rect, server_mode, true, false);
+#endif
+    server_reply(client, "OK");
+}
+
+// Rect from a client is within the screen. Compared without adding, so
+// huge values can't overflow past the check.
+static bool server_rect_valid(Rect rect) {
+    return (rect.x >= 0) && (rect.y >= 0) && (rect.w > 0) && (rect.h > 0) &&
+            (rect.w <= screen->width - rect.x) &&
+            (rect.h <= screen->height - rect.y);
+}
+
+static void server_cmd_region(ServerClient *client, Rect rect,
+        const char *filename) {
+    if (!server_rect_valid(rect)) {
+        server_reply(client, "ERR region out of screen");
+        return;
+    }
+    if (!server_load_image(filename, rect)) {
+        server_reply(client, "ERR failed to load image");
+        return;
+    }
+    // Pixels around the region may change as well
+    rect = disp_filtering_image_update(screen, rect);
+    server_present(&rect, 1, server_mode);
+    server_reply(client, "OK");
+}
+
+static int server_parse_mode(const char *name) {
+    for (int i = 0; i < (int)(sizeof(mode_names) / sizeof(mode_names[0])); i++) {
+        if (strcmp(name, mode_names[i]) == 0)
+            return i;
+    }
+    return -1;
+}
+
+static void server_cmd_mode(ServerClient *client, const char *name) {
+#ifdef ENABLE_CLASSIFY
+    if (strcmp(name, "auto") == 0) {
+        server_mode_auto = true;
+        server_mode = WVMD_GC16;
+        server_reply(client, "OK");
+        return;
+    }
+#endif
+    int mode = server_parse_mode(name);
+    if (mode < 0) {
+        server_reply(client, "ERR unknown mode");
+        return;
+    }
+    server_mode = (WaveformMode)mode;
+#ifdef ENABLE_CLASSIFY
+    server_mode_auto = false;
+#endif
+    server_reply(client, "OK");
+}
+
+// Pixels are already in the canvas, only dither and present. The reply is
+// sent once the region is dithered, the client may draw into it again after.
+static void server_cmd_damage(ServerClient *client, Rect rect,
+        const char *mode_name) {
+    int mode = server_mode;
+    if (mode_name[0] && ((mode = server_parse_mode(mode_name)) < 0)) {
+        server_reply(client, "ERR unknown mode");
+        return;
+    }
+    if (!server_rect_valid(rect)) {
+        server_reply(client, "ERR region out of screen");
+        return;
+    }
+    if (!server_shm_valid()) {
+        server_reply(client, "ERR shared memory resized");
+        return;
+    }
+    server_shm_copy(rect, false);
+    rect = disp_filtering_image_update(screen, rect);
+    server_present(&rect, 1, (WaveformMode)mode);
+    server_reply(client, "OK");
+}
+
+// Canvas already holds the scrolled content, only the exposed rows are dithered
+static void server_cmd_scroll(ServerClient *client, int dy,
+        const char *mode_name) {
+    int mode = server_mode;
+    if (mode_name[0] && ((mode = server_parse_mode(mode_name)) < 0)) {
+        server_reply(client, "ERR unknown mode");
+        return;
+    }
+    if ((dy >= screen->height) || (dy <= -screen->height)) {
+        server_reply(client, "ERR scroll out of screen");
+        return;
+    }
+    if (!server_shm_valid()) {
+        server_reply(client, "ERR shared memory resized");
+        return;
+    }
+    Rect full = {0, 0, screen->width, screen->height};
+    server_shm_copy(full, false);
+    Rect rects[SERVER_SCROLL_MAX_RECTS];
+    int count = disp_scroll(screen, dy, rects, SERVER_SCROLL_MAX_RECTS);
+    server_present(rects, count, (WaveformMode)mode);
+    server_reply(client, "OK");
+}
+
+static void server_cmd_clear(ServerClient *client) {
+    Rect zero_rect = {0};
+#ifdef ENABLE_COALESCE
+    coalesce_flush();
+#endif
+    server_fill_white(screen);
+    memset(shm_pixels, 0xff, shm_size);
+    disp_filtering_image(screen, zero_rect, zero_rect);
+    disp_present(zero_rect, WVMD_INIT, false, false);
+    server_reply(client, "OK");
+}
+
+#ifdef ENABLE_STATS
+// Logs are written as the daemon user, so only into the export directory
+static void server_cmd_export(ServerClient *client, const char *name,
+        int (*export)(const char *filename)) {
+    if (!name[0] || (name[0] == '.') || strchr(name, '/')) {
+        server_reply(client, "ERR invalid log name");
+        return;
+    }
+    char path[PATH_MAX];
+    if (snprintf(path, sizeof(path), "%s/%s", SERVER_EXPORT_DIR, name) >=
+            (int)sizeof(path)) {
+        server_reply(client, "ERR invalid log name");
+        return;
+    }
+    mkdir(SERVER_EXPORT_DIR, 0755);
+    if (export(path) < 0)
+        server_reply(client, "ERR failed to write log");
+    else
+        server_reply(client, "OK");
+}
+#endif
+
+static void server_command(ServerClient *client, char *line) {
+    char *cmd = strtok(line, " \t\r");
+    // Rest of the line is the argument, file names may contain spaces
+    char *arg = strtok(NULL, "\r");
+    if (!cmd)
+        return;
+
+    if ((strcmp(cmd, "show") == 0) && arg) {
+        server_cmd_show(client, arg);
+    }
+    else if ((strcmp(cmd, "region") == 0) && arg) {
+        Rect rect;
+        int pos;
+        if (sscanf(arg, "%d %d %d %d %n", &rect.x, &rect.y, &rect.w, &rect.h,
+                &pos) != 4)
+            server_reply(client, "ERR usage: region <x> <y> <w> <h> <file>");
+        else
+            server_cmd_region(client, rect, arg + pos);
+    }
+    else if ((strcmp(cmd, "damage") == 0) && arg) {
+        Rect rect;
+        int pos;
+        if (sscanf(arg, "%d %d %d %d %n", &rect.x, &rect.y, &rect.w, &rect.h,
+                &pos) != 4)
+            server_reply(client, "ERR usage: damage <x> <y> <w> <h> [mode]");
+        else
+            server_cmd_damage(client, rect, arg + pos);
+    }
+    else if ((strcmp(cmd, "scroll") == 0) && arg) {
+        int dy;
+        int pos;
+        if ((sscanf(arg, "%d %n", &dy, &pos) != 1) || (dy == 0))
+            server_reply(client, "ERR usage: scroll <dy> [mode]");
+        else
+            server_cmd_scroll(client, dy, arg + pos);
+    }
+    else if ((strcmp(cmd, "mode") == 0) && arg) {
+        server_cmd_mode(client, arg);
+    }
+    else if (strcmp(cmd, "info") == 0) {
+        char reply[64];
+        snprintf(reply, sizeof(reply), "OK %d %d %d", screen->width,
+                screen->height, screen->pixelFormat);
+        server_reply(client, reply);
+    }
+#ifdef ENABLE_STATS
+    else if ((strcmp(cmd, "stats") == 0) && arg) {
+        server_cmd_export(client, arg, stats_export);
+    }
+    else if ((strcmp(cmd, "latency") == 0) && arg) {
+        server_cmd_export(client, arg, stats_export_interactions);
+    }
+    else if (strcmp(cmd, "latency") == 0) {
+        char reply[200];
+        strcpy(reply, "OK ");
+        if (stats_latency_summary(reply + 3, sizeof(reply) - 3) < 0)
+            server_reply(client, "ERR out of memory");
+        else
+            server_reply(client, reply);
+    }
+#endif
+    else if (strcmp(cmd, "clear") == 0) {
+        server_cmd_clear(client);
+    }
+    else {
+        server_reply(client, "ERR unknown command");
+    }
+}
+
+static void server_receive(int fd, uint32_t events, void *arg) {
+    ServerClient *client = arg;
+    int count = read(client->fd, &client->line[client->len],
+            SERVER_LINE_MAX - client->len);
+    if (count <= 0) {
+        if ((count < 0) && (errno == EAGAIN))
+            return;
+        server_drop(client);
+        return;
+    }
+    client->len += count;
+
+    // Execute every complete line received
+    char *start = client->line;
+    char *end;
+    while ((client->fd >= 0) &&
+            (end = memchr(start, '\n', client->len - (start - client->line)))) {
+        *end = '\0';
+        server_command(client, start);
+        start = end + 1;
+    }
+    if (client->fd < 0)
+        return;
+    client->len -= start - client->line;
+    memmove(client->line, start, client->len);
+    if (client->len == SERVER_LINE_MAX) {
+        server_reply(client, "ERR line too long");
+        client->len = 0;
+    }
+}
+
+static void server_accept(int fd, uint32_t events, void *arg) {
+    int client_fd = accept4(fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (client_fd < 0)
+        return;
+    for (int i = 0; i < SERVER_MAX_CLIENTS; i++) {
+        if (clients[i].fd < 0) {
+            if (loop_add_fd(client_fd, server_receive, &clients[i]) < 0)
+                break;
+            clients[i].fd = client_fd;
+            clients[i].len = 0;
+            return;
+        }
+    }
+    fprintf(stderr, "Too many clients\n");
+    close(client_fd);
+}
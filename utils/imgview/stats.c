@@ -0,0 +1,527 @@
+//
+// NekoInk Image Viewer
+// Copyright 2024 Wenting Zhang
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+// 
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+//
+// File : stats.c
+// Brief: Display update latency telemetry
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include "config.h"
+#include "disp.h"
+#include "stats.h"
+
+// Every update sent to the EPDC is recorded in a ring, newest overwriting the
+// oldest. Submit and complete may be called from different threads.
+static UpdateRecord records[STATS_RING_SIZE];
+static uint32_t record_count; // Total recorded, newest at record_count - 1
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t start_us;
+
+// Pen input matched to the update showing it, by marker
+static InteractionRecord interactions[STATS_INTERACTION_RING_SIZE];
+static uint32_t interaction_count;
+
+// Panel power down delay, to tell which updates found the rails still on
+static uint32_t power_delay_ms;
+static uint64_t power_changed_us;
+static uint64_t power_raised_us; // Total time with a non zero delay
+static uint32_t power_raise_count;
+static uint64_t last_complete_us;
+// Submitted and not completed, including ones already dropped from the ring
+static uint32_t in_flight;
+
+// Read outside of stats_lock, completion threads never wait on the file
+static pthread_mutex_t temp_lock = PTHREAD_MUTEX_INITIALIZER;
+static int cached_temp = STATS_TEMP_UNKNOWN;
+static uint64_t temp_read_us;
+
+static const char *mode_names[] = {
+    [WVMD_INIT] = "init",
+    [WVMD_DU] = "du",
+    [WVMD_GC16] = "gc16",
+    [WVMD_GC4] = "gc4",
+    [WVMD_A2] = "a2"
+};
+#define MODE_COUNT (sizeof(mode_names) / sizeof(mode_names[0]))
+
+// Region size classes, as fraction of the screen area
+static const char *size_names[] = {"<1%", "<10%", "<50%", ">=50%"};
+#define SIZE_COUNT (sizeof(size_names) / sizeof(size_names[0]))
+
+// Latency histogram buckets, 1ms to 4s in powers of 2
+#define HIST_BUCKETS (13)
+
+// Touch to photon latency is split into reading the input, rendering it
+// (including holding it for the next update), getting the update accepted by
+// the driver, and the update itself (including waiting for earlier ones)
+enum {
+    STAGE_INPUT,
+    STAGE_RENDER,
+    STAGE_QUEUE,
+    STAGE_WAVEFORM,
+    STAGE_TOTAL,
+    STAGE_COUNT
+};
+static const char *stage_names[] = {
+    "input", "render", "queue", "waveform", "total"
+};
+
+typedef struct {
+    InteractionRecord record;
+    uint32_t stage_us[STAGE_COUNT];
+} InteractionLatency;
+
+static uint64_t stats_get_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// Panel temperature changes slowly, read it at most once per second
+static int stats_read_temp(uint64_t now) {
+    pthread_mutex_lock(&temp_lock);
+#ifdef STATS_TEMP_FILE
+    if ((temp_read_us == 0) || (now - temp_read_us >= 1000000)) {
+        temp_read_us = now;
+        FILE *fp = fopen(STATS_TEMP_FILE, "r");
+        if (fp) {
+            int millideg;
+            if (fscanf(fp, "%d", &millideg) == 1)
+                cached_temp = millideg / 1000;
+            fclose(fp);
+        }
+    }
+#endif
+    int temp = cached_temp;
+    pthread_mutex_unlock(&temp_lock);
+    return temp;
+}
+
+static UpdateRecord *stats_find(uint32_t marker) {
+    uint32_t count = (record_count < STATS_RING_SIZE) ?
+            record_count : STATS_RING_SIZE;
+    // Pending ones are among the newest
+    for (uint32_t i = 1; i <= count; i++) {
+        UpdateRecord *record = &records[(record_count - i) % STATS_RING_SIZE];
+        if (record->marker == marker)
+            return record;
+    }
+    return NULL;
+}
+
+void stats_init(void) {
+    start_us = stats_get_us();
+    record_count = 0;
+    interaction_count = 0;
+    power_delay_ms = 0;
+    power_raised_us = 0;
+    power_raise_count = 0;
+    in_flight = 0;
+}
+
+void stats_update_submit(uint32_t marker, WaveformMode mode, Rect rect,
+        bool partial) {
+    uint64_t now = stats_get_us();
+    int temp = stats_read_temp(now);
+    pthread_mutex_lock(&stats_lock);
+    UpdateRecord *record = &records[record_count++ % STATS_RING_SIZE];
+    // Its completion won't find it anymore
+    if ((record_count > STATS_RING_SIZE) && !record->completed && in_flight)
+        in_flight--;
+    memset(record, 0, sizeof(*record));
+    record->marker = marker;
+    record->mode = mode;
+    record->rect = rect;
+    record->partial = partial;
+    record->temp = temp;
+    record->submit_us = now - start_us;
+    // Rails stay on while updating and for the power down delay after
+    record->rails_on = (in_flight > 0) || ((last_complete_us != 0) &&
+            (record->submit_us - last_complete_us < power_delay_ms * 1000ull));
+    in_flight++;
+    pthread_mutex_unlock(&stats_lock);
+}
+
+// Update was accepted by the driver
+void stats_update_sent(uint32_t marker) {
+    uint64_t now = stats_get_us();
+    pthread_mutex_lock(&stats_lock);
+    UpdateRecord *record = stats_find(marker);
+    if (record)
+        record->sent_us = now - start_us;
+    pthread_mutex_unlock(&stats_lock);
+}
+
+// timed is false if the update finished at an unknown time
+void stats_update_complete(uint32_t marker, bool timed, bool collision) {
+    uint64_t now = stats_get_us();
+    pthread_mutex_lock(&stats_lock);
+    UpdateRecord *record = stats_find(marker);
+    if (record && !record->completed && in_flight)
+        in_flight--;
+    last_complete_us = now - start_us;
+    if (record) {
+        if (!record->sent_us)
+            record->sent_us = now - start_us;
+        record->completed = true;
+        record->timed = timed;
+        record->collision = collision;
+        record->complete_us = now - start_us;
+    }
+    pthread_mutex_unlock(&stats_lock);
+}
+
+// Input shown by the update with marker, times in CLOCK_MONOTONIC us
+void stats_interaction(uint32_t marker, uint64_t input_us, uint64_t read_us,
+        uint64_t render_us) {
+    pthread_mutex_lock(&stats_lock);
+    InteractionRecord *record =
+            &interactions[interaction_count++ % STATS_INTERACTION_RING_SIZE];
+    record->marker = marker;
+    // Input may predate stats_init
+    record->input_us = (input_us > start_us) ? (input_us - start_us) : 0;
+    record->read_us = (read_us > start_us) ? (read_us - start_us) : 0;
+    record->render_us = render_us - start_us;
+    pthread_mutex_unlock(&stats_lock);
+}
+
+// Power down delay set on the EPDC
+void stats_power_delay(uint32_t delay_ms) {
+    uint64_t now = stats_get_us() - start_us;
+    pthread_mutex_lock(&stats_lock);
+    if (power_delay_ms)
+        power_raised_us += now - power_changed_us;
+    else if (delay_ms)
+        power_raise_count++;
+    power_delay_ms = delay_ms;
+    power_changed_us = now;
+    pthread_mutex_unlock(&stats_lock);
+}
+
+bool stats_update_done(uint32_t marker) {
+    pthread_mutex_lock(&stats_lock);
+    UpdateRecord *record = stats_find(marker);
+    // Dropped from the ring means long done
+    bool done = !record || record->completed;
+    pthread_mutex_unlock(&stats_lock);
+    return done;
+}
+
+static int stats_size_class(Rect rect) {
+    int area = rect.w * rect.h;
+    int screen_area = DISP_WIDTH * DISP_HEIGHT;
+    if (area * 100 < screen_area)
+        return 0;
+    else if (area * 10 < screen_area)
+        return 1;
+    else if (area * 2 < screen_area)
+        return 2;
+    return 3;
+}
+
+static int stats_compare_u32(const void *a, const void *b) {
+    uint32_t va = *(const uint32_t *)a;
+    uint32_t vb = *(const uint32_t *)b;
+    return (va > vb) - (va < vb);
+}
+
+// Copy completed records with known latency, oldest first
+static int stats_snapshot(UpdateRecord *out) {
+    pthread_mutex_lock(&stats_lock);
+    uint32_t count = (record_count < STATS_RING_SIZE) ?
+            record_count : STATS_RING_SIZE;
+    int n = 0;
+    for (uint32_t i = record_count - count; i != record_count; i++) {
+        UpdateRecord *record = &records[i % STATS_RING_SIZE];
+        if (record->completed)
+            out[n++] = *record;
+    }
+    pthread_mutex_unlock(&stats_lock);
+    return n;
+}
+
+// Interactions whose update completed at a known time, oldest first
+static int stats_interaction_snapshot(InteractionLatency *out) {
+    pthread_mutex_lock(&stats_lock);
+    uint32_t count = (interaction_count < STATS_INTERACTION_RING_SIZE) ?
+            interaction_count : STATS_INTERACTION_RING_SIZE;
+    int n = 0;
+    for (uint32_t i = interaction_count - count; i != interaction_count; i++) {
+        InteractionRecord *record =
+                &interactions[i % STATS_INTERACTION_RING_SIZE];
+        UpdateRecord *update = stats_find(record->marker);
+        if (!update || !update->completed || !update->timed)
+            continue;
+        InteractionLatency *l = &out[n++];
+        l->record = *record;
+        l->stage_us[STAGE_INPUT] = record->read_us - record->input_us;
+        l->stage_us[STAGE_RENDER] = record->render_us - record->read_us;
+        l->stage_us[STAGE_QUEUE] = update->sent_us - record->render_us;
+        l->stage_us[STAGE_WAVEFORM] = update->complete_us - update->sent_us;
+        l->stage_us[STAGE_TOTAL] = update->complete_us - record->input_us;
+    }
+    pthread_mutex_unlock(&stats_lock);
+    return n;
+}
+
+// Sort latency of each stage into stage_us, STAGE_COUNT arrays of n
+static void stats_sort_stages(InteractionLatency *snap, int n,
+        uint32_t *stage_us) {
+    for (int s = 0; s < STAGE_COUNT; s++) {
+        uint32_t *latency = &stage_us[s * n];
+        for (int i = 0; i < n; i++)
+            latency[i] = snap[i].stage_us[s];
+        qsort(latency, n, sizeof(uint32_t), stats_compare_u32);
+    }
+}
+
+// One line summary of touch to photon latency, for querying it live. Returns
+// the length written like snprintf, 0 if no interaction was recorded yet (buf
+// still reads "count 0"), or -1 if out of memory.
+int stats_latency_summary(char *buf, size_t len) {
+    InteractionLatency *snap =
+            malloc(sizeof(InteractionLatency) * STATS_INTERACTION_RING_SIZE);
+    uint32_t *stage_us = malloc(sizeof(uint32_t) * STAGE_COUNT *
+            STATS_INTERACTION_RING_SIZE);
+    if (!snap || !stage_us) {
+        free(snap);
+        free(stage_us);
+        return -1;
+    }
+    int n = stats_interaction_snapshot(snap);
+    stats_sort_stages(snap, n, stage_us);
+
+    int pos;
+    if (n == 0) {
+        snprintf(buf, len, "count 0");
+        pos = 0;
+    }
+    else {
+        pos = snprintf(buf, len, "count %d ms p50/p90/max", n);
+    }
+    for (int s = 0; (s < STAGE_COUNT) && (n > 0); s++) {
+        uint32_t *latency = &stage_us[s * n];
+        if ((size_t)pos >= len)
+            break;
+        pos += snprintf(buf + pos, len - pos, " %s %.1f/%.1f/%.1f",
+                stage_names[s], latency[n / 2] / 1000.0f,
+                latency[n * 9 / 10] / 1000.0f, latency[n - 1] / 1000.0f);
+    }
+
+    free(snap);
+    free(stage_us);
+    return pos;
+}
+
+// Print latency summary and histograms per waveform mode and region size
+void stats_print(FILE *fp) {
+    UpdateRecord *snap = malloc(sizeof(UpdateRecord) * STATS_RING_SIZE);
+    uint32_t *latency = malloc(sizeof(uint32_t) * STATS_RING_SIZE);
+    if (!snap || !latency) {
+        free(snap);
+        free(latency);
+        return;
+    }
+    int n = stats_snapshot(snap);
+
+    fprintf(fp, "Update latency (ms) of the last %d updates\n", n);
+    fprintf(fp, "mode  size   count    p50    p90    max collisions\n");
+    for (int mode = 0; mode < (int)MODE_COUNT; mode++) {
+        for (int size = 0; size < (int)SIZE_COUNT; size++) {
+            int count = 0, collisions = 0;
+            for (int i = 0; i < n; i++) {
+                if ((snap[i].mode != mode) || !snap[i].timed ||
+                        (stats_size_class(snap[i].rect) != size))
+                    continue;
+                latency[count++] = snap[i].complete_us - snap[i].submit_us;
+                collisions += snap[i].collision;
+            }
+            if (count == 0)
+                continue;
+            qsort(latency, count, sizeof(uint32_t), stats_compare_u32);
+            fprintf(fp, "%-5s %-5s %6d %6.1f %6.1f %6.1f %10d\n",
+                    mode_names[mode], size_names[size], count,
+                    latency[count / 2] / 1000.0f,
+                    latency[count * 9 / 10] / 1000.0f,
+                    latency[count - 1] / 1000.0f, collisions);
+        }
+    }
+
+    fprintf(fp, "Latency histogram, updates up to each bucket (ms)\n");
+    fprintf(fp, "mode ");
+    for (int b = 0; b < HIST_BUCKETS; b++)
+        fprintf(fp, " %5d", 1 << b);
+    fprintf(fp, "  more\n");
+    for (int mode = 0; mode < (int)MODE_COUNT; mode++) {
+        int hist[HIST_BUCKETS + 1] = {0};
+        int count = 0;
+        for (int i = 0; i < n; i++) {
+            if ((snap[i].mode != mode) || !snap[i].timed)
+                continue;
+            uint32_t ms = (snap[i].complete_us - snap[i].submit_us) / 1000;
+            int b = 0;
+            while ((b < HIST_BUCKETS) && (ms > (1u << b)))
+                b++;
+            hist[b]++;
+            count++;
+        }
+        if (count == 0)
+            continue;
+        fprintf(fp, "%-5s", mode_names[mode]);
+        for (int b = 0; b <= HIST_BUCKETS; b++)
+            fprintf(fp, " %5d", hist[b]);
+        fprintf(fp, "\n");
+    }
+
+    char summary[256];
+    if (stats_latency_summary(summary, sizeof(summary)) > 0)
+        fprintf(fp, "Touch to photon latency, %s\n", summary);
+
+    // Latency gained by keeping the rails on, against the time they were
+    // kept on for it
+    for (int on = 0; on <= 1; on++) {
+        int count = 0;
+        for (int i = 0; i < n; i++) {
+            if (snap[i].timed && (snap[i].rails_on == on))
+                latency[count++] = snap[i].complete_us - snap[i].submit_us;
+        }
+        if (count == 0)
+            continue;
+        qsort(latency, count, sizeof(uint32_t), stats_compare_u32);
+        fprintf(fp, "Updates with rails %s: %d, p50 %.1f ms\n",
+                on ? "on" : "off", count, latency[count / 2] / 1000.0f);
+    }
+    pthread_mutex_lock(&stats_lock);
+    uint64_t now = stats_get_us() - start_us;
+    uint64_t raised = power_raised_us;
+    if (power_delay_ms)
+        raised += now - power_changed_us;
+    fprintf(fp, "Power down delay raised %u times, %.1f s of %.1f s\n",
+            power_raise_count, raised / 1e6f, now / 1e6f);
+    pthread_mutex_unlock(&stats_lock);
+
+    free(snap);
+    free(latency);
+}
+
+// Write all records in the ring to a file, JSON if the name ends in .json,
+// otherwise CSV. Returns 0 on success.
+int stats_export(const char *filename) {
+    UpdateRecord *snap = malloc(sizeof(UpdateRecord) * STATS_RING_SIZE);
+    if (!snap)
+        return -1;
+    int n = stats_snapshot(snap);
+    FILE *fp = fopen(filename, "w");
+    if (!fp) {
+        free(snap);
+        return -1;
+    }
+
+    size_t len = strlen(filename);
+    bool json = (len > 5) && (strcmp(filename + len - 5, ".json") == 0);
+    if (json)
+        fprintf(fp, "[\n");
+    else
+        fprintf(fp, "marker,mode,x,y,w,h,partial,temp,submit_us,latency_us,"
+                "collision,rails_on\n");
+    for (int i = 0; i < n; i++) {
+        UpdateRecord *r = &snap[i];
+        // Unknown latency is written as -1
+        int64_t latency = r->timed ? (int64_t)(r->complete_us - r->submit_us) : -1;
+        if (json) {
+            fprintf(fp, "  {\"marker\": %u, \"mode\": \"%s\", \"x\": %d, "
+                    "\"y\": %d, \"w\": %d, \"h\": %d, \"partial\": %s, "
+                    "\"temp\": %d, \"submit_us\": %llu, \"latency_us\": %lld, "
+                    "\"collision\": %s, \"rails_on\": %s}%s\n",
+                    r->marker, mode_names[r->mode], r->rect.x, r->rect.y,
+                    r->rect.w, r->rect.h, r->partial ? "true" : "false",
+                    r->temp, (unsigned long long)r->submit_us,
+                    (long long)latency, r->collision ? "true" : "false",
+                    r->rails_on ? "true" : "false", (i == n - 1) ? "" : ",");
+        }
+        else {
+            fprintf(fp, "%u,%s,%d,%d,%d,%d,%d,%d,%llu,%lld,%d,%d\n",
+                    r->marker, mode_names[r->mode], r->rect.x, r->rect.y,
+                    r->rect.w, r->rect.h, r->partial, r->temp,
+                    (unsigned long long)r->submit_us, (long long)latency,
+                    r->collision, r->rails_on);
+        }
+    }
+    if (json)
+        fprintf(fp, "]\n");
+
+    free(snap);
+    return (fclose(fp) == 0) ? 0 : -1;
+}
+
+// Write touch to photon latency of the interactions in the ring, in the same
+// formats as stats_export. Returns 0 on success.
+int stats_export_interactions(const char *filename) {
+    InteractionLatency *snap =
+            malloc(sizeof(InteractionLatency) * STATS_INTERACTION_RING_SIZE);
+    if (!snap)
+        return -1;
+    int n = stats_interaction_snapshot(snap);
+    FILE *fp = fopen(filename, "w");
+    if (!fp) {
+        free(snap);
+        return -1;
+    }
+
+    size_t len = strlen(filename);
+    bool json = (len > 5) && (strcmp(filename + len - 5, ".json") == 0);
+    if (json)
+        fprintf(fp, "[\n");
+    else
+        fprintf(fp, "marker,input_us,input_latency_us,render_us,queue_us,"
+                "waveform_us,total_us\n");
+    for (int i = 0; i < n; i++) {
+        InteractionLatency *l = &snap[i];
+        if (json) {
+            fprintf(fp, "  {\"marker\": %u, \"input_us\": %llu, "
+                    "\"input_latency_us\": %u, \"render_us\": %u, "
+                    "\"queue_us\": %u, \"waveform_us\": %u, "
+                    "\"total_us\": %u}%s\n",
+                    l->record.marker, (unsigned long long)l->record.input_us,
+                    l->stage_us[STAGE_INPUT], l->stage_us[STAGE_RENDER],
+                    l->stage_us[STAGE_QUEUE], l->stage_us[STAGE_WAVEFORM],
+                    l->stage_us[STAGE_TOTAL], (i == n - 1) ? "" : ",");
+        }
+        else {
+            fprintf(fp, "%u,%llu,%u,%u,%u,%u,%u\n", l->record.marker,
+                    (unsigned long long)l->record.input_us,
+                    l->stage_us[STAGE_INPUT], l->stage_us[STAGE_RENDER],
+                    l->stage_us[STAGE_QUEUE], l->stage_us[STAGE_WAVEFORM],
+                    l->stage_us[STAGE_TOTAL]);
+        }
+    }
+    if (json)
+        fprintf(fp, "]\n");
+
+    free(snap);
+    return (fclose(fp) == 0) ? 0 : -1;
+}
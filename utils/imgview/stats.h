@@ -0,0 +1,65 @@
+//
+// NekoInk Image Viewer
+// Copyright 2024 Wenting Zhang
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+// 
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+//
+// File : stats.h
+// Brief: Display update latency telemetry
+//
+#pragma once
+
+#define STATS_TEMP_UNKNOWN (-1000)
+
+typedef struct {
+    uint32_t marker;
+    WaveformMode mode;
+    Rect rect;
+    bool partial;
+    int temp; // Celsius at submit time, STATS_TEMP_UNKNOWN if not available
+    bool completed;
+    bool timed; // Completion time is known
+    bool collision;
+    bool rails_on; // Sent while panel power was likely still on
+    uint64_t submit_us; // Since stats_init
+    uint64_t sent_us; // Accepted by the driver
+    uint64_t complete_us;
+} UpdateRecord;
+
+// Input which caused an update, times since stats_init
+typedef struct {
+    uint32_t marker;
+    uint64_t input_us; // Kernel timestamp of the input event
+    uint64_t read_us; // Read by the application
+    uint64_t render_us; // Rendered, update about to be sent
+} InteractionRecord;
+
+void stats_init(void);
+void stats_update_submit(uint32_t marker, WaveformMode mode, Rect rect,
+        bool partial);
+void stats_update_sent(uint32_t marker);
+void stats_update_complete(uint32_t marker, bool timed, bool collision);
+void stats_interaction(uint32_t marker, uint64_t input_us, uint64_t read_us,
+        uint64_t render_us);
+int stats_latency_summary(char *buf, size_t len);
+void stats_power_delay(uint32_t delay_ms);
+int stats_export_interactions(const char *filename);
+bool stats_update_done(uint32_t marker);
+void stats_print(FILE *fp);
+int stats_export(const char *filename);
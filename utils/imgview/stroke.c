@@ -0,0 +1,118 @@
+//
+// NekoInk Image Viewer
+// Copyright 2024 Wenting Zhang
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+// 
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+//
+// File : stroke.c
+// Brief: Low latency pen stroke rendering
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+#include "config.h"
+#include "disp.h"
+#include "input.h"
+#include "stroke.h"
+#include "stats.h"
+#include "power.h"
+
+// Ink is drawn straight into the framebuffer as soon as input arrives, but
+// sent to the EPDC as at most one update per interval. This keeps the update
+// queue short while every update still carries all the points collected.
+static bool pen_down;
+static int last_x;
+static int last_y;
+static Rect dirty_rect;
+static uint32_t last_flush;
+// Oldest input not yet sent to the screen, for touch to photon latency
+static uint64_t input_time_us;
+static uint64_t input_read_us;
+
+static uint32_t stroke_get_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void stroke_draw(int x, int y) {
+    Rect rect = disp_draw_line(last_x, last_y, x, y, STROKE_WIDTH, 0x00);
+    dirty_rect = disp_union_rect(dirty_rect, rect);
+    last_x = x;
+    last_y = y;
+}
+
+void stroke_pen_down(int x, int y) {
+    pen_down = true;
+    last_x = x;
+    last_y = y;
+    stroke_draw(x, y);
+}
+
+void stroke_pen_move(int x, int y) {
+    if (!pen_down)
+        return;
+    stroke_draw(x, y);
+}
+
+void stroke_pen_up(void) {
+    pen_down = false;
+    stroke_flush(true);
+}
+
+// Tag the following pen event with its input timestamps, in CLOCK_MONOTONIC us
+void stroke_note_input(uint64_t time_us, uint64_t read_us) {
+    if (input_time_us)
+        return;
+    input_time_us = time_us;
+    input_read_us = read_us;
+}
+
+// Send pending ink to the screen if the update interval has elapsed, or if
+// forced. Returns the time in ms until the next flush is due, or -1 if there
+// is nothing pending.
+int stroke_flush(bool force) {
+    if ((dirty_rect.w == 0) || (dirty_rect.h == 0)) {
+        // Input which didn't leave any ink
+        input_time_us = 0;
+        return -1;
+    }
+    uint32_t now = stroke_get_ms();
+    uint32_t elapsed = now - last_flush;
+    if (!force && (elapsed < STROKE_UPDATE_INTERVAL_MS))
+        return STROKE_UPDATE_INTERVAL_MS - elapsed;
+#ifdef ENABLE_POWER_POLICY
+    power_note_update();
+#endif
+#ifdef ENABLE_STATS
+    uint64_t render_us = input_get_us();
+    uint32_t marker = disp_present(dirty_rect, STROKE_WAVEFORM, true, false);
+    if (input_time_us && marker)
+        stats_interaction(marker, input_time_us, input_read_us, render_us);
+#else
+    disp_present(dirty_rect, STROKE_WAVEFORM, true, false);
+#endif
+    input_time_us = 0;
+    dirty_rect.w = 0;
+    dirty_rect.h = 0;
+    last_flush = now;
+    return -1;
+}
@@ -0,0 +1,564 @@
+//
+// NekoInk Image Viewer
+// Copyright 2024 Wenting Zhang
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+// 
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+//
+// File : wfsim.c
+// Brief: Waveform driven panel simulation
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <ctype.h>
+#include <time.h>
+#include "config.h"
+#include "disp.h"
+#include "stats.h"
+#include "wfsim.h"
+#include "waveform.h"
+
+// Updates are shown the way the EPDC drives the panel. Every frame, each
+// pixel of a running update gets the drive value its waveform table lists
+// for (frame, target state, source state): 1 moves it towards black, 2
+// towards white, anything else leaves it alone. The reflectance model is
+// deliberately simple, pixels move a fixed step per frame driven and land on
+// the target grey once the update ends, so the timing and flashing are right
+// while the exact intermediate shades are not.
+//
+// Like the EPDC, a limited number of updates run at the same time, each on
+// its own LUT. An update wanting to change pixels still driven by another
+// collides, and waits in the queue until they are done.
+#define WFSIM_MAX_MODES (16)
+#define WFSIM_MAX_TEMPS (32)
+#define WFSIM_MAX_TABLES (WFSIM_MAX_MODES * WFSIM_MAX_TEMPS)
+#define WFSIM_LINE_MAX (4096)
+// Longest real waveforms are a few hundred frames, this is over 40s at 85Hz
+#define WFSIM_MAX_FRAMES (4096)
+
+typedef struct {
+    int frames;
+    uint8_t *lut; // lut[frame][dst][src]
+} WfsimTable;
+
+typedef struct {
+    uint32_t marker;
+    Rect rect;
+    int mode;
+    bool partial;
+    bool collision;
+    int frame;
+} WfsimUpdate;
+
+static int states; // Grey levels of the waveform, 16 or 32
+static int mode_count;
+static WfsimTable tables[WFSIM_MAX_MODES]; // Tables of the simulated temp
+
+static int width;
+static int height;
+static uint8_t *fb; // Y8 pixels updates are taken from
+static uint8_t *panel; // Y8 reflectance currently shown
+static uint8_t *state; // Grey state reached, source of the running update
+static uint8_t *target; // Grey state the running update drives to
+static uint8_t *owner; // LUT driving the pixel plus 1, 0 if none
+
+static WfsimUpdate running[WFSIM_MAX_LUTS];
+static bool running_used[WFSIM_MAX_LUTS];
+static int running_count;
+static WfsimUpdate queue[WFSIM_QUEUE_SIZE];
+static int queue_count;
+static uint64_t next_frame_us;
+
+static uint64_t wfsim_get_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void wfsim_free_tables(void) {
+    for (int i = 0; i < mode_count; i++) {
+        free(tables[i].lut);
+        tables[i].lut = NULL;
+    }
+    mode_count = 0;
+}
+
+// Ranges are lower bounds in degC, ascending
+static int wfsim_pick_temp(const int *ranges, int temps) {
+    int temp = 0;
+    for (int i = 0; i < temps; i++)
+        if (ranges[i] <= WFSIM_TEMP)
+            temp = i;
+    return temp;
+}
+
+// EPDC firmware or E Ink waveform file, parsed by libwaveform. Only the
+// tables of the simulated temperature get decoded.
+static int wfsim_load_file(const char *filename, waveform_format_t format) {
+    waveform_t *wf = waveform_open(filename, format);
+    if (!wf)
+        return -1;
+    int modes = waveform_modes(wf);
+    if (modes > WFSIM_MAX_MODES) {
+        waveform_close(wf);
+        return -1;
+    }
+    states = waveform_states(wf);
+    int entries = states * states;
+    int temp = waveform_find_temp(wf, WFSIM_TEMP);
+
+    for (mode_count = 0; mode_count < modes; mode_count++) {
+        int table = waveform_table(wf, mode_count, temp);
+        const uint8_t *lut = waveform_lut(wf, table);
+        int frames = waveform_frames(wf, table);
+        if (!lut || (frames < 0) || !waveform_table_ok(wf, table))
+            break;
+        // Kept past closing the file
+        tables[mode_count].frames = frames;
+        tables[mode_count].lut = malloc(frames * entries + 1);
+        if (!tables[mode_count].lut)
+            break;
+        memcpy(tables[mode_count].lut, lut, frames * entries);
+    }
+    int range = waveform_temp_range(wf, temp);
+    waveform_close(wf);
+    if (mode_count != modes) {
+        wfsim_free_tables();
+        return -1;
+    }
+    printf("Waveform %s: %d modes, temp range %d (%d degC), %d levels\n",
+            filename, modes, temp, range, states);
+    return 0;
+}
+
+// Either a single value or an inclusive range written as begin:end
+static void wfsim_parse_range(const char *str, int *begin, int *end) {
+    const char *delim = strchr(str, ':');
+    *begin = atoi(str);
+    *end = delim ? atoi(delim + 1) : *begin;
+}
+
+// One line per source and target state (or ranges of them), followed by the
+// drive value of every frame: src,dst,frame0,frame1,...
+static int wfsim_load_csv(const char *filename, WfsimTable *table) {
+    // Frame count comes from the descriptor, missing or bogus ones would
+    // size the table wrong
+    table->lut = NULL;
+    if ((table->frames <= 0) || (table->frames > WFSIM_MAX_FRAMES))
+        return -1;
+    FILE *fp = fopen(filename, "r");
+    if (!fp)
+        return -1;
+    int entries = states * states;
+    table->lut = malloc(table->frames * entries + 1);
+    if (!table->lut) {
+        fclose(fp);
+        return -1;
+    }
+    // Unspecified transitions are not driven
+    memset(table->lut, 3, table->frames * entries);
+
+    char line[WFSIM_LINE_MAX];
+    while (fgets(line, sizeof(line), fp)) {
+        char *fields[2];
+        char *ptr = line;
+        for (int i = 0; i < 2; i++) {
+            fields[i] = ptr;
+            ptr = strchr(ptr, ',');
+            if (!ptr)
+                break;
+            *ptr++ = '\0';
+        }
+        if (!ptr)
+            continue; // Empty or broken line
+        int src0, src1, dst0, dst1;
+        wfsim_parse_range(fields[0], &src0, &src1);
+        wfsim_parse_range(fields[1], &dst0, &dst1);
+        if ((src0 < 0) || (dst0 < 0) || (src1 >= states) || (dst1 >= states))
+            continue;
+        for (int frame = 0; frame < table->frames; frame++) {
+            char *end;
+            long val = strtol(ptr, &end, 10);
+            if (end == ptr)
+                break;
+            for (int src = src0; src <= src1; src++)
+                for (int dst = dst0; dst <= dst1; dst++)
+                    table->lut[frame * entries + dst * states + src] = val;
+            ptr = end;
+            if (*ptr == ',')
+                ptr++;
+        }
+    }
+    fclose(fp);
+    return 0;
+}
+
+static char *wfsim_trim(char *str) {
+    while (isspace((unsigned char)*str))
+        str++;
+    char *end = str + strlen(str);
+    while ((end > str) && isspace((unsigned char)end[-1]))
+        *--end = '\0';
+    return str;
+}
+
+// Descriptor written by the dump tools, with the tables in CSV files next to
+// it. Version 1.0 (mxc_waveform_dump) has a file per mode and temperature,
+// version 2.0 (wbf_waveform_dump) shares tables between them.
+static int wfsim_load_iwf(const char *filename) {
+    FILE *fp = fopen(filename, "r");
+    if (!fp)
+        return -1;
+
+    char prefix[256] = "";
+    int version = 1;
+    int modes = 0;
+    int temps = 0;
+    int bpp = 4;
+    int ranges[WFSIM_MAX_TEMPS] = {0};
+    int mode_frames[WFSIM_MAX_MODES][WFSIM_MAX_TEMPS] = {{0}};
+    int mode_tables[WFSIM_MAX_MODES][WFSIM_MAX_TEMPS] = {{0}};
+    int table_frames[WFSIM_MAX_TABLES] = {0};
+    int mode = -1; // Section being parsed, -1 for [WAVEFORM]
+
+    char line[WFSIM_LINE_MAX];
+    while (fgets(line, sizeof(line), fp)) {
+        char *comment = strchr(line, ';');
+        if (comment)
+            *comment = '\0';
+        char *str = wfsim_trim(line);
+        if (str[0] == '[') {
+            mode = (strncmp(str, "[MODE", 5) == 0) ? atoi(str + 5) : -1;
+            continue;
+        }
+        char *eq = strchr(str, '=');
+        if (!eq)
+            continue;
+        *eq = '\0';
+        char *name = wfsim_trim(str);
+        char *value = wfsim_trim(eq + 1);
+        int id = atoi(name + ((name[1] == 'B') ? 2 : 1));
+        if (id < 0)
+            continue;
+        size_t len = strlen(name);
+        if (mode < 0) {
+            if (strcmp(name, "VERSION") == 0)
+                version = atoi(value);
+            else if (strcmp(name, "PREFIX") == 0)
+                snprintf(prefix, sizeof(prefix), "%s", value);
+            else if (strcmp(name, "MODES") == 0)
+                modes = atoi(value);
+            else if (strcmp(name, "TEMPS") == 0)
+                temps = atoi(value);
+            else if (strcmp(name, "BPP") == 0)
+                bpp = atoi(value);
+            else if ((len > 5) && (strcmp(name + len - 5, "RANGE") == 0) &&
+                    (id < WFSIM_MAX_TEMPS))
+                ranges[id] = atoi(value);
+            else if ((strncmp(name, "TB", 2) == 0) && (len > 4) &&
+                    (strcmp(name + len - 2, "FC") == 0) &&
+                    (id < WFSIM_MAX_TABLES))
+                table_frames[id] = atoi(value);
+        }
+        else if ((mode < WFSIM_MAX_MODES) && (name[0] == 'T') &&
+                (id < WFSIM_MAX_TEMPS)) {
+            if ((len > 2) && (strcmp(name + len - 2, "FC") == 0))
+                mode_frames[mode][id] = atoi(value);
+            else if ((len > 5) && (strcmp(name + len - 5, "TABLE") == 0))
+                mode_tables[mode][id] = atoi(value);
+        }
+    }
+    fclose(fp);
+
+    if ((modes <= 0) || (modes > WFSIM_MAX_MODES) || (temps <= 0) ||
+            (temps > WFSIM_MAX_TEMPS) || !prefix[0])
+        return -1;
+    states = (bpp == 5) ? 32 : 16;
+    int temp = wfsim_pick_temp(ranges, temps);
+
+    char dir[256];
+    snprintf(dir, sizeof(dir), "%s", filename);
+    char *slash = strrchr(dir, '/');
+    if (slash)
+        *slash = '\0';
+    else
+        strcpy(dir, ".");
+
+    for (mode_count = 0; mode_count < modes; mode_count++) {
+        char fn[600];
+        int frames;
+        if (version >= 2) {
+            int table = mode_tables[mode_count][temp];
+            if ((table < 0) || (table >= WFSIM_MAX_TABLES))
+                break;
+            frames = table_frames[table];
+            snprintf(fn, sizeof(fn), "%s/%s_TB%d.csv", dir, prefix, table);
+        }
+        else {
+            frames = mode_frames[mode_count][temp];
+            snprintf(fn, sizeof(fn), "%s/%s_M%d_T%d.csv", dir, prefix,
+                    mode_count, temp);
+        }
+        tables[mode_count].frames = frames;
+        if (wfsim_load_csv(fn, &tables[mode_count]) < 0) {
+            fprintf(stderr, "Failed to load waveform table %s\n", fn);
+            break;
+        }
+    }
+    if (mode_count != modes) {
+        wfsim_free_tables();
+        return -1;
+    }
+    printf("Waveform %s: %d modes, temp range %d (%d degC), %d levels\n",
+            filename, modes, temp, ranges[temp], states);
+    return 0;
+}
+
+// Returns 0 on success, or -1 if the waveform couldn't be loaded
+int wfsim_init(int w, int h) {
+    const char *filename = getenv("WFSIM_WAVEFORM");
+    if (!filename)
+        filename = WFSIM_WAVEFORM_FILE;
+    size_t len = strlen(filename);
+    int ret;
+    if ((len > 3) && (strcmp(filename + len - 3, ".fw") == 0))
+        ret = wfsim_load_file(filename, (WFSIM_FW_VERSION == 1) ?
+                WAVEFORM_FW_V1 : WAVEFORM_FW_V2);
+    else if ((len > 4) && (strcmp(filename + len - 4, ".wbf") == 0))
+        ret = wfsim_load_file(filename, WAVEFORM_WBF);
+    else
+        ret = wfsim_load_iwf(filename);
+    if (ret < 0) {
+        fprintf(stderr, "Failed to load waveform %s\n", filename);
+        return -1;
+    }
+
+    width = w;
+    height = h;
+    fb = malloc(w * h);
+    panel = malloc(w * h);
+    state = malloc(w * h);
+    target = malloc(w * h);
+    owner = calloc(w * h, 1);
+    if (!fb || !panel || !state || !target || !owner) {
+        wfsim_deinit();
+        return -1;
+    }
+    // Panel starts out white
+    memset(fb, 0xff, w * h);
+    memset(panel, 0xff, w * h);
+    memset(state, states - 1, w * h);
+    running_count = 0;
+    queue_count = 0;
+    return 0;
+}
+
+void wfsim_deinit(void) {
+    wfsim_free_tables();
+    free(fb);
+    free(panel);
+    free(state);
+    free(target);
+    free(owner);
+    fb = panel = state = target = owner = NULL;
+}
+
+// Frame buffer updates read their pixels from, in Y8
+uint8_t *wfsim_get_fb(void) {
+    return fb;
+}
+
+// Reflectance of the simulated panel, in Y8
+uint8_t *wfsim_get_panel(void) {
+    return panel;
+}
+
+static bool wfsim_overlap(Rect a, Rect b) {
+    return (a.x < b.x + b.w) && (b.x < a.x + a.w) &&
+            (a.y < b.y + b.h) && (b.y < a.y + a.h);
+}
+
+static void wfsim_complete(WfsimUpdate *update) {
+#ifdef ENABLE_STATS
+    stats_update_complete(update->marker, true, update->collision);
+#endif
+}
+
+void wfsim_submit(Rect rect, WaveformMode mode, bool partial,
+        uint32_t marker) {
+    WfsimUpdate update = {
+        .marker = marker,
+        .rect = rect,
+        .mode = ((int)mode < mode_count) ? (int)mode : (mode_count - 1),
+        .partial = partial,
+        .collision = false,
+        .frame = 0
+    };
+    if (queue_count == WFSIM_QUEUE_SIZE) {
+        // Shown right away, the queue would have stalled the driver anyway
+        for (int y = rect.y; y < rect.y + rect.h; y++)
+            memcpy(&panel[y * width + rect.x], &fb[y * width + rect.x],
+                    rect.w);
+        wfsim_complete(&update);
+        return;
+    }
+    queue[queue_count++] = update;
+    if (!running_count && (queue_count == 1))
+        next_frame_us = wfsim_get_us();
+}
+
+// Starts the update if a LUT is free and none of its pixels collide with a
+// running update
+static bool wfsim_start(WfsimUpdate *update) {
+    int lut;
+    for (lut = 0; lut < WFSIM_MAX_LUTS; lut++)
+        if (!running_used[lut])
+            break;
+    if (lut == WFSIM_MAX_LUTS)
+        return false;
+
+    Rect rect = update->rect;
+    int shift = (states == 32) ? 3 : 4;
+    for (int y = rect.y; y < rect.y + rect.h; y++) {
+        for (int x = rect.x; x < rect.x + rect.w; x++) {
+            int i = y * width + x;
+            int dst = fb[i] >> shift;
+            if (owner[i] && (!update->partial || (dst != target[i]))) {
+                update->collision = true;
+                return false;
+            }
+        }
+    }
+    for (int y = rect.y; y < rect.y + rect.h; y++) {
+        for (int x = rect.x; x < rect.x + rect.w; x++) {
+            int i = y * width + x;
+            int dst = fb[i] >> shift;
+            // Partial updates only drive pixels that change
+            if (owner[i] || (update->partial && (dst == state[i])))
+                continue;
+            owner[i] = lut + 1;
+            target[i] = dst;
+        }
+    }
+    running[lut] = *update;
+    running_used[lut] = true;
+    running_count++;
+    return true;
+}
+
+// Drive one frame of a running update, returns true once it's finished
+static bool wfsim_drive(int lut) {
+    WfsimUpdate *update = &running[lut];
+    WfsimTable *table = &tables[update->mode];
+    Rect rect = update->rect;
+    if (update->frame < table->frames) {
+        uint8_t *frame_lut = &table->lut[update->frame * states * states];
+        for (int y = rect.y; y < rect.y + rect.h; y++) {
+            for (int x = rect.x; x < rect.x + rect.w; x++) {
+                int i = y * width + x;
+                if (owner[i] != lut + 1)
+                    continue;
+                int drive = frame_lut[target[i] * states + state[i]];
+                int level = panel[i];
+                if (drive == 1)
+                    level -= WFSIM_DRIVE_STEP;
+                else if (drive == 2)
+                    level += WFSIM_DRIVE_STEP;
+                panel[i] = (level < 0) ? 0 : (level > 255) ? 255 : level;
+            }
+        }
+        update->frame++;
+    }
+    if (update->frame < table->frames)
+        return false;
+    // Settle on the target grey and release the pixels
+    for (int y = rect.y; y < rect.y + rect.h; y++) {
+        for (int x = rect.x; x < rect.x + rect.w; x++) {
+            int i = y * width + x;
+            if (owner[i] != lut + 1)
+                continue;
+            state[i] = target[i];
+            panel[i] = target[i] * 255 / (states - 1);
+            owner[i] = 0;
+        }
+    }
+    return true;
+}
+
+// Run the panel frames due. Returns the time in ms until the next frame, or
+// -1 if the panel is idle. The area of the panel changed is put in dirty.
+int wfsim_step(Rect *dirty) {
+    memset(dirty, 0, sizeof(*dirty));
+    if (!running_count && !queue_count)
+        return -1;
+
+    uint64_t now = wfsim_get_us();
+    uint64_t period = 1000000 / WFSIM_FRAME_RATE;
+    if (now - next_frame_us > period * 8) {
+        // Fell far behind, the frames missed are dropped
+        next_frame_us = now;
+    }
+    while ((next_frame_us <= now) && (running_count || queue_count)) {
+        // New updates start on frame boundaries, in order of submission
+        for (int i = 0; i < queue_count; i++) {
+            bool blocked = false;
+            for (int j = 0; j < i; j++)
+                if (wfsim_overlap(queue[i].rect, queue[j].rect))
+                    blocked = true;
+            if (blocked || !wfsim_start(&queue[i]))
+                continue;
+            memmove(&queue[i], &queue[i + 1],
+                    (queue_count - i - 1) * sizeof(WfsimUpdate));
+            queue_count--;
+            i--;
+        }
+        for (int lut = 0; lut < WFSIM_MAX_LUTS; lut++) {
+            if (!running_used[lut])
+                continue;
+            *dirty = ((dirty->w == 0) || (dirty->h == 0)) ?
+                    running[lut].rect :
+                    disp_union_rect(*dirty, running[lut].rect);
+            if (wfsim_drive(lut)) {
+                running_used[lut] = false;
+                running_count--;
+                wfsim_complete(&running[lut]);
+            }
+        }
+        next_frame_us += period;
+    }
+    if (!running_count && !queue_count)
+        return -1;
+    now = wfsim_get_us();
+    if (next_frame_us <= now)
+        return 0;
+    return (next_frame_us - now + 999) / 1000;
+}
+
+// An update is done once it's neither queued nor running
+bool wfsim_update_done(uint32_t marker) {
+    for (int i = 0; i < queue_count; i++)
+        if (queue[i].marker == marker)
+            return false;
+    for (int i = 0; i < WFSIM_MAX_LUTS; i++)
+        if (running_used[i] && (running[i].marker == marker))
+            return false;
+    return true;
+}
@@ -0,0 +1,24 @@
+/*******************************************************************************
+ * Eink waveform file library, CRC-32
+ * Copyright 2024 Wenting Zhang
+ *
+ * This is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 2 of the License, or (at your option) any later
+ * version.
+ *
+ * This software is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * the software. If not, see <http://www.gnu.org/licenses/>.
+ ******************************************************************************/
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+uint32_t crc32_update(uint32_t crc, const uint8_t *buf, size_t len);
+const char *crc32_isa(void);
@@ -0,0 +1,12 @@
+# Included by Makefiles using libwaveform, after their default target. Either
+# link $(LIBWAVEFORM_LIB), built here on demand, or add $(LIBWAVEFORM_SRCS)
+# to the sources.
+LIBWAVEFORM_DIR ?= ../libwaveform
+LIBWAVEFORM_SRCS := $(LIBWAVEFORM_DIR)/waveform.c $(LIBWAVEFORM_DIR)/crc32.c
+LIBWAVEFORM_HDRS := $(LIBWAVEFORM_DIR)/waveform.h $(LIBWAVEFORM_DIR)/crc32.h
+LIBWAVEFORM_LIB := $(LIBWAVEFORM_DIR)/libwaveform.a
+
+ifneq ($(LIBWAVEFORM_DIR),.)
+$(LIBWAVEFORM_LIB): $(LIBWAVEFORM_SRCS) $(LIBWAVEFORM_HDRS)
+	$(MAKE) -C $(LIBWAVEFORM_DIR) libwaveform.a
+endif
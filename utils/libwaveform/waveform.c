@@ -0,0 +1,752 @@
+/*******************************************************************************
+ * Eink waveform file library
+ * Based on https://github.com/fread-ink/inkwave and Linux kernel
+ *
+ * This is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 2 of the License, or (at your option) any later
+ * version.
+ *
+ * This software is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * the software. If not, see <http://www.gnu.org/licenses/>.
+ * 
+ * This file is partially derived from Linux kernel driver, with the following
+ * copyright information:
+ * Copyright 2004-2013 Freescale Semiconductor, Inc.
+ * Copyright 2005-2017 Amazon Technologies, Inc.
+ * Copyright (C) 2014-2016 Freescale Semiconductor, Inc.
+ * Copyright 2017 NXP
+ * Copyright 2018, 2021 Marc Juul
+ * Copyright (C) 2022 Samuel Holland <samuel@sholland.org>
+ * Copyright 2024 Wenting Zhang
+ ******************************************************************************/
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <ctype.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "waveform.h"
+#include "crc32.h"
+
+// Waveform files are mapped rather than read, and only the parts needed are
+// looked at. Opening a file parses the header, the temperature table and the
+// mode and temperature pointers. For .wbf files it also indexes the run
+// length encoded tables, a pass over the encoded bytes giving their size
+// once decoded and checking their checksums, without decoding anything.
+// LUTs are decoded the first time they are asked for and kept until the file
+// is closed. EPDCv1 LUTs are already in the decoded layout, so those point
+// straight into the mapping.
+//
+// Decoded LUTs are indexed lut[frame * states * states + dst * states + src],
+// the layout the dump tools write CSV files from and the software waveform
+// engine takes.
+
+#define MODE_MAX 10
+#define MAX_DECOMP_SIZE (0x100000)
+#define FLASH_HEADER_SIZE (16)
+
+typedef struct {
+    uint32_t offset; // Of the table in the file
+    uint32_t encoded_size; // Up to and including the end marker, .wbf only
+    uint32_t decoded_size; // Of the packed entries
+    int frames; // -1 if the table is broken
+    int checksum; // Of the encoded bytes, -1 if the format has none
+    bool checksum_ok;
+    const uint8_t *lut; // Decoded, NULL until asked for
+    uint8_t *buffer; // Allocated for the decoded LUT, if it's not in the file
+} waveform_table_t;
+
+struct waveform {
+    waveform_format_t format;
+    const uint8_t *map; // Mapping to release on close, if any
+    size_t map_size;
+    uint8_t *image; // Decompressed flash image
+    const uint8_t *data;
+    size_t size;
+    const waveform_header_t *header;
+    uint32_t errors;
+
+    int bpp;
+    int states;
+    int entries_per_byte;
+    int modes;
+    int temps;
+    const uint8_t *temp_ranges; // temps entries, followed by the upper bound
+    const char *const *mode_names;
+    char xwia[255 * 4 + 1];
+    size_t data_offset;
+    uint32_t *mode_offsets;
+    int *mode_tables; // mode_tables[mode * temps + temp]
+    int tables;
+    waveform_table_t *table;
+};
+
+// Mode version to mode string
+struct mode_name_lut_t {
+    uint8_t versions[2];
+    const char *mode_strings[MODE_MAX];
+};
+
+// Partially derived from linux kernel drm_epd_helper.c
+// All GL series (GL GLR GLD) are marked as GL as the underlying wavetable seems to be identical
+// Thus it's impossible to identify the correct ordering
+// -R/ -D ghosting reduction is outside of the scope of this tool
+static const struct mode_name_lut_t mode_name_lut[] = {
+    {
+        // Example: ED050SC3
+        .versions = {0x01},
+        .mode_strings = {"INIT", "DU", "GL8", "GC8"}
+    },
+    {
+        // Example: ED097TC1
+        .versions = {0x03},
+        .mode_strings = {"INIT", "DU", "GL16", "GL16", "A2"}
+    },
+    {
+        // Example: ET073TC1
+        .versions = {0x09},
+        .mode_strings = {"INIT", "DU", "GC16", "A2"}
+    },
+    {
+        // Untested
+        .versions = {0x12},
+        .mode_strings = {"INIT", "DU", "NULL", "GC16", "A2", "GL16", "GL16", "DU4"}
+    },
+    {
+        // Example: ES133UT1
+        .versions = {0x15},
+        .mode_strings = {"INIT", "DU", "GC16", "GL16", "A2", "DU4", "GC4"}
+    },
+    {
+        // Untested
+        .versions = {0x16},
+        .mode_strings = {"INIT", "DU", "GC16", "GL16", "GL16", "GC16", "A2"}
+    },
+    {
+        // Example: ES108FC1
+        .versions = {0x18, 0x20},
+        .mode_strings = {"INIT", "DU", "GC16", "GL16", "GL16", "GL16", "A2"}
+    },
+    {
+        // Example: ES103TC1
+        .versions = {0x19, 0x43},
+        .mode_strings = {"INIT", "DU", "GC16", "GL16", "GL16", "GL16", "A2", "DU4"}
+    },
+    {
+        // Untested
+        .versions = {0x23},
+        .mode_strings = {"INIT", "DU", "GC16", "GL16", "A2", "DU4"}
+    },
+    {
+        // Untested
+        .versions = {0x54},
+        .mode_strings = {"INIT", "DU", "GC16", "GL16", "GL16", "A2"}
+    },
+    {
+        // Example: ES120MC1
+        .versions = {0x48},
+        .mode_strings = {"INIT", "DU", "GC16", "GL16", "GL16", "NULL", "A2"}
+    }
+};
+#define MODE_NAME_LUTS  (sizeof(mode_name_lut) / sizeof(*mode_name_lut))
+
+// 24 bit little endian pointer followed by its checksum
+static uint32_t read_pointer(waveform_t *wf, const uint8_t *ptr) {
+    uint32_t addr = ((uint32_t)ptr[2] << 16) | ((uint32_t)ptr[1] << 8) | ((uint32_t)ptr[0]);
+    uint8_t checksum = ptr[0] + ptr[1] + ptr[2];
+    if (checksum != ptr[3])
+        wf->errors |= WAVEFORM_ERR_POINTER;
+    return addr;
+}
+
+const uint8_t *waveform_map_file(const char *filename, size_t *size) {
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0)
+        return NULL;
+    struct stat st;
+    if ((fstat(fd, &st) != 0) || (st.st_size <= 0)) {
+        close(fd);
+        return NULL;
+    }
+    void *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED)
+        return NULL;
+    *size = st.st_size;
+    return data;
+}
+
+void waveform_unmap_file(const uint8_t *data, size_t size) {
+    munmap((void *)data, size);
+}
+
+// Flash images hold the .wbf compressed: a 16 byte header with the
+// compressed length and version (big endian), then tokens of a 16 bit
+// little endian back reference offset, a length, and a literal byte.
+// Returns 0 on success, -1 if the image is truncated, -2 for an unknown
+// version, -3 for broken data.
+int waveform_flash_decompress(const uint8_t *src, size_t size, uint8_t **dst,
+        size_t *dst_size) {
+    if (size < FLASH_HEADER_SIZE)
+        return -1;
+    uint32_t compressed_len = ((uint32_t)src[0] << 24) |
+            ((uint32_t)src[1] << 16) | ((uint32_t)src[2] << 8) | src[3];
+    uint32_t header_version = ((uint32_t)src[4] << 24) |
+            ((uint32_t)src[5] << 16) | ((uint32_t)src[6] << 8) | src[7];
+    if ((size_t)compressed_len + FLASH_HEADER_SIZE > size)
+        return -1;
+    if (header_version != 1)
+        return -2;
+
+    uint8_t *buffer = malloc(MAX_DECOMP_SIZE);
+    if (!buffer)
+        return -3;
+    const uint8_t *ptr = src + FLASH_HEADER_SIZE;
+    const uint8_t *ptr_end = ptr + compressed_len;
+    uint32_t wrptr = 0;
+    while (ptr + 4 <= ptr_end) {
+        uint32_t offset = ptr[0] | ((uint32_t)ptr[1] << 8);
+        uint8_t len = ptr[2];
+        uint8_t byte = ptr[3];
+        ptr += 4;
+        if (((len != 0) && ((offset == 0) || (offset > wrptr))) ||
+                (wrptr + len + 1 > MAX_DECOMP_SIZE)) {
+            free(buffer);
+            return -3;
+        }
+        // Byte by byte, the source may overlap with what's being written
+        for (int i = 0; i < len; i++) {
+            buffer[wrptr] = buffer[wrptr - offset];
+            wrptr++;
+        }
+        buffer[wrptr++] = byte;
+    }
+    *dst = buffer;
+    *dst_size = wrptr;
+    return 0;
+}
+
+// Tables in .wbf files are run length encoded. 0xfc toggles between runs,
+// a byte followed by its repeat count minus 1, and literal bytes. 0xff ends
+// the table, followed by a checksum of the encoded bytes.
+static void waveform_index_wbf(waveform_t *wf, waveform_table_t *table) {
+    const uint8_t *start = wf->data + table->offset;
+    const uint8_t *end = wf->data + wf->size;
+    const uint8_t *ptr = start;
+    bool rle_mode = true;
+    size_t size = 0;
+    uint8_t checksum = 0;
+    table->frames = -1;
+    table->checksum = -1;
+    while (1) {
+        if (ptr >= end)
+            return;
+        uint8_t chr = *ptr++;
+        checksum += chr;
+        if (chr == 0xfc) {
+            rle_mode = !rle_mode;
+        }
+        else if (chr == 0xff) {
+            break;
+        }
+        else if (!rle_mode) {
+            size++;
+        }
+        else {
+            if (ptr >= end)
+                return;
+            uint8_t len = *ptr++;
+            checksum += len;
+            size += (size_t)len + 1;
+        }
+    }
+    table->checksum = checksum;
+    table->checksum_ok = (ptr < end) && (*ptr == checksum);
+    if (!table->checksum_ok)
+        wf->errors |= WAVEFORM_ERR_TABLE;
+    if (size > UINT32_MAX)
+        return;
+    table->encoded_size = ptr - start;
+    table->decoded_size = size;
+    table->frames = size * wf->entries_per_byte /
+            (wf->states * wf->states);
+}
+
+static int waveform_parse_wbf(waveform_t *wf) {
+    const uint8_t *data = wf->data;
+    const waveform_header_t *header = wf->header;
+    wf->bpp = ((header->luts & 0xC) == 0x4) ? 5: 4;
+    wf->entries_per_byte = 4;
+    if (header->luts == 0x15) {
+        // ACeP, 4 bit drive values
+        wf->bpp = 5;
+        wf->entries_per_byte = 2;
+    }
+    wf->states = (wf->bpp == 5) ? 32 : 16;
+
+    // Right following the header is the temperature range table, the upper
+    // bound of the last range, and a checksum
+    if (WAVEFORM_HEADER_SIZE + wf->temps + 2 > wf->size)
+        return -1;
+    wf->temp_ranges = data + WAVEFORM_HEADER_SIZE;
+    uint8_t checksum = 0;
+    for (int i = 0; i < wf->temps + 1; i++)
+        checksum += wf->temp_ranges[i];
+    if (checksum != wf->temp_ranges[wf->temps + 1])
+        wf->errors |= WAVEFORM_ERR_TEMP_TABLE;
+
+    uint8_t xwia_len = 0;
+    if (header->xwia != 0) {
+        const uint8_t *ptr = data + header->xwia;
+        if ((size_t)header->xwia + 1 > wf->size)
+            return -1;
+        xwia_len = *ptr++;
+        if ((size_t)header->xwia + xwia_len + 2 > wf->size)
+            return -1;
+        checksum = xwia_len;
+        char *wrptr = wf->xwia;
+        for (int i = 0; i < xwia_len; i++) {
+            char c = *ptr++;
+            if (isprint((unsigned char)c))
+                *wrptr++ = c;
+            else
+                wrptr += sprintf(wrptr, "\\x%02x", (uint8_t)c);
+            checksum += c;
+        }
+        *wrptr = '\0';
+        if (checksum != *ptr)
+            wf->errors |= WAVEFORM_ERR_XWIA;
+    }
+
+    wf->data_offset = WAVEFORM_HEADER_SIZE + wf->temps + 2 + 1 + xwia_len + 1;
+    // This should yield the same result
+    if ((header->xwia) && (wf->data_offset !=
+            (size_t)header->xwia + 1 + xwia_len + 1))
+        wf->errors |= WAVEFORM_ERR_DATA_OFFSET;
+    if (wf->data_offset + (size_t)wf->modes * 4 > wf->size)
+        return -1;
+
+    for (int i = 0; i < wf->modes; i++)
+        wf->mode_offsets[i] = read_pointer(wf, data + wf->data_offset + i * 4);
+
+    // Tables are shared between modes and temperatures, numbered in the
+    // order they are first pointed to
+    for (int i = 0; i < wf->modes; i++) {
+        if ((size_t)wf->mode_offsets[i] + wf->temps * 4 > wf->size)
+            return -1;
+        const uint8_t *ptr = data + wf->mode_offsets[i];
+        for (int j = 0; j < wf->temps; j++) {
+            uint32_t addr = read_pointer(wf, ptr);
+            ptr += 4;
+            if (addr >= wf->size)
+                return -1;
+            // Linear search is more than good enough for this problem size
+            int id = -1;
+            for (int k = 0; k < wf->tables; k++) {
+                if (wf->table[k].offset == addr) {
+                    id = k;
+                    break;
+                }
+            }
+            if (id == -1) {
+                id = wf->tables++;
+                wf->table[id].offset = addr;
+                waveform_index_wbf(wf, &wf->table[id]);
+            }
+            wf->mode_tables[i * wf->temps + j] = id;
+        }
+    }
+
+    // Try to find mode description
+    uint8_t mode_version = header->mode_version_or_adhesive_run_num;
+    for (size_t i = 0; i < MODE_NAME_LUTS; i++) {
+        if ((mode_name_lut[i].versions[0] == mode_version) ||
+                (mode_name_lut[i].versions[1] == mode_version)) {
+            wf->mode_names = mode_name_lut[i].mode_strings;
+        }
+    }
+    return 0;
+}
+
+// EPDC firmware as built by mxc_waveform_asm. The temperature table is
+// followed by a pad byte, then the mode and temperature offset tables and
+// the LUTs, all 64 bit and relative to the end of the pad byte. Every mode
+// and temperature has a table of its own, starting with the frame count.
+static int waveform_parse_fw(waveform_t *wf) {
+    const uint8_t *data = wf->data;
+    wf->bpp = ((wf->header->luts & 0xC) == 0x4) ? 5 : 4;
+    wf->states = (wf->bpp == 5) ? 32 : 16;
+    wf->entries_per_byte = (wf->format == WAVEFORM_FW_V2) ? 2 : 1;
+    wf->temp_ranges = data + WAVEFORM_HEADER_SIZE;
+    wf->data_offset = WAVEFORM_HEADER_SIZE + wf->temps + 1;
+    if (wf->data_offset > wf->size)
+        return -1;
+    size_t region_size = wf->size - wf->data_offset;
+    const uint8_t *region = data + wf->data_offset;
+    if ((size_t)wf->modes * 8 > region_size)
+        return -1;
+
+    size_t frame_bytes = wf->states * wf->states / wf->entries_per_byte;
+    for (int i = 0; i < wf->modes; i++) {
+        // Offsets come from the file, compared without adding to them so
+        // they can't wrap around
+        uint64_t mode_offset = waveform_read_uint64_le(&region[i * 8]);
+        if ((mode_offset > region_size) ||
+                ((uint64_t)wf->temps * 8 > region_size - mode_offset))
+            return -1;
+        wf->mode_offsets[i] = wf->data_offset + mode_offset;
+        for (int j = 0; j < wf->temps; j++) {
+            uint64_t offset = waveform_read_uint64_le(
+                    &region[mode_offset + j * 8]);
+            if ((offset > region_size) || (region_size - offset < 8))
+                return -1;
+            uint64_t frames = waveform_read_uint64_le(&region[offset]);
+            if ((frames > (region_size - offset - 8) / frame_bytes) ||
+                    (frames > INT32_MAX))
+                return -1;
+            int id = wf->tables++;
+            wf->table[id].offset = wf->data_offset + offset;
+            wf->table[id].decoded_size = frames * frame_bytes;
+            wf->table[id].frames = frames;
+            wf->table[id].checksum = -1;
+            wf->table[id].checksum_ok = true;
+            wf->mode_tables[i * wf->temps + j] = id;
+        }
+    }
+    return 0;
+}
+
+// Takes the data over, releasing it on close if it's a mapping or buffer
+static waveform_t *waveform_parse(const uint8_t *data, size_t size,
+        waveform_format_t format) {
+    waveform_t *wf = calloc(1, sizeof(waveform_t));
+    if (!wf)
+        return NULL;
+    wf->format = format;
+    wf->data = data;
+    wf->size = size;
+    if (size < WAVEFORM_HEADER_SIZE) {
+        free(wf);
+        return NULL;
+    }
+    wf->header = (const waveform_header_t *)data;
+    wf->modes = wf->header->mc + 1;
+    wf->temps = wf->header->trc + 1;
+    wf->mode_offsets = calloc(wf->modes, sizeof(uint32_t));
+    wf->mode_tables = calloc(wf->modes * wf->temps, sizeof(int));
+    wf->table = calloc(wf->modes * wf->temps, sizeof(waveform_table_t));
+    if (!wf->mode_offsets || !wf->mode_tables || !wf->table) {
+        waveform_close(wf);
+        return NULL;
+    }
+    int ret = (format == WAVEFORM_WBF) ? waveform_parse_wbf(wf) :
+            waveform_parse_fw(wf);
+    if (ret < 0) {
+        waveform_close(wf);
+        return NULL;
+    }
+    return wf;
+}
+
+// The data has to stay around until the waveform is closed
+waveform_t *waveform_open_mem(const uint8_t *data, size_t size,
+        waveform_format_t format) {
+    if (format != WAVEFORM_FLASH)
+        return waveform_parse(data, size, format);
+    uint8_t *image;
+    size_t image_size;
+    if (waveform_flash_decompress(data, size, &image, &image_size) != 0)
+        return NULL;
+    waveform_t *wf = waveform_parse(image, image_size, WAVEFORM_WBF);
+    if (!wf) {
+        free(image);
+        return NULL;
+    }
+    wf->format = WAVEFORM_FLASH;
+    wf->image = image;
+    return wf;
+}
+
+waveform_t *waveform_open(const char *filename, waveform_format_t format) {
+    size_t size;
+    const uint8_t *data = waveform_map_file(filename, &size);
+    if (!data)
+        return NULL;
+    waveform_t *wf = waveform_open_mem(data, size, format);
+    if (!wf || (format == WAVEFORM_FLASH)) {
+        // Only the decompressed image is needed from now on
+        waveform_unmap_file(data, size);
+        return wf;
+    }
+    wf->map = data;
+    wf->map_size = size;
+    return wf;
+}
+
+void waveform_close(waveform_t *wf) {
+    if (wf->table) {
+        for (int i = 0; i < wf->tables; i++)
+            free(wf->table[i].buffer);
+    }
+    free(wf->table);
+    free(wf->mode_offsets);
+    free(wf->mode_tables);
+    free(wf->image);
+    if (wf->map)
+        waveform_unmap_file(wf->map, wf->map_size);
+    free(wf);
+}
+
+const waveform_header_t *waveform_header(const waveform_t *wf) {
+    return wf->header;
+}
+
+// Whole file, decompressed for flash images
+const uint8_t *waveform_data(const waveform_t *wf, size_t *size) {
+    *size = wf->size;
+    return wf->data;
+}
+
+uint32_t waveform_errors(const waveform_t *wf) {
+    return wf->errors;
+}
+
+// Check the CRC of a .wbf file against its header. The checksum field itself
+// is counted as zeros.
+bool waveform_verify(const waveform_t *wf, uint32_t *crc) {
+    const waveform_header_t *header = wf->header;
+    if ((wf->format == WAVEFORM_FW_V1) || (wf->format == WAVEFORM_FW_V2) ||
+            (header->filesize < 4) || (header->filesize > wf->size))
+        return false;
+    static const uint8_t zeros[4] = {0};
+    *crc = crc32_update(0, zeros, 4);
+    *crc = crc32_update(*crc, wf->data + 4, header->filesize - 4);
+    return *crc == header->checksum;
+}
+
+int waveform_bpp(const waveform_t *wf) {
+    return wf->bpp;
+}
+
+// Grey levels
+int waveform_states(const waveform_t *wf) {
+    return wf->states;
+}
+
+int waveform_modes(const waveform_t *wf) {
+    return wf->modes;
+}
+
+// Known from the mode version of .wbf files, NULL otherwise
+const char *waveform_mode_name(const waveform_t *wf, int mode) {
+    if (!wf->mode_names || (mode < 0) || (mode >= MODE_MAX))
+        return NULL;
+    return wf->mode_names[mode];
+}
+
+int waveform_temps(const waveform_t *wf) {
+    return wf->temps;
+}
+
+// Lower bound of the range in degC. The upper bound of the last range is at
+// index temps, for .wbf files only.
+int waveform_temp_range(const waveform_t *wf, int temp) {
+    return wf->temp_ranges[temp];
+}
+
+// Range the temperature falls in, ranges being ascending
+int waveform_find_temp(const waveform_t *wf, int degc) {
+    int temp = 0;
+    for (int i = 0; i < wf->temps; i++)
+        if (wf->temp_ranges[i] <= degc)
+            temp = i;
+    return temp;
+}
+
+// Extra waveform information of .wbf files, unprintable bytes escaped
+const char *waveform_xwia(const waveform_t *wf) {
+    return wf->xwia;
+}
+
+size_t waveform_data_offset(const waveform_t *wf) {
+    return wf->data_offset;
+}
+
+// Offset of the temperature table of the mode in the file
+uint32_t waveform_mode_offset(const waveform_t *wf, int mode) {
+    return wf->mode_offsets[mode];
+}
+
+int waveform_tables(const waveform_t *wf) {
+    return wf->tables;
+}
+
+int waveform_table(const waveform_t *wf, int mode, int temp) {
+    if ((mode < 0) || (mode >= wf->modes) || (temp < 0) ||
+            (temp >= wf->temps))
+        return -1;
+    return wf->mode_tables[mode * wf->temps + temp];
+}
+
+uint32_t waveform_table_offset(const waveform_t *wf, int table) {
+    return wf->table[table].offset;
+}
+
+// Unpack entries_per_byte entries from every byte, first in the low bits
+static uint8_t *waveform_unpack(const uint8_t *src, size_t entries,
+        int entries_per_byte) {
+    uint8_t *lut = malloc(entries + 1);
+    if (!lut)
+        return NULL;
+    uint8_t *wrptr = lut;
+    size_t bytes = entries / entries_per_byte;
+    if (entries_per_byte == 4) {
+        for (size_t i = 0; i < bytes; i++) {
+            uint8_t val = src[i];
+            *wrptr++ = val & 0x3;
+            *wrptr++ = (val >> 2) & 0x3;
+            *wrptr++ = (val >> 4) & 0x3;
+            *wrptr++ = (val >> 6) & 0x3;
+        }
+    }
+    else if (entries_per_byte == 2) {
+        for (size_t i = 0; i < bytes; i++) {
+            *wrptr++ = src[i] & 0xf;
+            *wrptr++ = src[i] >> 4;
+        }
+    }
+    else {
+        memcpy(lut, src, entries);
+    }
+    return lut;
+}
+
+// Expand the runs of an indexed table. Literals are copied a stretch at a
+// time and runs are filled, writes are checked against the size the index
+// found.
+static uint8_t *waveform_derle(const waveform_t *wf,
+        const waveform_table_t *table) {
+    size_t size = table->decoded_size;
+    uint8_t *buffer = malloc(size + 1);
+    if (!buffer)
+        return NULL;
+    const uint8_t *ptr = wf->data + table->offset;
+    const uint8_t *end = ptr + table->encoded_size;
+    bool rle_mode = true;
+    size_t idx = 0;
+    while (ptr < end) {
+        uint8_t chr = *ptr++;
+        if (chr == 0xfc) {
+            rle_mode = !rle_mode;
+        }
+        else if (chr == 0xff) {
+            break;
+        }
+        else if (!rle_mode) {
+            const uint8_t *literal = ptr - 1;
+            while ((ptr < end) && (*ptr != 0xfc) && (*ptr != 0xff))
+                ptr++;
+            size_t len = ptr - literal;
+            if (idx + len > size)
+                break;
+            memcpy(&buffer[idx], literal, len);
+            idx += len;
+        }
+        else {
+            if (ptr >= end)
+                break;
+            size_t len = (size_t)*ptr++ + 1;
+            if (idx + len > size)
+                break;
+            memset(&buffer[idx], chr, len);
+            idx += len;
+        }
+    }
+    if (idx != size) {
+        // Doesn't match the index, the data changed under us
+        free(buffer);
+        return NULL;
+    }
+    return buffer;
+}
+
+static int waveform_decode_wbf(waveform_t *wf, waveform_table_t *table) {
+    uint8_t *packed = waveform_derle(wf, table);
+    if (!packed)
+        return -1;
+    table->buffer = waveform_unpack(packed,
+            (size_t)table->frames * wf->states * wf->states,
+            wf->entries_per_byte);
+    free(packed);
+    return table->buffer ? 0 : -1;
+}
+
+static int waveform_decode(waveform_t *wf, waveform_table_t *table) {
+    if (table->lut)
+        return 0;
+    if (table->frames < 0)
+        return -1;
+    if (wf->format == WAVEFORM_FW_V1) {
+        table->lut = wf->data + table->offset + 8;
+        return 0;
+    }
+    if (wf->format == WAVEFORM_FW_V2) {
+        // 2 entries per byte, low nibble first
+        table->buffer = waveform_unpack(wf->data + table->offset + 8,
+                (size_t)table->frames * wf->states * wf->states, 2);
+    }
+    else if (waveform_decode_wbf(wf, table) != 0) {
+        return -1;
+    }
+    table->lut = table->buffer;
+    return table->lut ? 0 : -1;
+}
+
+// Frames of the table, known without decoding it. -1 if it's broken.
+int waveform_frames(const waveform_t *wf, int table) {
+    if ((table < 0) || (table >= wf->tables))
+        return -1;
+    return wf->table[table].frames;
+}
+
+// Whether the table was indexed and its checksum matches. Firmware tables
+// carry no checksum, only their size is checked.
+bool waveform_table_ok(const waveform_t *wf, int table) {
+    if ((table < 0) || (table >= wf->tables))
+        return false;
+    return (wf->table[table].frames >= 0) && wf->table[table].checksum_ok;
+}
+
+// Checksum of the encoded table as computed, -1 if there's none
+int waveform_table_checksum(const waveform_t *wf, int table) {
+    if ((table < 0) || (table >= wf->tables))
+        return -1;
+    return wf->table[table].checksum;
+}
+
+// Bytes the table takes once run length decoded, still packed
+size_t waveform_table_size(const waveform_t *wf, int table) {
+    if ((table < 0) || (table >= wf->tables))
+        return 0;
+    return wf->table[table].decoded_size;
+}
+
+// Decoded LUT of the table, NULL if it couldn't be decoded
+const uint8_t *waveform_lut(waveform_t *wf, int table) {
+    if ((table < 0) || (table >= wf->tables))
+        return NULL;
+    if (waveform_decode(wf, &wf->table[table]) != 0)
+        return NULL;
+    return wf->table[table].lut;
+}
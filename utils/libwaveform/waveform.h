@@ -0,0 +1,134 @@
+/*******************************************************************************
+ * Eink waveform file library
+ * Based on https://github.com/fread-ink/inkwave and Linux kernel
+ *
+ * This is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 2 of the License, or (at your option) any later
+ * version.
+ *
+ * This software is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * the software. If not, see <http://www.gnu.org/licenses/>.
+ * 
+ * This file is partially derived from Linux kernel driver, with the following
+ * copyright information:
+ * Copyright 2004-2013 Freescale Semiconductor, Inc.
+ * Copyright 2005-2017 Amazon Technologies, Inc.
+ * Copyright (C) 2014-2016 Freescale Semiconductor, Inc.
+ * Copyright 2017 NXP
+ * Copyright 2018, 2021 Marc Juul
+ * Copyright (C) 2022 Samuel Holland <samuel@sholland.org>
+ * Copyright 2024 Wenting Zhang
+ ******************************************************************************/
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+typedef enum {
+    WAVEFORM_WBF, // E Ink waveform file
+    WAVEFORM_FW_V1, // i.MX EPDCv1 firmware, a byte per LUT entry
+    WAVEFORM_FW_V2, // i.MX EPDCv2 firmware, 2 LUT entries per byte
+    WAVEFORM_FLASH, // Compressed flash image holding a .wbf
+} waveform_format_t;
+
+// Shared by .wbf and .fw files. The first 28 bytes are only meaningful in
+// .wbf files, the EPDC firmware keeps whatever they were converted from.
+typedef struct {
+    uint32_t checksum:32; // 0
+    uint32_t filesize:32; // 4
+    uint32_t serial:32; // 8 serial number
+    uint32_t run_type:8; // 12
+    uint32_t fpl_platform:8; // 13
+    uint32_t fpl_lot:16; // 14
+    uint32_t mode_version_or_adhesive_run_num:8; // 16
+    uint32_t waveform_version:8; // 17
+    uint32_t waveform_subversion:8; // 18
+    uint32_t waveform_type:8; // 19
+    uint32_t fpl_size:8; // 20 (aka panel_size)
+    uint32_t mfg_code:8; // 21 (aka amepd_part_number)
+    uint32_t waveform_tuning_bias_or_rev:8; // 22
+    uint32_t fpl_rate:8; // 23 (aka frame_rate)
+    uint32_t unknown0:8;
+    uint32_t vcom_shifted:8;
+    uint32_t unknown1:16;
+    uint32_t xwia:24; // address of extra waveform information
+    uint32_t cs1:8; // checksum 1
+    uint32_t wmta:24;
+    uint32_t fvsn:8;
+    uint32_t luts:8;
+    uint32_t mc:8; // mode count (length of mode table - 1)
+    uint32_t trc:8; // temperature range count (length of temperature table - 1)
+    uint32_t advanced_wfm_flags:8;
+    uint32_t eb:8;
+    uint32_t sb:8;
+    uint32_t reserved0_1:8;
+    uint32_t reserved0_2:8;
+    uint32_t reserved0_3:8;
+    uint32_t reserved0_4:8;
+    uint32_t reserved0_5:8;
+    uint32_t cs2:8; // checksum 2
+} __attribute__((packed)) waveform_header_t;
+
+#define WAVEFORM_HEADER_SIZE (sizeof(waveform_header_t))
+
+// Problems found while parsing, see waveform_errors()
+#define WAVEFORM_ERR_POINTER        (0x01) // Pointer checksum mismatch
+#define WAVEFORM_ERR_TEMP_TABLE     (0x02) // Temperature table checksum
+#define WAVEFORM_ERR_XWIA           (0x04) // Extra information checksum
+#define WAVEFORM_ERR_TABLE          (0x08) // Table checksum
+#define WAVEFORM_ERR_DATA_OFFSET    (0x10) // Data offset doesn't match xwia
+
+typedef struct waveform waveform_t;
+
+const uint8_t *waveform_map_file(const char *filename, size_t *size);
+void waveform_unmap_file(const uint8_t *data, size_t size);
+int waveform_flash_decompress(const uint8_t *src, size_t size, uint8_t **dst,
+        size_t *dst_size);
+
+waveform_t *waveform_open(const char *filename, waveform_format_t format);
+waveform_t *waveform_open_mem(const uint8_t *data, size_t size,
+        waveform_format_t format);
+void waveform_close(waveform_t *wf);
+
+const waveform_header_t *waveform_header(const waveform_t *wf);
+const uint8_t *waveform_data(const waveform_t *wf, size_t *size);
+uint32_t waveform_errors(const waveform_t *wf);
+bool waveform_verify(const waveform_t *wf, uint32_t *crc);
+int waveform_bpp(const waveform_t *wf);
+int waveform_states(const waveform_t *wf);
+int waveform_modes(const waveform_t *wf);
+const char *waveform_mode_name(const waveform_t *wf, int mode);
+int waveform_temps(const waveform_t *wf);
+int waveform_temp_range(const waveform_t *wf, int temp);
+int waveform_find_temp(const waveform_t *wf, int degc);
+const char *waveform_xwia(const waveform_t *wf);
+size_t waveform_data_offset(const waveform_t *wf);
+uint32_t waveform_mode_offset(const waveform_t *wf, int mode);
+int waveform_tables(const waveform_t *wf);
+int waveform_table(const waveform_t *wf, int mode, int temp);
+uint32_t waveform_table_offset(const waveform_t *wf, int table);
+int waveform_frames(const waveform_t *wf, int table);
+bool waveform_table_ok(const waveform_t *wf, int table);
+int waveform_table_checksum(const waveform_t *wf, int table);
+size_t waveform_table_size(const waveform_t *wf, int table);
+const uint8_t *waveform_lut(waveform_t *wf, int table);
+
+static inline uint64_t waveform_read_uint64_le(const uint8_t *src) {
+    uint64_t val = 0;
+    for (int i = 7; i >= 0; i--)
+        val = (val << 8) | src[i];
+    return val;
+}
+
+static inline void waveform_write_uint64_le(uint8_t *dst, uint64_t val) {
+    for (int i = 0; i < 8; i++)
+        dst[i] = (val >> (i * 8)) & 0xff;
+}
@@ -36,6 +36,7 @@
 #include <inttypes.h>
 #include "ini.h"
 #include "csv.h"
+#include "waveform.h"
 
 #define MAX_MODES (32) // Maximum waveform modes supported
 #define MAX_TEMPS (32) // Maximum temperature ranges supported
@@ -46,35 +47,7 @@
 #define GREYSCALE_LEVEL (16)
 
 typedef struct {
-    unsigned int wi0;
-    unsigned int wi1;
-    unsigned int wi2;
-    unsigned int wi3;
-    unsigned int wi4;
-    unsigned int wi5;
-    unsigned int wi6;
-
-    unsigned int xwia: 24; // address of extra waveform information
-    unsigned int cs1: 8; // checksum 1
-
-    unsigned int wmta: 24;
-    unsigned int fvsn: 8;
-    unsigned int luts: 8;
-    unsigned int mc: 8; // mode count
-    unsigned int trc: 8; // temperature range count
-    unsigned int advanced_wfm_flags: 8;
-    unsigned int eb: 8;
-    unsigned int sb: 8;
-    unsigned int reserved0_1: 8;
-    unsigned int reserved0_2: 8;
-    unsigned int reserved0_3: 8;
-    unsigned int reserved0_4: 8;
-    unsigned int reserved0_5: 8;
-    unsigned int cs2: 8; // checksum 2
-} waveform_data_header_t;
-
-typedef struct {
-    waveform_data_header_t wdh;
+    waveform_header_t wdh;
     uint8_t data[];    /* Temperature Range Table + Waveform Data */
 } waveform_data_file_t;
 
@@ -160,17 +133,6 @@ static int ini_parser_handler(void* user, const char* section, const char* name,
     return 1;
 }
 
-static void write_uint64_le(uint8_t* dst, uint64_t val) {
-    dst[7] = (val >> 56) & 0xff;
-    dst[6] = (val >> 48) & 0xff;
-    dst[5] = (val >> 40) & 0xff;
-    dst[4] = (val >> 32) & 0xff;
-    dst[3] = (val >> 24) & 0xff;
-    dst[2] = (val >> 16) & 0xff;
-    dst[1] = (val >> 8) & 0xff;
-    dst[0] = (val) & 0xff;
-}
-
 static void parse_range(const char* str, int* begin, int* end) {
     // Parse range specified in the waveform.
     // Example:
@@ -342,7 +304,7 @@ int main(int argc, char *argv[]) {
     }
 
     // Calculate file size and offset
-    uint64_t header_size = sizeof(waveform_data_header_t);
+    uint64_t header_size = sizeof(waveform_header_t);
     uint64_t temp_table_size = sizeof(uint8_t) * context.temps;
     uint64_t mode_offset_table_size = sizeof(uint64_t) * context.modes;
     uint64_t temp_offset_table_size = sizeof(uint64_t) * context.temps;
@@ -378,7 +340,7 @@ int main(int argc, char *argv[]) {
     assert(pwvfm_file);
 
     // Fill waveform header
-    memset(&pwvfm_file->wdh, 0, sizeof(waveform_data_header_t));
+    memset(&pwvfm_file->wdh, 0, sizeof(waveform_header_t));
     pwvfm_file->wdh.trc = context.temps - 1;
     pwvfm_file->wdh.mc = context.modes - 1;
     // Other fields (including checksums) are generally directly imported from
@@ -395,10 +357,10 @@ int main(int argc, char *argv[]) {
     // Fill waveform offset table and temp offset table
     uint8_t* wvfm_data_region = &pwvfm_file->data[data_region_offset];
     for (int i = 0; i < context.modes; i++) {
-        write_uint64_le(&wvfm_data_region[i * 8],
+        waveform_write_uint64_le(&wvfm_data_region[i * 8],
                 mode_offset_table[i]);
         for (int j = 0; j < context.temps; j++) {
-            write_uint64_le(&wvfm_data_region[mode_offset_table[i] + j * 8],
+            waveform_write_uint64_le(&wvfm_data_region[mode_offset_table[i] + j * 8],
                     data_offset_table[i * context.temps + j]);
         }
     }
@@ -409,7 +371,7 @@ int main(int argc, char *argv[]) {
             size_t index = i * context.temps + j;
             uint8_t* wvfm_wr_ptr = &wvfm_data_region[data_offset_table[index]];
             int frame_count = context.frame_counts[index];
-            write_uint64_le(wvfm_wr_ptr, frame_count);
+            waveform_write_uint64_le(wvfm_wr_ptr, frame_count);
             wvfm_wr_ptr += 8;
             copy_lut(wvfm_wr_ptr, context.luts[i][j], frame_count * 256, ver);
         }
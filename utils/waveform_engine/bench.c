@@ -0,0 +1,418 @@
+// Eink software waveform engine benchmark
+// Copyright 2024 Wenting Zhang
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+// 
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <time.h>
+#include <unistd.h>
+#include "engine.h"
+#include "sched.h"
+#include "stream.h"
+#include "waveform.h"
+
+#define DEFAULT_WIDTH (2232)
+#define DEFAULT_HEIGHT (1680)
+#define DEFAULT_FRAMES (38)
+#define TARGET_RATE (85)
+#define MAX_FRAMES (1024)
+#define MAX_LINE (8192)
+#define PEN_SIZE (64)
+#define PEN_INTERVAL (4)
+#define STREAM_SLOTS (4)
+
+static double get_time(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Waveform with random drive values, timing doesn't depend on the content
+static uint8_t *make_lut(int states, int frames) {
+    uint8_t *lut = malloc(frames * states * states);
+    uint32_t seed = 1;
+    for (int i = 0; i < frames * states * states; i++) {
+        seed = seed * 1103515245 + 12345;
+        lut[i] = (seed >> 16) & 0x3;
+    }
+    return lut;
+}
+
+static void parse_range(const char *str, int *begin, int *end) {
+    const char *delim = strchr(str, ':');
+    *begin = atoi(str);
+    *end = delim ? atoi(delim + 1) : *begin;
+}
+
+// CSV as written by the waveform dump tools: src,dst,frame0,frame1,...
+static uint8_t *load_lut(const char *filename, int states, int *frames) {
+    FILE *fp = fopen(filename, "r");
+    if (!fp)
+        return NULL;
+    static char line[MAX_LINE];
+    uint8_t *lut = malloc(MAX_FRAMES * states * states);
+    memset(lut, 0, MAX_FRAMES * states * states);
+    *frames = 0;
+    while (fgets(line, sizeof(line), fp)) {
+        char *src_str = strtok(line, ",");
+        char *dst_str = strtok(NULL, ",");
+        if (!src_str || !dst_str)
+            continue;
+        int src0, src1, dst0, dst1;
+        parse_range(src_str, &src0, &src1);
+        parse_range(dst_str, &dst0, &dst1);
+        if ((src0 < 0) || (dst0 < 0) || (src1 >= states) || (dst1 >= states))
+            continue;
+        int frame = 0;
+        char *val;
+        while ((val = strtok(NULL, ",\r\n")) && (frame < MAX_FRAMES)) {
+            for (int src = src0; src <= src1; src++)
+                for (int dst = dst0; dst <= dst1; dst++)
+                    lut[(frame * states + dst) * states + src] = atoi(val);
+            frame++;
+        }
+        if (frame > *frames)
+            *frames = frame;
+    }
+    fclose(fp);
+    return lut;
+}
+
+// Table of the mode at the temperature, straight from a .wbf or .fw file
+static uint8_t *load_waveform(const char *filename, int mode, int degc,
+        int *states, int *frames) {
+    size_t len = strlen(filename);
+    waveform_format_t format = WAVEFORM_FW_V1;
+    if ((len > 4) && (strcmp(filename + len - 4, ".wbf") == 0))
+        format = WAVEFORM_WBF;
+    waveform_t *wf = waveform_open(filename, format);
+    if (!wf)
+        return NULL;
+    int table = waveform_table(wf, mode, waveform_find_temp(wf, degc));
+    const uint8_t *lut = waveform_lut(wf, table);
+    *frames = waveform_frames(wf, table);
+    *states = waveform_states(wf);
+    uint8_t *copy = NULL;
+    if (lut && (*frames > 0)) {
+        size_t size = (size_t)*frames * *states * *states;
+        copy = malloc(size);
+        memcpy(copy, lut, size);
+    }
+    waveform_close(wf);
+    return copy;
+}
+
+static void fill_random(uint8_t *buf, size_t size, uint32_t seed) {
+    for (size_t i = 0; i < size; i++) {
+        seed = seed * 1103515245 + 12345;
+        buf[i] = seed >> 16;
+    }
+}
+
+// Plain lookup to check the engine output against
+static bool verify(const engine_lut_t *lut, const uint8_t *old_img,
+        const uint8_t *new_img, int frame, const uint8_t *out, size_t pixels) {
+    int shift = (lut->states == 32) ? 3 : 4;
+    int states = lut->states;
+    for (size_t i = 0; i < pixels; i++) {
+        int src = old_img[i] >> shift;
+        int dst = new_img[i] >> shift;
+        int expected = lut->lut[(frame * states + dst) * states + src] & 0x3;
+        int actual = (out[i / 4] >> ((i % 4) * 2)) & 0x3;
+        if (expected != actual) {
+            fprintf(stderr, "Mismatch at pixel %zu frame %d: %d, expected %d\n",
+                    i, frame, actual, expected);
+            return false;
+        }
+    }
+    return true;
+}
+
+// Full screen update with small partial ones landing on top of it while it
+// runs, like pen strokes during a page turn. The second mode is the first
+// few frames of the waveform. Runs until every pixel is idle.
+static int run_sched(sched_t *sched, const engine_lut_t *lut,
+        const uint8_t *old_img, const uint8_t *new_img, uint8_t *pen_img,
+        int width, int height, uint8_t *out, int *frames_run) {
+    size_t pixels = (size_t)width * height;
+    sched_set_state(sched, old_img);
+    sched_update(sched, new_img, 0, 0, width, height, 0, false);
+    int frame = 0;
+    int active;
+    do {
+        if ((frame % PEN_INTERVAL == 0) && (frame < lut->frames * 2)) {
+            int x = (frame * PEN_SIZE / 2) % (width - PEN_SIZE);
+            int y = (frame * PEN_SIZE / 4) % (height - PEN_SIZE);
+            sched_update(sched, pen_img, x, y, PEN_SIZE, PEN_SIZE, 1, true);
+        }
+        active = sched_frame(sched, out);
+        if ((frame == 0) && !verify(lut, old_img, new_img, 0, out, pixels))
+            return -1;
+        frame++;
+    } while (active);
+    *frames_run = frame;
+    return 0;
+}
+
+// Check the newest frame in the ring against a plain packing of the drive
+// values
+static bool verify_stream(const stream_t *stream, const stream_config_t *cfg,
+        const uint8_t *drive) {
+    const stream_ring_t *ring = stream_ring(stream);
+    const uint8_t *rdptr = (const uint8_t *)ring + ring->data_offset +
+            (size_t)((ring->head - 1) % ring->slots) * ring->slot_size;
+    const stream_frame_marker_t *frame = (const stream_frame_marker_t *)rdptr;
+    if ((frame->magic != STREAM_FRAME_MAGIC) ||
+            (frame->sequence != ring->head - 1)) {
+        fprintf(stderr, "Bad frame marker\n");
+        return false;
+    }
+    rdptr += sizeof(stream_frame_marker_t);
+    int row_bytes = cfg->width / 4;
+    int bus_bytes = cfg->bus_bits / 8;
+    for (int y = 0; y < cfg->height; y++) {
+        const stream_line_marker_t *line = (const stream_line_marker_t *)rdptr;
+        if ((line->magic != STREAM_LINE_MAGIC) || (line->line != y)) {
+            fprintf(stderr, "Bad line marker at line %d\n", y);
+            return false;
+        }
+        rdptr += sizeof(stream_line_marker_t);
+        for (int x = 0; x < cfg->width; x++) {
+            // Pixel x of the bus word, counting from the top bits
+            int word = x / (bus_bytes * 4);
+            int bit = bus_bytes * 8 - 2 - (x % (bus_bytes * 4)) * 2;
+            int val = (rdptr[word * bus_bytes + bit / 8] >> (bit % 8)) & 0x3;
+            int expected = (drive[y * row_bytes + x / 4] >> ((x % 4) * 2)) & 0x3;
+            if (val != expected) {
+                fprintf(stderr, "Stream mismatch at %d, %d\n", x, y);
+                return false;
+            }
+        }
+        rdptr += row_bytes;
+    }
+    return true;
+}
+
+int main(int argc, char **argv) {
+    int width = DEFAULT_WIDTH;
+    int height = DEFAULT_HEIGHT;
+    int max_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    int states = 16;
+    int frames = DEFAULT_FRAMES;
+    char *lut_file = NULL;
+    char *stream_file = NULL;
+    int mode = 2;
+    int degc = 25;
+    int bus_bits = 16;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "w:h:t:b:f:l:o:c:m:T:")) != -1) {
+        switch (opt) {
+        case 'w': width = atoi(optarg); break;
+        case 'h': height = atoi(optarg); break;
+        case 't': max_threads = atoi(optarg); break;
+        case 'b': states = (atoi(optarg) == 5) ? 32 : 16; break;
+        case 'f': frames = atoi(optarg); break;
+        case 'l': lut_file = optarg; break;
+        case 'o': stream_file = optarg; break;
+        case 'c': bus_bits = atoi(optarg); break;
+        case 'm': mode = atoi(optarg); break;
+        case 'T': degc = atoi(optarg); break;
+        default:
+            fprintf(stderr, "Usage: wvfm_bench [-w width] [-h height] "
+                    "[-t threads] [-b 4|5] [-f frames] [-l lut.csv] "
+                    "[-o stream] [-c 8|16|32] [-m mode] [-T degC]\n");
+            fprintf(stderr, "lut.csv: waveform table written by the dump "
+                    "tools, random if not given. A .wbf or EPDCv1 .fw file "
+                    "is read directly, taking the mode and temperature "
+                    "given.\n");
+            fprintf(stderr, "stream: device node or file to write packed "
+                    "frames to, with the bus width given by -c\n");
+            return 1;
+        }
+    }
+    if (max_threads < 1)
+        max_threads = 1;
+
+    uint8_t *lut_data;
+    size_t lut_len = lut_file ? strlen(lut_file) : 0;
+    if ((lut_len > 4) && ((strcmp(lut_file + lut_len - 4, ".wbf") == 0) ||
+            (strcmp(lut_file + lut_len - 3, ".fw") == 0))) {
+        lut_data = load_waveform(lut_file, mode, degc, &states, &frames);
+        if (!lut_data) {
+            fprintf(stderr, "Failed to load %s\n", lut_file);
+            return 1;
+        }
+    }
+    else if (lut_file) {
+        lut_data = load_lut(lut_file, states, &frames);
+        if (!lut_data || !frames) {
+            fprintf(stderr, "Failed to load %s\n", lut_file);
+            return 1;
+        }
+    }
+    else {
+        lut_data = make_lut(states, frames);
+    }
+    engine_lut_t lut = {
+        .states = states,
+        .frames = frames,
+        .lut = lut_data
+    };
+
+    size_t pixels = (size_t)width * height;
+    uint8_t *old_img = malloc(pixels);
+    uint8_t *new_img = malloc(pixels);
+    fill_random(old_img, pixels, 1);
+    fill_random(new_img, pixels, 2);
+
+    printf("Waveform engine benchmark (%s)\n", engine_isa());
+    printf("%d x %d, %d levels, %d frames, target %d Hz\n", width, height,
+            states, frames, TARGET_RATE);
+    printf("threads  frames/s  Mpixel/s\n");
+
+    int threads = 1;
+    while (1) {
+        engine_t *engine = engine_create(width, height, threads);
+        if (!engine) {
+            fprintf(stderr, "Failed to create engine\n");
+            return 1;
+        }
+        uint8_t *out = malloc(engine_frame_size(engine));
+        engine_begin(engine, &lut, old_img, new_img);
+        engine_frame(engine, 0, out);
+        if (!verify(&lut, old_img, new_img, 0, out, pixels))
+            return 1;
+
+        // Run the waveform repeatedly for at least a second
+        int count = 0;
+        double start = get_time();
+        double elapsed;
+        do {
+            for (int frame = 0; frame < frames; frame++)
+                engine_frame(engine, frame, out);
+            count += frames;
+            elapsed = get_time() - start;
+        } while (elapsed < 1.0);
+        if (!verify(&lut, old_img, new_img, frames - 1, out, pixels))
+            return 1;
+
+        double rate = count / elapsed;
+        printf("%7d  %8.1f  %8.1f%s\n", threads, rate, rate * pixels / 1e6,
+                (rate >= TARGET_RATE) ? "" : "  (below target)");
+        free(out);
+        engine_destroy(engine);
+        if (threads == max_threads)
+            break;
+        threads = (threads * 2 < max_threads) ? (threads * 2) : max_threads;
+    }
+
+    // Packing overlapped with generating frames, on every thread
+    if (stream_file) {
+        stream_config_t cfg = {
+            .width = width,
+            .height = height,
+            .bus_bits = bus_bits,
+            .msb_first = true,
+            .frame_marker = true,
+            .line_marker = true,
+            .slots = STREAM_SLOTS
+        };
+        stream_t *stream = stream_open(stream_file, &cfg);
+        engine_t *engine = engine_create(width, height, max_threads);
+        if (!stream || !engine) {
+            fprintf(stderr, "Failed to open stream\n");
+            return 1;
+        }
+        engine_begin(engine, &lut, old_img, new_img);
+        int count = 0;
+        double start = get_time();
+        double elapsed;
+        do {
+            for (int frame = 0; frame < frames; frame++) {
+                engine_frame(engine, frame, stream_buffer(stream));
+                stream_submit(stream);
+            }
+            count += frames;
+            elapsed = get_time() - start;
+        } while (elapsed < 1.0);
+        stream_flush(stream);
+        elapsed = get_time() - start;
+
+        uint8_t *out = malloc(engine_frame_size(engine));
+        engine_frame(engine, frames - 1, out);
+        if (!verify_stream(stream, &cfg, out))
+            return 1;
+        double rate = count / elapsed;
+        printf("Stream to %s, %d bit bus, %d threads: %.1f frames/s%s\n",
+                stream_file, bus_bits, max_threads, rate,
+                (rate >= TARGET_RATE) ? "" : "  (below target)");
+        free(out);
+        engine_destroy(engine);
+        stream_close(stream);
+    }
+
+    // Per pixel scheduler, pixels only wait for their own last transition
+    engine_lut_t luts[2] = { lut, lut };
+    luts[1].frames = (frames < 8) ? frames : 8;
+    uint8_t *pen_img = malloc(pixels);
+    fill_random(pen_img, pixels, 3);
+    printf("Per pixel scheduler, %d frame updates every %d frames\n",
+            luts[1].frames, PEN_INTERVAL);
+    printf("threads  frames/s  frames run\n");
+    threads = 1;
+    while (1) {
+        sched_t *sched = sched_create(width, height, luts, 2, threads);
+        if (!sched) {
+            fprintf(stderr, "Failed to create scheduler\n");
+            return 1;
+        }
+        uint8_t *out = malloc(pixels / 4);
+        int count = 0;
+        int frames_run;
+        double start = get_time();
+        double elapsed;
+        do {
+            if (run_sched(sched, &lut, old_img, new_img, pen_img, width,
+                    height, out, &frames_run) != 0)
+                return 1;
+            count += frames_run;
+            elapsed = get_time() - start;
+        } while (elapsed < 1.0);
+
+        double rate = count / elapsed;
+        printf("%7d  %8.1f  %10d%s\n", threads, rate, frames_run,
+                (rate >= TARGET_RATE) ? "" : "  (below target)");
+        free(out);
+        sched_destroy(sched);
+        if (threads == max_threads)
+            break;
+        threads = (threads * 2 < max_threads) ? (threads * 2) : max_threads;
+    }
+
+    free(old_img);
+    free(new_img);
+    free(pen_img);
+    free(lut_data);
+    return 0;
+}
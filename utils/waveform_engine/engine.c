@@ -0,0 +1,301 @@
+// Eink software waveform engine
+// Copyright 2024 Wenting Zhang
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+// 
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include "engine.h"
+#include "pool.h"
+
+#if defined(__SSSE3__)
+#include <tmmintrin.h>
+#define ENGINE_SSSE3
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#include <arm_neon.h>
+#define ENGINE_NEON
+#endif
+
+// For every frame of an update, each pixel gets the drive value its waveform
+// lists for (frame, new state, old state). The states don't change during an
+// update, so they are converted once in engine_begin, then every frame is a
+// table lookup per pixel.
+//
+// A frame of a 4 bit waveform is a 256 entry table, too large for a single
+// byte shuffle. The two bits of the drive value are instead looked up as bit
+// matrices: for each new state, a row of bits over the old states. A shuffle
+// on the new state fetches a byte of the row, a second one on the low bits of
+// the old state picks the bit within it. 5 bit waveforms have rows of 4 bytes
+// and twice as many rows, taking more shuffles, but the same steps.
+//
+// Frames are split into bands of rows, one per thread.
+
+#define ENGINE_MAX_STATES (32)
+#define ENGINE_ROW_BYTES (ENGINE_MAX_STATES / 8)
+
+struct engine {
+    int width;
+    int height;
+    engine_lut_t lut;
+    uint8_t *src; // Old state of each pixel
+    uint8_t *dst; // New state of each pixel
+
+    // Frame being generated
+    uint8_t *out;
+    uint8_t drive[ENGINE_MAX_STATES * ENGINE_MAX_STATES]; // [dst][src]
+    // [bit][byte of row][dst / 16][dst % 16], bits over src
+    uint8_t tables[2][ENGINE_ROW_BYTES][2][16] __attribute__((aligned(16)));
+
+    pool_t *pool;
+};
+
+const char *engine_isa(void) {
+#if defined(ENGINE_SSSE3)
+    return "SSSE3";
+#elif defined(ENGINE_NEON)
+    return "NEON";
+#else
+    return "scalar";
+#endif
+}
+
+size_t engine_frame_size(const engine_t *engine) {
+    return (size_t)engine->width * engine->height / 4;
+}
+
+static void engine_build_tables(engine_t *engine, int frame) {
+    int states = engine->lut.states;
+    const uint8_t *lut = &engine->lut.lut[frame * states * states];
+    for (int i = 0; i < states * states; i++)
+        engine->drive[i] = lut[i] & 0x3;
+
+    memset(engine->tables, 0, sizeof(engine->tables));
+    for (int dst = 0; dst < states; dst++) {
+        for (int src = 0; src < states; src++) {
+            uint8_t val = engine->drive[dst * states + src];
+            for (int bit = 0; bit < 2; bit++) {
+                if (val & (1 << bit))
+                    engine->tables[bit][src / 8][dst / 16][dst % 16] |=
+                            1 << (src % 8);
+            }
+        }
+    }
+}
+
+static void engine_row_scalar(const engine_t *engine, const uint8_t *src,
+        const uint8_t *dst, uint8_t *out, int count) {
+    int states = engine->lut.states;
+    for (int x = 0; x < count; x += 4) {
+        uint8_t val = 0;
+        for (int i = 0; i < 4; i++)
+            val |= engine->drive[dst[x + i] * states + src[x + i]] << (i * 2);
+        *out++ = val;
+    }
+}
+
+#if defined(ENGINE_SSSE3)
+// Drive values (0-3) of 16 pixels
+static inline __m128i engine_lookup_16(const __m128i tables[2][4][2],
+        int row_bytes, bool wide, __m128i src, __m128i dst) {
+    const __m128i bit_table = _mm_setr_epi8(1, 2, 4, 8, 16, 32, 64, -128,
+            1, 2, 4, 8, 16, 32, 64, -128);
+    __m128i dst_lo = _mm_and_si128(dst, _mm_set1_epi8(0x0f));
+    __m128i dst_hi = _mm_cmpgt_epi8(dst, _mm_set1_epi8(0x0f));
+    __m128i bit_mask = _mm_shuffle_epi8(bit_table,
+            _mm_and_si128(src, _mm_set1_epi8(0x07)));
+    __m128i row_byte = _mm_and_si128(_mm_srli_epi16(src, 3),
+            _mm_set1_epi8(0x03));
+    __m128i result = _mm_setzero_si128();
+    for (int bit = 0; bit < 2; bit++) {
+        __m128i row = _mm_setzero_si128();
+        for (int i = 0; i < row_bytes; i++) {
+            __m128i val = _mm_shuffle_epi8(tables[bit][i][0], dst_lo);
+            if (wide) {
+                __m128i val_hi = _mm_shuffle_epi8(tables[bit][i][1], dst_lo);
+                val = _mm_or_si128(_mm_andnot_si128(dst_hi, val),
+                        _mm_and_si128(dst_hi, val_hi));
+            }
+            __m128i sel = _mm_cmpeq_epi8(row_byte, _mm_set1_epi8(i));
+            row = _mm_or_si128(row, _mm_and_si128(sel, val));
+        }
+        __m128i set = _mm_cmpeq_epi8(_mm_and_si128(row, bit_mask), bit_mask);
+        result = _mm_or_si128(result,
+                _mm_and_si128(set, _mm_set1_epi8(1 << bit)));
+    }
+    return result;
+}
+
+static void engine_row(const engine_t *engine, const uint8_t *src,
+        const uint8_t *dst, uint8_t *out, int count) {
+    __m128i tables[2][4][2];
+    int row_bytes = engine->lut.states / 8;
+    bool wide = (engine->lut.states > 16);
+    for (int bit = 0; bit < 2; bit++)
+        for (int i = 0; i < row_bytes; i++)
+            for (int j = 0; j < 2; j++)
+                tables[bit][i][j] = _mm_load_si128(
+                        (const __m128i *)engine->tables[bit][i][j]);
+
+    // 64 pixels into 16 bytes, 4 pixels per byte with the first one in the
+    // lowest bits
+    const __m128i weight_2 = _mm_set1_epi16(0x0401);
+    const __m128i weight_4 = _mm_set1_epi32(0x00100001);
+    int x;
+    for (x = 0; x + 64 <= count; x += 64) {
+        __m128i packed[4];
+        for (int i = 0; i < 4; i++) {
+            __m128i s = _mm_loadu_si128((const __m128i *)&src[x + i * 16]);
+            __m128i d = _mm_loadu_si128((const __m128i *)&dst[x + i * 16]);
+            __m128i val = engine_lookup_16(tables, row_bytes, wide, s, d);
+            packed[i] = _mm_madd_epi16(_mm_maddubs_epi16(val, weight_2),
+                    weight_4);
+        }
+        __m128i lo = _mm_packs_epi32(packed[0], packed[1]);
+        __m128i hi = _mm_packs_epi32(packed[2], packed[3]);
+        _mm_storeu_si128((__m128i *)&out[x / 4], _mm_packus_epi16(lo, hi));
+    }
+    engine_row_scalar(engine, &src[x], &dst[x], &out[x / 4], count - x);
+}
+#elif defined(ENGINE_NEON)
+// Drive values (0-3) of 16 pixels
+static inline uint8x16_t engine_lookup_16(const uint8x16_t tables[2][4][2],
+        int row_bytes, bool wide, uint8x16_t src, uint8x16_t dst) {
+    uint8x16_t dst_lo = vandq_u8(dst, vdupq_n_u8(0x0f));
+    uint8x16_t dst_hi = vcgtq_u8(dst, vdupq_n_u8(0x0f));
+    uint8x16_t bit_mask = vshlq_u8(vdupq_n_u8(1),
+            vreinterpretq_s8_u8(vandq_u8(src, vdupq_n_u8(0x07))));
+    uint8x16_t row_byte = vshrq_n_u8(src, 3);
+    uint8x16_t result = vdupq_n_u8(0);
+    for (int bit = 0; bit < 2; bit++) {
+        uint8x16_t row = vdupq_n_u8(0);
+        for (int i = 0; i < row_bytes; i++) {
+            uint8x16_t val = vqtbl1q_u8(tables[bit][i][0], dst_lo);
+            if (wide)
+                val = vbslq_u8(dst_hi, vqtbl1q_u8(tables[bit][i][1], dst_lo),
+                        val);
+            row = vbslq_u8(vceqq_u8(row_byte, vdupq_n_u8(i)), val, row);
+        }
+        uint8x16_t set = vtstq_u8(row, bit_mask);
+        result = vorrq_u8(result, vandq_u8(set, vdupq_n_u8(1 << bit)));
+    }
+    return result;
+}
+
+static void engine_row(const engine_t *engine, const uint8_t *src,
+        const uint8_t *dst, uint8_t *out, int count) {
+    uint8x16_t tables[2][4][2];
+    int row_bytes = engine->lut.states / 8;
+    bool wide = (engine->lut.states > 16);
+    for (int bit = 0; bit < 2; bit++)
+        for (int i = 0; i < row_bytes; i++)
+            for (int j = 0; j < 2; j++)
+                tables[bit][i][j] = vld1q_u8(engine->tables[bit][i][j]);
+
+    // De-interleaving loads put every 4th pixel in the same vector, so the
+    // packed bytes are just shifted and or'ed together
+    int x;
+    for (x = 0; x + 64 <= count; x += 64) {
+        uint8x16x4_t s = vld4q_u8(&src[x]);
+        uint8x16x4_t d = vld4q_u8(&dst[x]);
+        uint8x16_t val = vdupq_n_u8(0);
+        for (int i = 0; i < 4; i++) {
+            uint8x16_t drive = engine_lookup_16(tables, row_bytes, wide,
+                    s.val[i], d.val[i]);
+            val = vorrq_u8(val, vshlq_u8(drive, vdupq_n_s8(i * 2)));
+        }
+        vst1q_u8(&out[x / 4], val);
+    }
+    engine_row_scalar(engine, &src[x], &dst[x], &out[x / 4], count - x);
+}
+#else
+#define engine_row engine_row_scalar
+#endif
+
+static void engine_process(void *arg, int index, int count) {
+    engine_t *engine = arg;
+    int y0 = engine->height * index / count;
+    int y1 = engine->height * (index + 1) / count;
+    size_t offset = (size_t)y0 * engine->width;
+    engine_row(engine, &engine->src[offset], &engine->dst[offset],
+            &engine->out[offset / 4], (y1 - y0) * engine->width);
+}
+
+// Width has to be a multiple of 4, so every row starts on a byte. Threads
+// include the calling one.
+engine_t *engine_create(int width, int height, int threads) {
+    if ((width <= 0) || (width % 4) || (height <= 0) || (threads <= 0))
+        return NULL;
+    if (threads > height)
+        threads = height;
+    engine_t *engine = calloc(1, sizeof(engine_t));
+    if (!engine)
+        return NULL;
+    engine->width = width;
+    engine->height = height;
+    engine->src = malloc((size_t)width * height);
+    engine->dst = malloc((size_t)width * height);
+    engine->pool = pool_create(threads);
+    if (!engine->src || !engine->dst || !engine->pool) {
+        engine_destroy(engine);
+        return NULL;
+    }
+    return engine;
+}
+
+void engine_destroy(engine_t *engine) {
+    if (engine->pool)
+        pool_destroy(engine->pool);
+    free(engine->src);
+    free(engine->dst);
+    free(engine);
+}
+
+// Start an update from old_img to new_img, both 8 bit grey of the engine size.
+// The LUT has to stay valid until the last frame is generated.
+int engine_begin(engine_t *engine, const engine_lut_t *lut,
+        const uint8_t *old_img, const uint8_t *new_img) {
+    int shift;
+    if (lut->states == 16)
+        shift = 4;
+    else if (lut->states == 32)
+        shift = 3;
+    else
+        return -1;
+    engine->lut = *lut;
+    size_t count = (size_t)engine->width * engine->height;
+    for (size_t i = 0; i < count; i++) {
+        engine->src[i] = old_img[i] >> shift;
+        engine->dst[i] = new_img[i] >> shift;
+    }
+    return 0;
+}
+
+// Generate a frame of drive values, 2 bits per pixel, 4 pixels per byte with
+// the first pixel in the lowest bits. out holds engine_frame_size() bytes.
+int engine_frame(engine_t *engine, int frame, uint8_t *out) {
+    if ((frame < 0) || (frame >= engine->lut.frames))
+        return -1;
+    engine_build_tables(engine, frame);
+    engine->out = out;
+    pool_run(engine->pool, engine_process, engine);
+    return 0;
+}
@@ -0,0 +1,48 @@
+// Eink software waveform engine
+// Copyright 2024 Wenting Zhang
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+// 
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+// Drive values found in the waveform LUTs, 2 bits per pixel
+#define ENGINE_DRIVE_NONE   (0)
+#define ENGINE_DRIVE_BLACK  (1)
+#define ENGINE_DRIVE_WHITE  (2)
+
+// Waveform of a single mode at a single temperature, as decoded by the
+// waveform dump tools
+typedef struct {
+    int states; // Grey levels, 16 (4 bit) or 32 (5 bit)
+    int frames;
+    const uint8_t *lut; // lut[frame * states * states + dst * states + src]
+} engine_lut_t;
+
+typedef struct engine engine_t;
+
+engine_t *engine_create(int width, int height, int threads);
+void engine_destroy(engine_t *engine);
+int engine_begin(engine_t *engine, const engine_lut_t *lut,
+        const uint8_t *old_img, const uint8_t *new_img);
+int engine_frame(engine_t *engine, int frame, uint8_t *out);
+size_t engine_frame_size(const engine_t *engine);
+const char *engine_isa(void);
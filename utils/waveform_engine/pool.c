@@ -0,0 +1,138 @@
+// Eink software waveform engine thread pool
+// Copyright 2024 Wenting Zhang
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+// 
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include "pool.h"
+
+// Fixed set of threads running the same job on their share of the work. The
+// calling thread takes share 0, so a pool of 1 runs everything inline.
+
+typedef struct {
+    pool_t *pool;
+    int index;
+} pool_worker_t;
+
+struct pool {
+    int threads;
+    pthread_t *workers;
+    pool_worker_t *worker_args;
+    pthread_mutex_t lock;
+    pthread_cond_t start_cond;
+    pthread_cond_t done_cond;
+    pool_job_t job;
+    void *arg;
+    uint32_t generation;
+    int pending;
+    bool quit;
+};
+
+static void *pool_worker(void *arg) {
+    pool_worker_t *worker = arg;
+    pool_t *pool = worker->pool;
+    uint32_t generation = 0;
+    pthread_mutex_lock(&pool->lock);
+    while (1) {
+        while ((pool->generation == generation) && !pool->quit)
+            pthread_cond_wait(&pool->start_cond, &pool->lock);
+        if (pool->quit)
+            break;
+        generation = pool->generation;
+        pthread_mutex_unlock(&pool->lock);
+
+        pool->job(pool->arg, worker->index, pool->threads);
+
+        pthread_mutex_lock(&pool->lock);
+        if (--pool->pending == 0)
+            pthread_cond_signal(&pool->done_cond);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+// Threads include the calling one
+pool_t *pool_create(int threads) {
+    if (threads <= 0)
+        return NULL;
+    pool_t *pool = calloc(1, sizeof(pool_t));
+    if (!pool)
+        return NULL;
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->start_cond, NULL);
+    pthread_cond_init(&pool->done_cond, NULL);
+    pool->threads = 1;
+    pool->workers = calloc(threads, sizeof(pthread_t));
+    pool->worker_args = calloc(threads, sizeof(pool_worker_t));
+    if (!pool->workers || !pool->worker_args) {
+        pool_destroy(pool);
+        return NULL;
+    }
+    for (int i = 1; i < threads; i++) {
+        pool->worker_args[i].pool = pool;
+        pool->worker_args[i].index = i;
+        if (pthread_create(&pool->workers[i], NULL, pool_worker,
+                &pool->worker_args[i]) != 0) {
+            pool_destroy(pool);
+            return NULL;
+        }
+        pool->threads = i + 1;
+    }
+    return pool;
+}
+
+void pool_destroy(pool_t *pool) {
+    pthread_mutex_lock(&pool->lock);
+    pool->quit = true;
+    pthread_cond_broadcast(&pool->start_cond);
+    pthread_mutex_unlock(&pool->lock);
+    for (int i = 1; i < pool->threads; i++)
+        pthread_join(pool->workers[i], NULL);
+    free(pool->workers);
+    free(pool->worker_args);
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->start_cond);
+    pthread_cond_destroy(&pool->done_cond);
+    free(pool);
+}
+
+int pool_threads(const pool_t *pool) {
+    return pool->threads;
+}
+
+// Run the job on all threads, returns once every one has finished
+void pool_run(pool_t *pool, pool_job_t job, void *arg) {
+    pthread_mutex_lock(&pool->lock);
+    pool->job = job;
+    pool->arg = arg;
+    pool->pending = pool->threads - 1;
+    pool->generation++;
+    pthread_cond_broadcast(&pool->start_cond);
+    pthread_mutex_unlock(&pool->lock);
+
+    job(arg, 0, pool->threads);
+
+    pthread_mutex_lock(&pool->lock);
+    while (pool->pending)
+        pthread_cond_wait(&pool->done_cond, &pool->lock);
+    pthread_mutex_unlock(&pool->lock);
+}
@@ -0,0 +1,440 @@
+// Eink software waveform engine per pixel scheduler
+// Copyright 2024 Wenting Zhang
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+// 
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include "engine.h"
+#include "pool.h"
+#include "sched.h"
+
+#if defined(__SSSE3__)
+#include <tmmintrin.h>
+#define SCHED_SSSE3
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#include <arm_neon.h>
+#define SCHED_NEON
+#endif
+
+// The EPDC runs every update on one of a handful of LUTs, and an update
+// touching pixels of a running one has to wait for all of it to finish. Here
+// every pixel runs its own transition instead: its source and target state,
+// the mode, and the frames left. A pixel receiving a new target while busy
+// keeps it as pending and starts it as soon as its own transition is done,
+// so overlapping updates never wait on each other beyond the pixels shared.
+//
+// The state is kept as separate arrays so frames can be stepped with plain
+// vector operations. LUTs are stored with their frames in reverse, so the
+// frames left count indexes them directly, and a pixel is idle once it hits
+// 0. Work happens in chunks of pixels, skipping idle chunks entirely, and
+// only the chunks where transitions end take the slower per pixel path.
+// Unlike the engine, every pixel may be on a different mode and frame, so
+// drive values are still fetched one by one, only the rest is in vectors.
+//
+// Per pixel state is not locked: sched_update and sched_set_state must not
+// run while sched_frame is generating a frame.
+
+#define SCHED_MAX_MODES (16)
+#define SCHED_CHUNK (64)
+#define SCHED_NEXT_PARTIAL (0x80)
+
+struct sched {
+    int width;
+    int height;
+    int states;
+    int shift;
+    int modes;
+    uint8_t *luts; // All modes, frames reversed
+    size_t base[SCHED_MAX_MODES]; // Offset of the last frame of each mode
+    uint16_t frames[SCHED_MAX_MODES];
+
+    // Per pixel state
+    uint8_t *src; // State the pixel is in, or leaving
+    uint8_t *dst; // State the pixel is driven to
+    uint8_t *mode;
+    uint16_t *left; // Frames left of the transition, 0 if idle
+    uint8_t *next; // Mode of the pending transition plus 1, 0 if none
+    uint8_t *next_dst;
+
+    uint8_t *out;
+    int *active; // Pixels still active, per thread
+    pool_t *pool;
+};
+
+// All LUTs need the same number of states. Width has to be a multiple of 4.
+sched_t *sched_create(int width, int height, const engine_lut_t *luts,
+        int modes, int threads) {
+    if ((width <= 0) || (width % 4) || (height <= 0) || (modes <= 0) ||
+            (modes > SCHED_MAX_MODES) || (threads <= 0))
+        return NULL;
+    int states = luts[0].states;
+    if ((states != 16) && (states != 32))
+        return NULL;
+    size_t lut_size = 0;
+    for (int i = 0; i < modes; i++) {
+        if ((luts[i].states != states) || (luts[i].frames > UINT16_MAX))
+            return NULL;
+        lut_size += (size_t)luts[i].frames * states * states;
+    }
+
+    sched_t *sched = calloc(1, sizeof(sched_t));
+    if (!sched)
+        return NULL;
+    sched->width = width;
+    sched->height = height;
+    sched->states = states;
+    sched->shift = (states == 32) ? 3 : 4;
+    sched->modes = modes;
+    size_t pixels = (size_t)width * height;
+    sched->luts = malloc(lut_size + 1);
+    sched->src = malloc(pixels);
+    sched->dst = malloc(pixels);
+    sched->mode = malloc(pixels);
+    sched->left = calloc(pixels, sizeof(uint16_t));
+    sched->next = calloc(pixels, 1);
+    sched->next_dst = malloc(pixels);
+    sched->active = calloc(threads, sizeof(int));
+    sched->pool = pool_create((threads < height) ? threads : height);
+    if (!sched->luts || !sched->src || !sched->dst || !sched->mode ||
+            !sched->left || !sched->next || !sched->next_dst ||
+            !sched->active || !sched->pool) {
+        sched_destroy(sched);
+        return NULL;
+    }
+
+    // Frame f of a mode with n frames is found n - 1 - f frames from its
+    // base, so a pixel with l frames left uses frame l - 1
+    size_t frame_size = states * states;
+    size_t offset = 0;
+    for (int i = 0; i < modes; i++) {
+        int frames = luts[i].frames;
+        for (int f = 0; f < frames; f++) {
+            const uint8_t *rdptr = &luts[i].lut[f * frame_size];
+            uint8_t *wrptr = &sched->luts[offset + (frames - 1 - f) *
+                    frame_size];
+            for (size_t j = 0; j < frame_size; j++)
+                wrptr[j] = rdptr[j] & 0x3;
+        }
+        sched->base[i] = offset;
+        sched->frames[i] = frames;
+        offset += frames * frame_size;
+    }
+
+    memset(sched->src, states - 1, pixels);
+    memset(sched->dst, states - 1, pixels);
+    memset(sched->mode, 0, pixels);
+    return sched;
+}
+
+void sched_destroy(sched_t *sched) {
+    if (sched->pool)
+        pool_destroy(sched->pool);
+    free(sched->luts);
+    free(sched->src);
+    free(sched->dst);
+    free(sched->mode);
+    free(sched->left);
+    free(sched->next);
+    free(sched->next_dst);
+    free(sched->active);
+    free(sched);
+}
+
+// Set what the panel shows, in 8 bit grey, stopping every transition. Not to
+// be called while sched_frame runs.
+void sched_set_state(sched_t *sched, const uint8_t *img) {
+    size_t pixels = (size_t)sched->width * sched->height;
+    for (size_t i = 0; i < pixels; i++) {
+        sched->src[i] = img[i] >> sched->shift;
+        sched->dst[i] = sched->src[i];
+    }
+    memset(sched->left, 0, pixels * sizeof(uint16_t));
+    memset(sched->next, 0, pixels);
+}
+
+// Begin the transition of an idle pixel. Partial updates leave pixels
+// already showing the target alone.
+static inline void sched_begin(sched_t *sched, size_t i, uint8_t state,
+        int mode, bool partial) {
+    if (partial && (state == sched->src[i]))
+        return;
+    sched->dst[i] = state;
+    sched->mode[i] = mode;
+    sched->left[i] = sched->frames[mode];
+    if (!sched->left[i])
+        sched->src[i] = state;
+}
+
+// Drive the pixels of the rect to the 8 bit grey image, which is the size of
+// the whole screen. Pixels still in a transition start once it's finished, a
+// later update replacing a target still pending. Not to be called while
+// sched_frame runs.
+int sched_update(sched_t *sched, const uint8_t *img, int x, int y, int w,
+        int h, int mode, bool partial) {
+    if ((mode < 0) || (mode >= sched->modes) || (x < 0) || (y < 0) ||
+            (w < 0) || (h < 0) || (x + w > sched->width) ||
+            (y + h > sched->height))
+        return -1;
+    for (int yy = y; yy < y + h; yy++) {
+        size_t i = (size_t)yy * sched->width + x;
+        for (int xx = 0; xx < w; xx++, i++) {
+            uint8_t state = img[i] >> sched->shift;
+            if (!sched->left[i]) {
+                sched_begin(sched, i, state, mode, partial);
+            }
+            else if (partial && !sched->next[i] && (state == sched->dst[i])) {
+                // Already on its way
+            }
+            else {
+                sched->next[i] = (mode + 1) | (partial ? SCHED_NEXT_PARTIAL : 0);
+                sched->next_dst[i] = state;
+            }
+        }
+    }
+    return 0;
+}
+
+// Pixels of the chunk that just finished their transition
+static void sched_finish(sched_t *sched, size_t start, int count,
+        const uint8_t *done) {
+    for (int j = 0; j < count; j++) {
+        if (!done[j])
+            continue;
+        size_t i = start + j;
+        sched->src[i] = sched->dst[i];
+        uint8_t next = sched->next[i];
+        if (next) {
+            sched->next[i] = 0;
+            sched_begin(sched, i, sched->next_dst[i],
+                    (next & ~SCHED_NEXT_PARTIAL) - 1,
+                    next & SCHED_NEXT_PARTIAL);
+        }
+    }
+}
+
+// Whether any pixel of the chunk has a transition running
+static inline bool sched_busy_scalar(const uint16_t *left, int n) {
+    uint16_t busy = 0;
+    for (int j = 0; j < n; j++)
+        busy |= left[j];
+    return busy != 0;
+}
+
+// Step every running transition a frame, marking the pixels finishing it in
+// done. Returns whether there are any.
+static inline bool sched_step_scalar(uint16_t *left, uint8_t *done, int n) {
+    uint8_t any_done = 0;
+    for (int j = 0; j < n; j++) {
+        done[j] = (left[j] == 1);
+        any_done |= done[j];
+        left[j] -= (left[j] != 0);
+    }
+    return any_done;
+}
+
+// Pixels with a transition running
+static inline int sched_count_scalar(const uint16_t *left, int n) {
+    int active = 0;
+    for (int j = 0; j < n; j++)
+        active += (left[j] != 0);
+    return active;
+}
+
+// 4 pixels per byte with the first one in the lowest bits
+static inline void sched_pack_scalar(const uint8_t *drive, uint8_t *out,
+        int n) {
+    for (int j = 0; j < n; j += 4)
+        out[j / 4] = drive[j] | (drive[j + 1] << 2) |
+                (drive[j + 2] << 4) | (drive[j + 3] << 6);
+}
+
+// Vector versions take full chunks, the last chunk of a band may be shorter
+#if defined(SCHED_SSSE3)
+static inline bool sched_busy(const uint16_t *left, int n) {
+    if (n < SCHED_CHUNK)
+        return sched_busy_scalar(left, n);
+    __m128i busy = _mm_setzero_si128();
+    for (int j = 0; j < SCHED_CHUNK; j += 8)
+        busy = _mm_or_si128(busy, _mm_loadu_si128((const __m128i *)&left[j]));
+    return _mm_movemask_epi8(_mm_cmpeq_epi16(busy, _mm_setzero_si128())) !=
+            0xffff;
+}
+
+static inline bool sched_step(uint16_t *left, uint8_t *done, int n) {
+    if (n < SCHED_CHUNK)
+        return sched_step_scalar(left, done, n);
+    const __m128i one = _mm_set1_epi16(1);
+    __m128i any_done = _mm_setzero_si128();
+    for (int j = 0; j < SCHED_CHUNK; j += 16) {
+        __m128i l0 = _mm_loadu_si128((const __m128i *)&left[j]);
+        __m128i l1 = _mm_loadu_si128((const __m128i *)&left[j + 8]);
+        __m128i d = _mm_packs_epi16(_mm_cmpeq_epi16(l0, one),
+                _mm_cmpeq_epi16(l1, one));
+        _mm_storeu_si128((__m128i *)&done[j], d);
+        any_done = _mm_or_si128(any_done, d);
+        // Saturating, so idle pixels stay at 0
+        _mm_storeu_si128((__m128i *)&left[j], _mm_subs_epu16(l0, one));
+        _mm_storeu_si128((__m128i *)&left[j + 8], _mm_subs_epu16(l1, one));
+    }
+    return _mm_movemask_epi8(any_done) != 0;
+}
+
+static inline int sched_count(const uint16_t *left, int n) {
+    if (n < SCHED_CHUNK)
+        return sched_count_scalar(left, n);
+    int idle = 0;
+    for (int j = 0; j < SCHED_CHUNK; j += 8) {
+        __m128i l = _mm_loadu_si128((const __m128i *)&left[j]);
+        idle += __builtin_popcount(_mm_movemask_epi8(
+                _mm_cmpeq_epi16(l, _mm_setzero_si128())));
+    }
+    // 2 mask bits per pixel
+    return SCHED_CHUNK - idle / 2;
+}
+
+// Same packing as the engine
+static inline void sched_pack(const uint8_t *drive, uint8_t *out, int n) {
+    if (n < SCHED_CHUNK) {
+        sched_pack_scalar(drive, out, n);
+        return;
+    }
+    const __m128i weight_2 = _mm_set1_epi16(0x0401);
+    const __m128i weight_4 = _mm_set1_epi32(0x00100001);
+    __m128i packed[4];
+    for (int i = 0; i < 4; i++) {
+        __m128i val = _mm_loadu_si128((const __m128i *)&drive[i * 16]);
+        packed[i] = _mm_madd_epi16(_mm_maddubs_epi16(val, weight_2),
+                weight_4);
+    }
+    __m128i lo = _mm_packs_epi32(packed[0], packed[1]);
+    __m128i hi = _mm_packs_epi32(packed[2], packed[3]);
+    _mm_storeu_si128((__m128i *)out, _mm_packus_epi16(lo, hi));
+}
+#elif defined(SCHED_NEON)
+static inline bool sched_busy(const uint16_t *left, int n) {
+    if (n < SCHED_CHUNK)
+        return sched_busy_scalar(left, n);
+    uint16x8_t busy = vdupq_n_u16(0);
+    for (int j = 0; j < SCHED_CHUNK; j += 8)
+        busy = vorrq_u16(busy, vld1q_u16(&left[j]));
+    return vmaxvq_u16(busy) != 0;
+}
+
+static inline bool sched_step(uint16_t *left, uint8_t *done, int n) {
+    if (n < SCHED_CHUNK)
+        return sched_step_scalar(left, done, n);
+    const uint16x8_t one = vdupq_n_u16(1);
+    uint8x16_t any_done = vdupq_n_u8(0);
+    for (int j = 0; j < SCHED_CHUNK; j += 16) {
+        uint16x8_t l0 = vld1q_u16(&left[j]);
+        uint16x8_t l1 = vld1q_u16(&left[j + 8]);
+        uint8x16_t d = vcombine_u8(vmovn_u16(vceqq_u16(l0, one)),
+                vmovn_u16(vceqq_u16(l1, one)));
+        vst1q_u8(&done[j], d);
+        any_done = vorrq_u8(any_done, d);
+        // Saturating, so idle pixels stay at 0
+        vst1q_u16(&left[j], vqsubq_u16(l0, one));
+        vst1q_u16(&left[j + 8], vqsubq_u16(l1, one));
+    }
+    return vmaxvq_u8(any_done) != 0;
+}
+
+static inline int sched_count(const uint16_t *left, int n) {
+    if (n < SCHED_CHUNK)
+        return sched_count_scalar(left, n);
+    uint16x8_t active = vdupq_n_u16(0);
+    for (int j = 0; j < SCHED_CHUNK; j += 8) {
+        uint16x8_t l = vld1q_u16(&left[j]);
+        active = vaddq_u16(active, vshrq_n_u16(vtstq_u16(l, l), 15));
+    }
+    return vaddvq_u16(active);
+}
+
+// De-interleaving load puts every 4th pixel in the same vector
+static inline void sched_pack(const uint8_t *drive, uint8_t *out, int n) {
+    if (n < SCHED_CHUNK) {
+        sched_pack_scalar(drive, out, n);
+        return;
+    }
+    uint8x16x4_t d = vld4q_u8(drive);
+    uint8x16_t val = vorrq_u8(vorrq_u8(d.val[0], vshlq_n_u8(d.val[1], 2)),
+            vorrq_u8(vshlq_n_u8(d.val[2], 4), vshlq_n_u8(d.val[3], 6)));
+    vst1q_u8(out, val);
+}
+#else
+#define sched_busy sched_busy_scalar
+#define sched_step sched_step_scalar
+#define sched_count sched_count_scalar
+#define sched_pack sched_pack_scalar
+#endif
+
+static void sched_process(void *arg, int index, int count) {
+    sched_t *sched = arg;
+    int y0 = sched->height * index / count;
+    int y1 = sched->height * (index + 1) / count;
+    size_t start = (size_t)y0 * sched->width;
+    size_t end = (size_t)y1 * sched->width;
+    int states = sched->states;
+    size_t frame_size = states * states;
+    int active = 0;
+
+    for (size_t chunk = start; chunk < end; chunk += SCHED_CHUNK) {
+        int n = (end - chunk < SCHED_CHUNK) ? (end - chunk) : SCHED_CHUNK;
+        uint16_t *left = &sched->left[chunk];
+        uint8_t *out = &sched->out[chunk / 4];
+
+        if (!sched_busy(left, n)) {
+            memset(out, 0, n / 4);
+            continue;
+        }
+
+        // Drive values, idle pixels aren't driven
+        const uint8_t *src = &sched->src[chunk];
+        const uint8_t *dst = &sched->dst[chunk];
+        const uint8_t *mode = &sched->mode[chunk];
+        uint8_t drive[SCHED_CHUNK];
+        for (int j = 0; j < n; j++) {
+            drive[j] = left[j] ? sched->luts[sched->base[mode[j]] +
+                    (left[j] - 1) * frame_size + dst[j] * states + src[j]] : 0;
+        }
+        sched_pack(drive, out, n);
+
+        uint8_t done[SCHED_CHUNK];
+        if (sched_step(left, done, n))
+            sched_finish(sched, chunk, n, done);
+        active += sched_count(left, n);
+    }
+    sched->active[index] = active;
+}
+
+// Generate the next frame of drive values for the whole screen, 2 bits per
+// pixel, 4 pixels per byte with the first pixel in the lowest bits. Returns
+// the number of pixels with transitions left.
+int sched_frame(sched_t *sched, uint8_t *out) {
+    sched->out = out;
+    pool_run(sched->pool, sched_process, sched);
+    int active = 0;
+    for (int i = 0; i < pool_threads(sched->pool); i++)
+        active += sched->active[i];
+    return active;
+}
@@ -0,0 +1,358 @@
+// Eink software waveform engine FPGA frame stream
+// Copyright 2024 Wenting Zhang
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+// 
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "stream.h"
+
+#if defined(__SSSE3__)
+#include <tmmintrin.h>
+#define STREAM_SSSE3
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#include <arm_neon.h>
+#define STREAM_NEON
+#endif
+
+// Drive frames for the FPGA go through a ring of frame slots mapped from a
+// device node, or from a regular file standing in for it. Frames are packed
+// straight into the mapping, there is no copy after that, and the consumer
+// advances the tail once it has sent a frame out. A file has no consumer, so
+// the oldest frame gets dropped instead of waiting, leaving the last frames
+// written in the file.
+//
+// Packing happens on a thread of its own. The caller fills one of two
+// buffers with the next frame while the other one is packed, so generating
+// the drive values of a frame overlaps with packing the previous one.
+//
+// In the waveform engine output the first pixel is in the lowest bits of a
+// byte. A bus word with the first pixel in its highest bits needs the pixel
+// order reversed within each byte, done with a shuffle per nibble, and the
+// byte order reversed within each word, a single shuffle.
+
+#define STREAM_VERSION (1)
+#define STREAM_ALIGN (4096)
+#define STREAM_POLL_TIMEOUT (100)
+
+struct stream {
+    stream_config_t config;
+    int fd;
+    bool is_file;
+    uint8_t *map;
+    size_t map_size;
+    stream_ring_t *ring;
+    size_t row_bytes; // Of drive values, in and out
+    size_t buffer_size;
+    uint32_t sequence;
+
+    uint8_t *buffers[2];
+    bool full[2]; // Submitted, not packed yet
+    int current; // Buffer being filled by the caller
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    bool quit;
+};
+
+static size_t stream_align(size_t size) {
+    return (size + STREAM_ALIGN - 1) / STREAM_ALIGN * STREAM_ALIGN;
+}
+
+// Pixel order within a byte reversed
+static inline uint8_t stream_reverse(uint8_t val) {
+    val = (val >> 4) | (val << 4);
+    return ((val >> 2) & 0x33) | ((val & 0x33) << 2);
+}
+
+static void stream_pack_scalar(uint8_t *dst, const uint8_t *src, size_t size,
+        int bus_bytes) {
+    for (size_t i = 0; i < size; i += bus_bytes)
+        for (int j = 0; j < bus_bytes; j++)
+            dst[i + j] = stream_reverse(src[i + bus_bytes - 1 - j]);
+}
+
+// Pack drive values as written by the engine into bus words. Size has to be
+// a multiple of the bus word.
+void stream_pack(uint8_t *dst, const uint8_t *src, size_t size, int bus_bits,
+        bool msb_first) {
+    if (!msb_first) {
+        // Already in order, words are little endian
+        memcpy(dst, src, size);
+        return;
+    }
+    int bus_bytes = bus_bits / 8;
+    size_t i = 0;
+#if defined(STREAM_SSSE3)
+    const __m128i tab_lo = _mm_setr_epi8(0x00, 0x04, 0x08, 0x0c, 0x01, 0x05,
+            0x09, 0x0d, 0x02, 0x06, 0x0a, 0x0e, 0x03, 0x07, 0x0b, 0x0f);
+    const __m128i tab_hi = _mm_slli_epi16(tab_lo, 4);
+    const __m128i order = (bus_bytes == 4) ?
+            _mm_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12) :
+            (bus_bytes == 2) ?
+            _mm_setr_epi8(1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14) :
+            _mm_setr_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+    const __m128i nibble = _mm_set1_epi8(0x0f);
+    for (; i + 16 <= size; i += 16) {
+        __m128i val = _mm_loadu_si128((const __m128i *)&src[i]);
+        val = _mm_shuffle_epi8(val, order);
+        __m128i lo = _mm_and_si128(val, nibble);
+        __m128i hi = _mm_and_si128(_mm_srli_epi16(val, 4), nibble);
+        val = _mm_or_si128(_mm_shuffle_epi8(tab_hi, lo),
+                _mm_shuffle_epi8(tab_lo, hi));
+        _mm_storeu_si128((__m128i *)&dst[i], val);
+    }
+#elif defined(STREAM_NEON)
+    static const uint8_t tab_data[16] = {0x00, 0x04, 0x08, 0x0c, 0x01, 0x05,
+            0x09, 0x0d, 0x02, 0x06, 0x0a, 0x0e, 0x03, 0x07, 0x0b, 0x0f};
+    const uint8x16_t tab_lo = vld1q_u8(tab_data);
+    const uint8x16_t tab_hi = vshlq_n_u8(tab_lo, 4);
+    const uint8x16_t nibble = vdupq_n_u8(0x0f);
+    for (; i + 16 <= size; i += 16) {
+        uint8x16_t val = vld1q_u8(&src[i]);
+        if (bus_bytes == 4)
+            val = vrev32q_u8(val);
+        else if (bus_bytes == 2)
+            val = vrev16q_u8(val);
+        uint8x16_t lo = vandq_u8(val, nibble);
+        uint8x16_t hi = vshrq_n_u8(val, 4);
+        val = vorrq_u8(vqtbl1q_u8(tab_hi, lo), vqtbl1q_u8(tab_lo, hi));
+        vst1q_u8(&dst[i], val);
+    }
+#endif
+    stream_pack_scalar(&dst[i], &src[i], size - i, bus_bytes);
+}
+
+// Wait for a free slot, returns the frame number to write
+static uint32_t stream_wait_slot(stream_t *stream) {
+    stream_ring_t *ring = stream->ring;
+    uint32_t head = ring->head;
+    bool ready = false;
+    while (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) >=
+            ring->slots) {
+        if (stream->is_file) {
+            __atomic_store_n(&ring->tail, head - ring->slots + 1,
+                    __ATOMIC_RELEASE);
+            break;
+        }
+        // Not every driver blocks in poll
+        if (ready)
+            usleep(1000);
+        struct pollfd pfd = { .fd = stream->fd, .events = POLLOUT };
+        ready = poll(&pfd, 1, STREAM_POLL_TIMEOUT) > 0;
+    }
+    return head;
+}
+
+static void stream_pack_frame(stream_t *stream, const uint8_t *buffer) {
+    stream_config_t *config = &stream->config;
+    stream_ring_t *ring = stream->ring;
+    uint32_t head = stream_wait_slot(stream);
+    uint8_t *wrptr = stream->map + ring->data_offset +
+            (size_t)(head % ring->slots) * ring->slot_size;
+
+    if (config->frame_marker) {
+        stream_frame_marker_t marker = {
+            .magic = STREAM_FRAME_MAGIC,
+            .sequence = stream->sequence,
+            .width = config->width,
+            .height = config->height,
+            .bus_bits = config->bus_bits,
+            .flags = ring->flags
+        };
+        memcpy(wrptr, &marker, sizeof(marker));
+        wrptr += sizeof(marker);
+    }
+    for (int y = 0; y < config->height; y++) {
+        if (config->line_marker) {
+            stream_line_marker_t marker = {
+                .magic = STREAM_LINE_MAGIC,
+                .line = y
+            };
+            memcpy(wrptr, &marker, sizeof(marker));
+            wrptr += sizeof(marker);
+        }
+        stream_pack(wrptr, &buffer[y * stream->row_bytes], stream->row_bytes,
+                config->bus_bits, config->msb_first);
+        wrptr += stream->row_bytes;
+    }
+    stream->sequence++;
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+static void *stream_thread(void *arg) {
+    stream_t *stream = arg;
+    int index = 0;
+    pthread_mutex_lock(&stream->lock);
+    while (1) {
+        while (!stream->full[index] && !stream->quit)
+            pthread_cond_wait(&stream->cond, &stream->lock);
+        if (!stream->full[index])
+            break;
+        pthread_mutex_unlock(&stream->lock);
+
+        stream_pack_frame(stream, stream->buffers[index]);
+
+        pthread_mutex_lock(&stream->lock);
+        stream->full[index] = false;
+        pthread_cond_broadcast(&stream->cond);
+        index ^= 1;
+    }
+    pthread_mutex_unlock(&stream->lock);
+    return NULL;
+}
+
+// Open the device node, or create the file, and map the ring from it. Width
+// has to be a multiple of the pixels in a bus word.
+stream_t *stream_open(const char *path, const stream_config_t *config) {
+    int bus_bits = config->bus_bits;
+    if ((bus_bits != 8) && (bus_bits != 16) && (bus_bits != 32))
+        return NULL;
+    if ((config->width <= 0) || (config->width % (bus_bits / 2)) ||
+            (config->height <= 0) || (config->height > UINT16_MAX) ||
+            (config->width > UINT16_MAX) || (config->slots <= 0))
+        return NULL;
+
+    stream_t *stream = calloc(1, sizeof(stream_t));
+    if (!stream)
+        return NULL;
+    stream->config = *config;
+    stream->row_bytes = config->width / 4;
+    stream->buffer_size = stream->row_bytes * config->height;
+    size_t frame_size = stream->buffer_size;
+    if (config->frame_marker)
+        frame_size += sizeof(stream_frame_marker_t);
+    if (config->line_marker)
+        frame_size += sizeof(stream_line_marker_t) * config->height;
+    size_t slot_size = stream_align(frame_size);
+    size_t data_offset = stream_align(sizeof(stream_ring_t));
+    stream->map_size = data_offset + slot_size * config->slots;
+
+    stream->fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (stream->fd < 0) {
+        fprintf(stderr, "Failed to open %s\n", path);
+        free(stream);
+        return NULL;
+    }
+    struct stat st;
+    fstat(stream->fd, &st);
+    stream->is_file = S_ISREG(st.st_mode);
+    if (stream->is_file && (ftruncate(stream->fd, stream->map_size) != 0)) {
+        fprintf(stderr, "Failed to resize %s\n", path);
+        close(stream->fd);
+        free(stream);
+        return NULL;
+    }
+    stream->map = mmap(NULL, stream->map_size, PROT_READ | PROT_WRITE,
+            MAP_SHARED, stream->fd, 0);
+    if (stream->map == MAP_FAILED) {
+        fprintf(stderr, "Failed to map %s\n", path);
+        close(stream->fd);
+        free(stream);
+        return NULL;
+    }
+
+    stream_ring_t *ring = (stream_ring_t *)stream->map;
+    stream->ring = ring;
+    ring->version = STREAM_VERSION;
+    ring->slots = config->slots;
+    ring->slot_size = slot_size;
+    ring->frame_size = frame_size;
+    ring->data_offset = data_offset;
+    ring->width = config->width;
+    ring->height = config->height;
+    ring->bus_bits = bus_bits;
+    ring->flags = (config->msb_first ? STREAM_FLAG_MSB_FIRST : 0) |
+            (config->frame_marker ? STREAM_FLAG_FRAME_MARKER : 0) |
+            (config->line_marker ? STREAM_FLAG_LINE_MARKER : 0);
+    ring->head = 0;
+    ring->tail = 0;
+    __atomic_store_n(&ring->magic, STREAM_RING_MAGIC, __ATOMIC_RELEASE);
+
+    pthread_mutex_init(&stream->lock, NULL);
+    pthread_cond_init(&stream->cond, NULL);
+    stream->buffers[0] = malloc(stream->buffer_size);
+    stream->buffers[1] = malloc(stream->buffer_size);
+    if (!stream->buffers[0] || !stream->buffers[1] ||
+            (pthread_create(&stream->thread, NULL, stream_thread, stream) != 0)) {
+        free(stream->buffers[0]);
+        free(stream->buffers[1]);
+        pthread_mutex_destroy(&stream->lock);
+        pthread_cond_destroy(&stream->cond);
+        munmap(stream->map, stream->map_size);
+        close(stream->fd);
+        free(stream);
+        return NULL;
+    }
+    return stream;
+}
+
+// Packs what's still submitted before closing
+void stream_close(stream_t *stream) {
+    pthread_mutex_lock(&stream->lock);
+    stream->quit = true;
+    pthread_cond_broadcast(&stream->cond);
+    pthread_mutex_unlock(&stream->lock);
+    pthread_join(stream->thread, NULL);
+    free(stream->buffers[0]);
+    free(stream->buffers[1]);
+    pthread_mutex_destroy(&stream->lock);
+    pthread_cond_destroy(&stream->cond);
+    munmap(stream->map, stream->map_size);
+    close(stream->fd);
+    free(stream);
+}
+
+// Buffer for the drive values of the next frame, in the engine output
+// layout. Changes with every submit.
+uint8_t *stream_buffer(stream_t *stream) {
+    return stream->buffers[stream->current];
+}
+
+// Hand the buffer over to be packed, waiting for the other one to be free
+void stream_submit(stream_t *stream) {
+    pthread_mutex_lock(&stream->lock);
+    stream->full[stream->current] = true;
+    pthread_cond_broadcast(&stream->cond);
+    stream->current ^= 1;
+    while (stream->full[stream->current])
+        pthread_cond_wait(&stream->cond, &stream->lock);
+    pthread_mutex_unlock(&stream->lock);
+}
+
+// Wait for every submitted frame to be in the ring
+void stream_flush(stream_t *stream) {
+    pthread_mutex_lock(&stream->lock);
+    while (stream->full[0] || stream->full[1])
+        pthread_cond_wait(&stream->cond, &stream->lock);
+    pthread_mutex_unlock(&stream->lock);
+}
+
+const stream_ring_t *stream_ring(const stream_t *stream) {
+    return stream->ring;
+}
@@ -0,0 +1,89 @@
+// Eink software waveform engine FPGA frame stream
+// Copyright 2024 Wenting Zhang
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+// 
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+// Magic numbers of the markers in the stream
+#define STREAM_RING_MAGIC   (0x474e5257) // "WRNG"
+#define STREAM_FRAME_MAGIC  (0x46445045) // "EPDF"
+#define STREAM_LINE_MAGIC   (0x4c45) // "EL"
+
+typedef struct {
+    int width;
+    int height;
+    int bus_bits; // Bits per clock on the FPGA side, 8, 16 or 32
+    bool msb_first; // First pixel of a bus word in its highest bits
+    bool frame_marker;
+    bool line_marker;
+    int slots; // Frames the ring holds
+} stream_config_t;
+
+// Shared with the consumer, at the start of the mapping. Slots follow it at
+// data_offset, slot_size apart. Frame n is in slot n % slots.
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t slots;
+    uint32_t slot_size;
+    uint32_t frame_size; // Bytes used of each slot
+    uint32_t data_offset;
+    uint16_t width;
+    uint16_t height;
+    uint8_t bus_bits;
+    uint8_t flags;
+    uint16_t reserved;
+    volatile uint32_t head; // Frames written, advanced by the host
+    volatile uint32_t tail; // Frames consumed, advanced by the consumer
+} stream_ring_t;
+
+#define STREAM_FLAG_MSB_FIRST       (0x01)
+#define STREAM_FLAG_FRAME_MARKER    (0x02)
+#define STREAM_FLAG_LINE_MARKER     (0x04)
+
+typedef struct {
+    uint32_t magic;
+    uint32_t sequence;
+    uint16_t width;
+    uint16_t height;
+    uint8_t bus_bits;
+    uint8_t flags;
+    uint16_t reserved;
+} stream_frame_marker_t;
+
+typedef struct {
+    uint16_t magic;
+    uint16_t line;
+} stream_line_marker_t;
+
+typedef struct stream stream_t;
+
+stream_t *stream_open(const char *path, const stream_config_t *config);
+void stream_close(stream_t *stream);
+uint8_t *stream_buffer(stream_t *stream);
+void stream_submit(stream_t *stream);
+void stream_flush(stream_t *stream);
+const stream_ring_t *stream_ring(const stream_t *stream);
+void stream_pack(uint8_t *dst, const uint8_t *src, size_t size, int bus_bits,
+        bool msb_first);